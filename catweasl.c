@@ -24,6 +24,7 @@
 #define CHECK_DISK_CHANGED 0  /* older drives don't provide this signal */
 
 #include "cwfloppy.h"
+#include "cwsim.h"
 #include "firmware.h"
 
 #include <sys/time.h>
@@ -35,6 +36,8 @@
 #include <errno.h>
 #if linux
 #include <sys/io.h>
+#include <sys/mman.h>
+#include <pthread.h>
 #endif
 #if __DJGPP__
 #include <pc.h>
@@ -66,9 +69,86 @@ void OUTB(unsigned char b, unsigned short port)
 #define outb OUTB
 #endif /*DEBUG*/
 
+/* Send port I/O to the simulator instead if it's in use */
+static unsigned char
+SIMINB(unsigned short port)
+{
+    return cwsim_on ? cwsim_inb(port) : inb(port);
+}
+static void
+SIMOUTB(unsigned char b, unsigned short port)
+{
+    if (cwsim_on) {
+	cwsim_outb(b, port);
+    } else {
+	outb(b, port);
+    }
+}
+#undef inb
+#undef outb
+#define inb SIMINB
+#define outb SIMOUTB
+
+/* String I/O: read/write n bytes from/to one port */
+static void
+INSB(unsigned short port, unsigned char *buf, int n)
+{
+#if !DEBUG10 && __DJGPP__
+    if (!cwsim_on) {
+	inportsb(port, buf, n);
+	return;
+    }
+#elif !DEBUG10 && linux
+    if (!cwsim_on) {
+	insb(port, buf, n);
+	return;
+    }
+#endif
+    while (n--) {
+	*buf++ = inb(port);
+    }
+}
+static void
+OUTSB(unsigned short port, const unsigned char *buf, int n)
+{
+#if !DEBUG10 && __DJGPP__
+    if (!cwsim_on) {
+	outportsb(port, buf, n);
+	return;
+    }
+#elif !DEBUG10 && linux
+    if (!cwsim_on) {
+	outsb(port, buf, n);
+	return;
+    }
+#endif
+    while (n--) {
+	outb(*buf++, port);
+    }
+}
+
+long long
+catweasel_clock_us(void)
+{
+    if (cwsim_on) {
+	return cwsim_clock_us();
+    }
+#if __DJGPP__
+  return (long long) uclock() * 1000000LL / UCLOCKS_PER_SEC;
+#else
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (long long) ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+#endif
+}
+
 unsigned int
 catweasel_usleep(unsigned int _useconds)
 {
+  if (cwsim_on) {
+    cwsim_usleep(_useconds);
+    return 0;
+  }
 #if __DJGPP__
   /* DJGPP's usleep is based on a clock with a 55 ms granularity, so
      it's not usable for short sleeps!  Fortunately DJGPP also makes
@@ -185,12 +265,18 @@ unsigned char Mk3ControlBit[] = {
     /* CatDensityOut */  1<<0,
 };
 
-#define MEMSIZE 131072
+#define MEMSIZE CW_MEMSIZE
+#define READ_CHUNK 512
+#define READ_POLL_US 500
 #define CREG(c) (c->private[0])
 #define PTR(c) (c->private[1])
 #define LASTSECTEND(c) (c->private[2])
+#define DATAEND(c) (c->private[3])  /* MK4: pointer at end of read, or -1 */
 #define INREG(c, name) inb((c)->iobase + (c)->reg[name])
+#define INSREG(c, name, buf, n) INSB((c)->iobase + (c)->reg[name], (buf), (n))
 #define OUTREG(c, name, val) outb((val), (c)->iobase + (c)->reg[name])
+#define OUTSREG(c, name, buf, n) \
+    OUTSB((c)->iobase + (c)->reg[name], (buf), (n))
 #define SBIT(c, name) ((c)->stat[name])
 #define CBIT(c, name) ((c)->ctrl[name])
 
@@ -235,26 +321,64 @@ CWReadPointer(catweasel_contr *c)
 /* Await particular bit value(s) in the control register.  Return 1 if
    it appears, 0 if 5 seconds pass and it doesn't.  Bits that are 1
    in "clear" must be 0; bits that are 1 in "set" must be 1; others
-   are don't-cares. */
+   are don't-cares.
+
+   If the caller knows the bits can't appear for a while, it passes
+   that time in sleep_us.  We sleep through most of it, checking
+   every AWAIT_SLICE_US, and spin only for the last AWAIT_GUARD_US,
+   so the edge is still seen as soon as it happens.  If sleep_us is
+   AWAIT_POLL, the caller doesn't care exactly when the bits appear,
+   so just check every AWAIT_SLICE_US without spinning at all. */
+#define AWAIT_TIMEOUT_US 5000000
+#define AWAIT_SLICE_US 1000
+#define AWAIT_GUARD_US 2000
+#define AWAIT_POLL -1
+
 int
-CWAwaitCReg(catweasel_contr *c, int clear, int set)
+CWAwaitCReg(catweasel_contr *c, int clear, int set, long sleep_us)
 {
-  int i;
-  struct timeval tv1, tv2;
+  int i, v;
+  long long start, now, then, wake;
+
+  start = now = catweasel_clock_us();
+  wake = start + sleep_us - AWAIT_GUARD_US;
+  while (sleep_us == AWAIT_POLL || now < wake) {
+      v = INREG(c, CatControl);
+      if ((v & clear) == 0 && (v & set) == set) return 1;
+      if (now - start > AWAIT_TIMEOUT_US) return 0;
+      catweasel_usleep((sleep_us == AWAIT_POLL || wake - now > AWAIT_SLICE_US)
+		       ? AWAIT_SLICE_US : wake - now);
+      then = catweasel_clock_us();
+      c->sleep_us += then - now;
+      now = then;
+  }
 
-  gettimeofday(&tv1, NULL);
   for (;;) {
       i = 1000000;
       while (i--) {
-	  int v = INREG(c, CatControl);
-	  if ((v & clear) == 0 && (v & set) == set) return 1;
+	  v = INREG(c, CatControl);
+	  if ((v & clear) == 0 && (v & set) == set) {
+	      c->spin_us += catweasel_clock_us() - now;
+	      return 1;
+	  }
       }
-      gettimeofday(&tv2, NULL);
-      if ((tv2.tv_sec - tv1.tv_sec)*1000000 + tv2.tv_usec - tv1.tv_usec
-	  > 5000000) return 0;
+      then = catweasel_clock_us();
+      c->spin_us += then - now;
+      now = then;
+      if (now - start > AWAIT_TIMEOUT_US) return 0;
   }
 }
 
+/* How long to sleep while awaiting the end of an index-to-index
+   operation: nearly a revolution, allowing for a drive running a few
+   percent fast and for a late start of the wait. */
+static long
+CWRevSleep(catweasel_contr *c)
+{
+    if (c->rev_us == 0) return 0;
+    return c->rev_us - c->rev_us / 20 - AWAIT_SLICE_US;
+}
+
 /* Trivial memory test.  Returns number of seemingly good bytes. */
 int
 catweasel_memtest(catweasel_contr *c)
@@ -353,6 +477,10 @@ catweasel_init_controller(catweasel_contr *c, int iobase, int mk, char *fwname,
     c->mk = mk;
     c->step_us = step_ms * 1000;
     c->settle_us = settle_ms * 1000;
+    c->rev_us = 0;
+    c->spin_us = 0;
+    c->sleep_us = 0;
+    c->shared = NULL;
 
     switch (mk) {
     case 1:
@@ -488,6 +616,7 @@ catweasel_init_controller(catweasel_contr *c, int iobase, int mk, char *fwname,
     }
 
     CREG(c) = 255;
+    DATAEND(c) = -1;
     catweasel_abort(c);
     return 1;
 }
@@ -668,6 +797,81 @@ catweasel_write_protected(catweasel_drive *d)
     return !(INREG(d->contr, CatControl) & SBIT(d->contr, CatWProtect));
 }
 
+/*
+ * Sharing a controller between processes.  The control register is
+ * write-only, so CREG is really a copy of it; each process keeps its
+ * own, and the one in the shared area is the real one.  A turn is
+ * holding the mutex.  It is robust, so if a process dies during its
+ * turn (killed, or crashed), the next one to ask gets the controller
+ * instead of every other process waiting forever.  Turns are not
+ * strictly in order, but a process always decodes what it read before
+ * asking again, which gives the others time to get in.
+ */
+#if linux
+struct cw_shared {
+    pthread_mutex_t mutex;
+    int creg;
+};
+#endif
+
+int
+catweasel_share(catweasel_contr *c)
+{
+#if linux
+    struct cw_shared *sh;
+    pthread_mutexattr_t ma;
+
+    sh = mmap(NULL, sizeof(*sh), PROT_READ | PROT_WRITE,
+	      MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (sh == MAP_FAILED) {
+	return 0;
+    }
+    pthread_mutexattr_init(&ma);
+    pthread_mutexattr_setpshared(&ma, PTHREAD_PROCESS_SHARED);
+    pthread_mutexattr_setrobust(&ma, PTHREAD_MUTEX_ROBUST);
+    if (pthread_mutex_init(&sh->mutex, &ma) != 0) {
+	munmap(sh, sizeof(*sh));
+	return 0;
+    }
+    sh->creg = CREG(c);
+    c->shared = sh;
+    return 1;
+#else
+    return 0;
+#endif
+}
+
+void
+catweasel_lock(catweasel_drive *d)
+{
+    catweasel_contr *c = d->contr;
+#if linux
+    struct cw_shared *sh = c->shared;
+
+    if (sh) {
+	if (pthread_mutex_lock(&sh->mutex) == EOWNERDEAD) {
+	    /* The last process died during its turn; carry on */
+	    pthread_mutex_consistent(&sh->mutex);
+	}
+	CREG(c) = sh->creg;
+    }
+#endif
+    catweasel_select(c, d->number == 0, d->number == 1);
+}
+
+void
+catweasel_unlock(catweasel_drive *d)
+{
+#if linux
+    struct cw_shared *sh = d->contr->shared;
+
+    if (sh) {
+	sh->creg = CREG(d->contr);
+	pthread_mutex_unlock(&sh->mutex);
+    }
+#endif
+}
+
 /* Select clock multiplier */
 static int
 CWEncodeClock(catweasel_contr *c, int multiplier)
@@ -688,22 +892,15 @@ CWEncodeClock(catweasel_contr *c, int multiplier)
     }
 }
 
-int
-catweasel_read(catweasel_drive *d, int side, int clockmult, int time, int idx)
+/* Common setup for a read: select side, clock, and index storage.
+   Return 0 if no disk. */
+static int
+CWReadSetup(catweasel_contr *c, int side, int clockmult, int idx)
 {
-    catweasel_contr *c = d->contr;
-
-    /* On MK3 and MK4, turning on index storage and requesting the
-     * index to index read instead does a read starting at the
-     * next MFM sync sequence!  Ugh. */
-    if (c->mk >= 3 && idx && time == 0) {
-        fprintf(stderr, "bug: MK%d can't index-to-index read with index store",
-		c->mk);
-    }
-
 #if CHECK_DISK_CHANGED
-    if (!CWAwaitCReg(c, 0, SBIT(c, CatDiskChange))) return 0;
+    if (!CWAwaitCReg(c, 0, SBIT(c, CatDiskChange), 0)) return 0;
 #endif
+    DATAEND(c) = -1;
 
     /* set disk side */
     CWSetCReg(c, CBIT(c, CatSideSelect), (!side) ? CBIT(c, CatSideSelect) : 0);
@@ -722,25 +919,18 @@ catweasel_read(catweasel_drive *d, int side, int clockmult, int time, int idx)
     }
 
     catweasel_reset_pointer(c);
-    if (time <= 0) {
-	/* read index hole to index hole */
-	INREG(c, CatStartB);
-	/* wait for read to start */
-	if (!CWAwaitCReg(c, SBIT(c, CatReading), 0)) return 0;
-	/* wait for read to end */
-	if (!CWAwaitCReg(c, 0, SBIT(c, CatReading))) return 0;
-    } else {
-	/* start reading immediately */
-	INREG(c, CatStartA);
-	/* wait the prescribed time */
-	catweasel_usleep(time*1000);
-	/* stop reading, don't reset pointer */
-	catweasel_abort(c);
-    }
+    return 1;
+}
 
+/* Common end of a read: add the end mark and leave the pointer at
+   the first sample */
+static void
+CWReadEnd(catweasel_contr *c)
+{
     if (c->mk >= 4) {
 	/* add data end mark if there is room */
-	if (CWReadPointer(c) <= MEMSIZE - 2) {
+	DATAEND(c) = CWReadPointer(c);
+	if (DATAEND(c) <= MEMSIZE - 2) {
 	    OUTREG(c, CatMem, 0x80);
 	    OUTREG(c, CatMem, 0x00);
 	}
@@ -758,7 +948,86 @@ catweasel_read(catweasel_drive *d, int side, int clockmult, int time, int idx)
 	INREG(c, CatMem);
 	INREG(c, CatMem);
     }
+}
+
+int
+catweasel_read(catweasel_drive *d, int side, int clockmult, int time, int idx)
+{
+    catweasel_contr *c = d->contr;
+
+    /* On MK3 and MK4, turning on index storage and requesting the
+     * index to index read instead does a read starting at the
+     * next MFM sync sequence!  Ugh. */
+    if (c->mk >= 3 && idx && time == 0) {
+        fprintf(stderr, "bug: MK%d can't index-to-index read with index store",
+		c->mk);
+    }
+
+    if (!CWReadSetup(c, side, clockmult, idx)) return 0;
+    if (time <= 0) {
+	/* read index hole to index hole */
+	INREG(c, CatStartB);
+	/* wait for read to start */
+	if (!CWAwaitCReg(c, SBIT(c, CatReading), 0, AWAIT_POLL)) return 0;
+	/* wait for read to end */
+	if (!CWAwaitCReg(c, 0, SBIT(c, CatReading), CWRevSleep(c))) return 0;
+    } else {
+	/* start reading immediately */
+	INREG(c, CatStartA);
+	/* wait the prescribed time */
+	catweasel_usleep(time*1000);
+	/* stop reading, don't reset pointer */
+	catweasel_abort(c);
+    }
 
+    CWReadEnd(c);
+    return 1;
+}
+
+int
+catweasel_read_revs(catweasel_drive *d, int side, int clockmult, int time,
+		    int idx, int revs, int mintime, int tail)
+{
+    catweasel_contr *c = d->contr;
+    long long start, now, lastindex = 0;
+    int nindex = 0, index, oldindex;
+
+    if (c->mk < 4) {
+	return catweasel_read(d, side, clockmult, time, idx);
+    }
+
+    if (!CWReadSetup(c, side, clockmult, idx)) return 0;
+
+    /* start reading immediately */
+    INREG(c, CatStartA);
+    start = catweasel_clock_us();
+    oldindex = INREG(c, CatControl) & SBIT(c, CatIndex);
+
+    /* Watch the index sensor and the memory pointer while the read
+       runs.  The pulse is a few ms wide, so polling this often can't
+       miss it; if it somehow does, we just read for the full time.
+       The samples can't be looked at until the read ends, as reading
+       CatMem would move the pointer the card is storing through, so
+       there is no stopping early once enough sectors have been seen. */
+    for (;;) {
+	catweasel_usleep(READ_POLL_US);
+	index = INREG(c, CatControl) & SBIT(c, CatIndex);
+	now = catweasel_clock_us();
+	if (oldindex && !index) {
+	    nindex++;
+	    lastindex = now;
+	}
+	oldindex = index;
+	if (now - start >= time * 1000LL) break;
+	if (nindex >= revs && now - start >= mintime * 1000LL &&
+	    now - lastindex >= tail * 1000LL) break;
+	if (CWReadPointer(c) >= MEMSIZE - 2) break;
+    }
+
+    /* stop reading, don't reset pointer */
+    catweasel_abort(c);
+
+    CWReadEnd(c);
     return 1;
 }
 
@@ -772,7 +1041,7 @@ catweasel_write(catweasel_drive *d, int side, int clockmult, int time)
 #endif
 
 #if CHECK_DISK_CHANGED
-    if (!CWAwaitCReg(c, 0, SBIT(c, CatDiskChange))) return 0;
+    if (!CWAwaitCReg(c, 0, SBIT(c, CatDiskChange), 0)) return 0;
 #endif
 
     /* set disk side */
@@ -798,9 +1067,9 @@ catweasel_write(catweasel_drive *d, int side, int clockmult, int time)
 	/* write from index hole to index hole */
 	OUTREG(c, CatStartA, 0);
 	/* wait for write to start */
-	if (!CWAwaitCReg(c, SBIT(c, CatWriting), 0)) return 0;
+	if (!CWAwaitCReg(c, SBIT(c, CatWriting), 0, AWAIT_POLL)) return 0;
 	/* wait for write to end */
-	if (!CWAwaitCReg(c, 0, SBIT(c, CatWriting))) return 0;
+	if (!CWAwaitCReg(c, 0, SBIT(c, CatWriting), CWRevSleep(c))) return 0;
     } else {
 	/* start writing immediately */
 	OUTREG(c, CatStartB, 0);
@@ -828,10 +1097,10 @@ int catweasel_await_index(catweasel_drive *d)
 {
     catweasel_contr *c = d->contr;
 #if CHECK_DISK_CHANGED
-    if (!CWAwaitCReg(c, 0, SBIT(c, CatDiskChange))) return 0;
+    if (!CWAwaitCReg(c, 0, SBIT(c, CatDiskChange), 0)) return 0;
 #endif
-    if (!CWAwaitCReg(c, 0, SBIT(c, CatIndex))) return 0;
-    if (!CWAwaitCReg(c, SBIT(c, CatIndex), 0)) return 0;
+    if (!CWAwaitCReg(c, 0, SBIT(c, CatIndex), 0)) return 0;
+    if (!CWAwaitCReg(c, SBIT(c, CatIndex), 0, 0)) return 0;
     return 1;
 }
 
@@ -859,6 +1128,34 @@ int catweasel_get_byte(catweasel_contr *c)
     return INREG(c, CatMem);
 }
 
+int catweasel_read_block(catweasel_contr *c, unsigned char *buf, int maxlen)
+{
+    int n = 0, len, i;
+
+    while (n < maxlen && PTR(c) < MEMSIZE) {
+	len = MEMSIZE - PTR(c);
+	if (DATAEND(c) + 2 > PTR(c) && DATAEND(c) + 2 - PTR(c) < len) {
+	    /* MK4: we know where the data ends; get it and the end mark */
+	    len = DATAEND(c) + 2 - PTR(c);
+	} else if (len > READ_CHUNK) {
+	    /* Don't overshoot the end mark by too much */
+	    len = READ_CHUNK;
+	}
+	if (len > maxlen - n) {
+	    len = maxlen - n;
+	}
+	INSREG(c, CatMem, buf + n, len);
+	PTR(c) += len;
+	for (i = n; i < n + len; i++) {
+	    if (buf[i] == 0x00 && i > 0 && buf[i-1] == 0x80) {
+		return i;
+	    }
+	}
+	n += len;
+    }
+    return n;
+}
+
 int catweasel_put_byte(catweasel_contr *c, unsigned char val)
 {
     if (PTR(c) >= MEMSIZE) {
@@ -876,6 +1173,28 @@ int catweasel_put_byte(catweasel_contr *c, unsigned char val)
     return 0;
 }
 
+int catweasel_write_block(catweasel_contr *c, const unsigned char *buf,
+			  int len, int sectend)
+{
+    int res = 0;
+
+    catweasel_reset_pointer(c);
+    if (len > MEMSIZE) {
+	len = MEMSIZE;
+	res = -1;
+    }
+    OUTSREG(c, CatMem, buf, len);
+    PTR(c) = len;
+    LASTSECTEND(c) = sectend;
+#if DEBUG13
+    printf("@%d ", LASTSECTEND(c));
+#endif
+    if (sectend >= MEMSIZE) {
+	res = -1;
+    }
+    return res;
+}
+
 int catweasel_sector_end(catweasel_contr *c)
 {
     LASTSECTEND(c) = PTR(c);
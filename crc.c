@@ -2,8 +2,9 @@
    Compute CCITT CRC-16 using the correct bit order for floppy disks.
 */
 
-/* Accelerator table to compute the CRC eight bits at a time */
-unsigned short const crc16_table[256] = {
+#include "crc.h"
+
+unsigned short const cw2dmk_crc16_table[256] = {
   0x0000, 0x1021, 0x2042, 0x3063, 0x4084, 0x50A5, 0x60C6, 0x70E7,
   0x8108, 0x9129, 0xA14A, 0xB16B, 0xC18C, 0xD1AD, 0xE1CE, 0xF1EF,
   0x1231, 0x0210, 0x3273, 0x2252, 0x52B5, 0x4294, 0x72F7, 0x62D6,
@@ -39,7 +40,7 @@ unsigned short const crc16_table[256] = {
 };
 
 /* Slow way, not using table */
-unsigned short CALC_CRC1a(unsigned short crc, unsigned char byte)
+unsigned short cw2dmk_calc_crc1a(unsigned short crc, unsigned char byte)
 {
   int i = 8;
   unsigned short b = byte << 8;
@@ -50,16 +51,9 @@ unsigned short CALC_CRC1a(unsigned short crc, unsigned char byte)
   return crc;
 }
 
-/* Fast way, using table */
-#define CALC_CRC1b(crc, c) (((crc) << 8) ^ crc16_table[((crc) >> 8) ^ (c)])
-
-#ifndef calc_crc1
-#define calc_crc1 CALC_CRC1b
-#endif
-
 /* Recompute the CRC with len bytes appended. */
-unsigned short calc_crc(unsigned short crc,
-			unsigned char const *buf, int len)
+unsigned short cw2dmk_calc_crc(unsigned short crc,
+			       unsigned char const *buf, int len)
 {
   while (len--) {
     crc = calc_crc1(crc, *buf++);
@@ -94,7 +88,7 @@ main(int argc, char **argv)
     if (res != 1) break;
     buf[count++] = c;
   }
-  printf("\n%04x\n", calc_crc(preset, buf, count));
+  printf("\n%04x\n", cw2dmk_calc_crc(preset, buf, count));
   return 0;
 }
 #endif
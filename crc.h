@@ -0,0 +1,26 @@
+/* crc.h
+   Compute CCITT CRC-16 using the correct bit order for floppy disks.
+*/
+
+#ifndef _CRC_H
+#define _CRC_H
+
+/* Accelerator table to compute the CRC eight bits at a time */
+extern unsigned short const cw2dmk_crc16_table[256];
+
+/* Slow way, not using table */
+unsigned short cw2dmk_calc_crc1a(unsigned short crc, unsigned char byte);
+
+/* Fast way, using table */
+#define CALC_CRC1b(crc, c) \
+  (((crc) << 8) ^ cw2dmk_crc16_table[((crc) >> 8) ^ (c)])
+
+#ifndef calc_crc1
+#define calc_crc1 CALC_CRC1b
+#endif
+
+/* Recompute the CRC with len bytes appended. */
+unsigned short cw2dmk_calc_crc(unsigned short crc,
+			       unsigned char const *buf, int len);
+
+#endif /* _CRC_H */
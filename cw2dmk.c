@@ -38,40 +38,53 @@
 #endif
 #if linux
 #include <sys/io.h>
+#include <pthread.h>
+#include <poll.h>
+#include <sys/wait.h>
+#define HAVE_PIPELINE 1
+#define HAVE_POOL 1
+#define HAVE_MULTI 1
 #endif
-#include "crc.c"
 #include "cwfloppy.h"
 #include "dmk.h"
+#include "decoder.h"
 #include "kind.h"
 #include "cwpci.h"
+#include "cwsim.h"
 #include "version.h"
 #include "parselog.h"
+#include "cwraw.h"
+#include "flux.h"
 
 struct catweasel_contr c;
 
+/* Imaging several drives at once; see run_drives */
+#define MAX_DRIVES (2 * MK3_MAX_CARDS)
+int ndrives = 1;
+int drv_card[MAX_DRIVES];   /* card index, or -1 for the -p card */
+int drv_unit[MAX_DRIVES];
+int card_port[MK3_MAX_CARDS];
+int card_mk[MK3_MAX_CARDS];
+struct catweasel_contr cards[MK3_MAX_CARDS];
+
+pid_t workers[MAX_DRIVES];
+int jobs = 0;               /* decoding threads (-J); 0 = one per CPU */
+
 dmk_header_t dmk_header;
-unsigned char* dmk_track = NULL;
-unsigned char* dmk_merged_track = NULL;
-int dmk_merged_track_len;
-unsigned char* dmk_tmp_track = NULL;
 FILE *dmk_file;
+char *raw_name = NULL;     /* raw capture file (-F) */
+cwraw_file *raw_file = NULL;
+int raw_compress = 0;      /* zlib level for raw_file (-Z) */
+char *scp_name = NULL;     /* SCP flux image (-E) */
+scp_file *scp_out = NULL;
+char *trace_name = NULL;   /* decoder event trace (-B) */
+struct trace *trace_out = NULL;
+flux_file *flux_replay = NULL;  /* replaying another drive's flux image */
+int flux_tracks;
 
 #define COUNT_OF(x) ((sizeof(x)/sizeof(0[x])) / \
 			((size_t)(!(sizeof(x) % sizeof(0[x])))))
 
-/* Constants and globals for decoding */
-#define FM 1
-#define MFM 2
-#define RX02 3
-#define MIXED 0
-#define N_ENCS 4
-char *enc_name[] = { "autodetect", "FM", "MFM", "RX02" };
-int enc_count[N_ENCS];
-int enc_sec[DMK_TKHDR_SIZE / 2];
-int total_enc_count[N_ENCS];
-
-#include "secsize.c"
-
 /* Max sectors per track.  Taken from DMK limit. */
 #define MAX_SECTORS 64
 
@@ -83,28 +96,12 @@ int total_enc_count[N_ENCS];
    drive.  However, many drives can't step that far. */
 #define TRACKS_GUESS MAX_TRACKS
 
-/* Suppress FM address mark detection for a few bit times after each
-   data CRC is seen.  Helps prevent seeing bogus marks in write
-   splices. */
-#define WRITE_SPLICE 32
-
 #define RETRIES_DEFAULT	4
 
-struct TrackStat {
-	int errcount;
-	int good_sectors;
-	int reused_sectors;
-	int enc_count[N_ENCS];
-	int enc_sec[DMK_TKHDR_SIZE / 2];
-};
-
-struct TrackStat merged_stat;
+struct decoder *dec;
 
 int kind = -1;
 int maxsize = 3;  /* 177x/179x look at only low-order 2 bits */
-unsigned long long accum, taccum;
-int bits;
-int ibyte, dbyte, ebyte;
 int cwclock = -1;
 int fmthresh = -1;
 int mfmthresh1 = -1;
@@ -113,25 +110,19 @@ int dmktracklen = -1;
 float mfmshort = -1.0;
 float postcomp = 0.5;
 int check_compat_sides = 1;
-unsigned short crc;
-int sizecode;
-unsigned char premark;
-int mark_after;
-int write_splice; /* bit counter, >0 if we may be in a write splice */
-int errcount;
-int good_sectors;
-int reused_sectors;
 int total_errcount;
 int total_retries;
 int total_good_sectors;
+int total_enc_count[N_ENCS];
 int good_tracks;
 int err_tracks;
-int index_edge;
+unsigned char sample_buf[2][CW_MEMSIZE];
+unsigned char *samples = sample_buf[0];  /* raw samples of current read */
+int nsamples;
+int pipeline = 0;
 int fmtimes = 2; /* record FM bytes twice; see man page */
 int hole = 1;
-int backward_am, flippy = 0;
-int first_encoding;  /* first encoding to try on next track */
-int curenc;
+int flippy = 0;
 int uencoding = MIXED;
 int reverse = 0;
 int accum_sectors = 0;
@@ -148,15 +139,6 @@ char* plu(int val)
   return (val == 1) ? "" : "s";
 }
 
-/* Note: out_level values are used in usage message and on command line */
-#define OUT_QUIET 0
-#define OUT_SUMMARY 1
-#define OUT_TSUMMARY 2
-#define OUT_ERRORS 3
-#define OUT_IDS 4
-#define OUT_HEX 5
-#define OUT_RAW 6
-#define OUT_SAMPLES 7
 int out_level = OUT_TSUMMARY;
 int out_file_level = OUT_QUIET;
 char *out_file_name;
@@ -164,14 +146,8 @@ FILE* out_file;
 
 /* DMK stuff */
 
-unsigned short* dmk_idam_p;
-unsigned char* dmk_data_p;
-int dmk_valid_id, dmk_awaiting_dam, dmk_awaiting_iam;
 int dmk_iam_pos = -1;
 int dmk_ignore = 0;
-int dmk_ignored;
-int dmk_full;
-int cylseen = -1;
 int prevcylseen;
 
 
@@ -184,6 +160,9 @@ void fatal_msg(int exit_code, const char *fmt, ...)
 					  __attribute__((format(printf,2,3)))
 					  __attribute__((noreturn));
 
+void vmsg(int level, const char *fmt, va_list ap)
+					  __attribute__((format(printf,2,0)));
+
 void msg(int level, const char *fmt, ...) __attribute__((format(printf,2,3)));
 #endif
 
@@ -229,192 +208,43 @@ fatal_msg(int exit_code, const char *fmt, ...)
 
 /* Log a message. */
 void
-msg(int level, const char *fmt, ...)
+vmsg(int level, const char *fmt, va_list ap)
 {
   va_list args;
 
   if (level <= out_level &&
       !(level == OUT_RAW && out_level != OUT_RAW) &&
       !(level == OUT_HEX && out_level == OUT_RAW)) {
-    va_start(args, fmt);
+    va_copy(args, ap);
     vfprintf(stdout, fmt, args);
     va_end(args);
   }
   if (out_file && level <= out_file_level &&
       !(level == OUT_RAW && out_file_level != OUT_RAW) &&
       !(level == OUT_HEX && out_file_level == OUT_RAW)) {
-    va_start(args, fmt);
+    va_copy(args, ap);
     vfprintf(out_file, fmt, args);
     va_end(args);
   }
 }
 
 
-/* True if we are ignoring data while waiting for an iam or for the
-   first idam */
-int
-dmk_awaiting_track_start(void)
-{
-  if (dmk_iam_pos == -1) {
-    return !hole && (unsigned char*) dmk_idam_p == dmk_track;
-  } else {
-    return dmk_awaiting_iam;
-  }
-}
-
-
-int
-dmk_in_range(void)
-{
-  if (dmk_full) return 0;
-  if (dmk_ignored < dmk_ignore) {
-    dmk_ignored++;
-    return 0;
-  }
-  /* Stop at leading edge of last index unless in sector data. */
-  if (hole && index_edge >= 3 && dbyte == -1 && ebyte == -1) {
-    msg(OUT_HEX, "[index edge %d] ", index_edge);
-    dmk_full = 1;
-    return 0;
-  }
-  return 1;
-}
-
-
 void
-dmk_data(unsigned char byte, int encoding)
-{
-  if (!dmk_in_range()) return;
-  if (dmk_awaiting_dam && byte >= 0xf8 && byte <= 0xfd) {
-    /* Kludge: DMK doesn't tag DAMs, so noise after the ID bytes
-       but before the DAM must not have the data bit pattern of a DAM */
-    byte = 0xf0;
-  }
-  if (dmk_data_p - dmk_track <= dmk_header.tracklen - 2) {
-    *dmk_data_p++ = byte;
-    if (encoding == FM && !(dmk_header.options & DMK_SDEN_OPT)) {
-      *dmk_data_p++ = byte;
-    }
-  }
-  if (dmk_data_p - dmk_track > dmk_header.tracklen - 2) {
-    /* No room for more bytes after this one */
-    msg(OUT_HEX, "[DMK track buffer full] ");
-    dmk_full = 1;
-  }
-}
-
-
-void
-dmk_idam(unsigned char byte, int encoding)
+msg(int level, const char *fmt, ...)
 {
-  unsigned short idamp;
-  if (!dmk_in_range()) return;
-
-  if (!dmk_awaiting_iam && dmk_awaiting_track_start()) {
-    /* In this mode, we position the first IDAM a nominal distance
-       from the start of the track, to make sure that (1) the whole
-       track will fit and (2) if dmk2cw is used to write the image
-       back to a real disk, the first IDAM won't be too close to the
-       index hole.  */
-#define GAP1PLUS 48
-    int bytesread = dmk_data_p - (dmk_track + DMK_TKHDR_SIZE);
-    if (bytesread < GAP1PLUS) {
-      /* Not enough bytes read yet.  Move read bytes forward and add fill. */
-      memmove(dmk_track + DMK_TKHDR_SIZE + GAP1PLUS - bytesread,
-	      dmk_track + DMK_TKHDR_SIZE,
-	      bytesread);
-      memset(dmk_track + DMK_TKHDR_SIZE,
-	     (encoding == MFM) ? 0x4e : 0xff,
-	     GAP1PLUS - bytesread);
-    } else {
-      /* Too many bytes read.  Move last GAP1PLUS back and throw rest away. */
-      memmove(dmk_track + DMK_TKHDR_SIZE,
-	      dmk_track + DMK_TKHDR_SIZE + bytesread - GAP1PLUS,
-	      GAP1PLUS);
-    }
-    dmk_data_p = dmk_track + DMK_TKHDR_SIZE + GAP1PLUS;
-  }
+  va_list args;
 
-  dmk_awaiting_dam = 0;
-  dmk_valid_id = 0;
-  idamp = dmk_data_p - dmk_track;
-  if (encoding == MFM) {
-    idamp |= DMK_DDEN_FLAG;
-  }
-  if (dmk_data_p < dmk_track + dmk_header.tracklen) {
-    if ((unsigned char*) dmk_idam_p >= dmk_track + DMK_TKHDR_SIZE) {
-      msg(OUT_ERRORS, "[too many AMs on track] ");
-      errcount++;
-    } else {
-      if (accum_sectors) {
-        /* Initially set enc_sec[] for this sector to the current
-         * encoding.  However, if the disk is RX02 format and the
-         * sector is double density, then the current encoding is FM,
-         * but the sector data encoding is RX02.  In this case enc_sec
-         * will be updated after we read the DAM to detect the sector
-         * data encoding.
-         */
-	enc_sec[(dmk_idam_p - (unsigned short *)dmk_track)] = encoding;
-      }
-      *dmk_idam_p++ = idamp;
-      ibyte = 0;
-      dmk_data(byte, encoding);
-    }
-  }
+  va_start(args, fmt);
+  vmsg(level, fmt, args);
+  va_end(args);
 }
 
 
+/* Log a message from the decoder */
 void
-dmk_iam(unsigned char byte, int encoding)
+decoder_msg(void *arg, int level, const char *fmt, va_list ap)
 {
-  if (!dmk_in_range()) return;
-
-  if (dmk_iam_pos >= 0) {
-    /* If the user told us where to position the IAM...*/
-    int bytesread = dmk_data_p - (dmk_track + DMK_TKHDR_SIZE);
-    if (dmk_awaiting_iam || (unsigned char*) dmk_idam_p == dmk_track) {
-      /* First IAM.  (Or a subsequent IAM with no IDAMs in between --
-	 in the latter case, we assume the previous IAM(s) were
-	 garbage.)  Position the IAM as instructed.  This can result
-	 in data loss if an IAM appears somewhere in the middle of the
-	 track, unless the read was for twice the track length as the
-	 hole=0 (-h0) flag sets it. */
-      int iam_pos = dmk_iam_pos;
-      if (encoding == FM && !(dmk_header.options & DMK_SDEN_OPT)) {
-	iam_pos *= 2;
-      }
-      if (bytesread < iam_pos) {
-	/* Not enough bytes read yet.  Move read bytes forward and add fill. */
-	memmove(dmk_track + DMK_TKHDR_SIZE + iam_pos - bytesread,
-		dmk_track + DMK_TKHDR_SIZE,
-		bytesread);
-	memset(dmk_track + DMK_TKHDR_SIZE,
-	       (encoding == MFM) ? 0x4e : 0xff,
-	       iam_pos - bytesread);
-      } else {
-	/* Too many bytes read.  Move last iam_pos back and throw rest away. */
-	memmove(dmk_track + DMK_TKHDR_SIZE,
-		dmk_track + DMK_TKHDR_SIZE + bytesread - iam_pos,
-		iam_pos);
-      }
-      dmk_data_p = dmk_track + DMK_TKHDR_SIZE + iam_pos;
-      dmk_awaiting_iam = 0;
-    } else {
-      /* IAM that follows another IAM and one or more IDAMs.  If we're
-	 >95% of the way around the track, assume it's actually the
-	 first one again and stop here.  XXX This heuristic might be
-	 useful even when the user isn't having us position by IAM. */
-      if (bytesread > (dmk_header.tracklen - DMK_TKHDR_SIZE) * 95 / 100) {
-	msg(OUT_IDS, "[stopping before second IAM] ");
-	dmk_full = 1;
-	return;
-      }
-    }
-  }
-
-  dmk_awaiting_dam = 0;
-  dmk_valid_id = 0;
-  dmk_data(byte, encoding);
+  vmsg(level, fmt, ap);
 }
 
 
@@ -431,1134 +261,1369 @@ dmk_write_header(void)
 void
 dmk_write(int min_sector_cnt)
 {
+  const struct TrackStat *stat = decode_stat(dec);
   int i;
 
-  if (accum_sectors)
-    good_sectors += reused_sectors;
-
-  if (min_sector_cnt && (good_sectors != min_sector_cnt))
-    msg(OUT_TSUMMARY, " %d/%d", good_sectors, min_sector_cnt);
+  if (min_sector_cnt && (stat->good_sectors != min_sector_cnt))
+    msg(OUT_TSUMMARY, " %d/%d", stat->good_sectors, min_sector_cnt);
   else
-    msg(OUT_TSUMMARY, " %d", good_sectors);
-  msg(OUT_TSUMMARY, " good sector%s", plu(good_sectors));
-  if (accum_sectors && reused_sectors > 0)
-    msg(OUT_TSUMMARY, " (%d reused)", reused_sectors);
-  msg(OUT_TSUMMARY, ", %d error%s\n", errcount, plu(errcount));
+    msg(OUT_TSUMMARY, " %d", stat->good_sectors);
+  msg(OUT_TSUMMARY, " good sector%s", plu(stat->good_sectors));
+  if (accum_sectors && stat->reused_sectors > 0)
+    msg(OUT_TSUMMARY, " (%d reused)", stat->reused_sectors);
+  msg(OUT_TSUMMARY, ", %d error%s\n",
+      stat->errcount, plu(stat->errcount));
   msg(OUT_IDS, "\n");
 
-  total_good_sectors += good_sectors;
-  total_errcount += errcount;
-  if (errcount) {
+  total_good_sectors += stat->good_sectors;
+  total_errcount += stat->errcount;
+  if (stat->errcount) {
     err_tracks++;
-  } else if (good_sectors > 0) {
+  } else if (stat->good_sectors > 0) {
     good_tracks++;
   }
   for (i = 0; i < N_ENCS; i++) {
-    total_enc_count[i] += enc_count[i];
+    total_enc_count[i] += stat->enc_count[i];
   }
-  if (fwrite(dmk_track, dmk_header.tracklen, 1, dmk_file) != 1)
+  decoder_set_rx02(dec, total_enc_count[RX02] > 0);
+  if (fwrite(decode_dmk_track(dec), dmk_header.tracklen, 1, dmk_file) != 1)
     fatal_msg(1, "Error writing to DMK file\n");
 }
 
 
+
+/* Main program */
+
+int read_ahead_finish(int headpos, int side);
+int read_ahead_busy(int sig);
+
+void stop_workers(void);
+extern int drive;
+
+/* Turn off the motor and let go of the hardware, once nothing else
+   is using it */
 void
-dmk_init_track(void)
+release_hardware(void)
 {
   int i;
 
-  memset(dmk_track, 0, dmk_header.tracklen);
-  dmk_idam_p = (unsigned short*) dmk_track;
-  dmk_data_p = dmk_track + DMK_TKHDR_SIZE;
-  dmk_awaiting_dam = 0;
-  dmk_valid_id = 0;
-  dmk_full = 0;
-  good_sectors = 0;
-  if (accum_sectors)
-    reused_sectors = 0;
-  for (i = 0; i < N_ENCS; i++) {
-    enc_count[i] = 0;
-  }
-  errcount = 0;
-  backward_am = 0;
-  dmk_ignored = 0;
-  if (dmk_ignore < 0) {
-    i = dmk_ignore;
-    while (i++) *dmk_data_p++ = 0xff;
+  if (c.shared) {
+    /* A worker for one of several drives; the card is still in use */
+    catweasel_lock(&c.drives[drive]);
+    catweasel_set_motor(&c.drives[drive], 0);
+    catweasel_unlock(&c.drives[drive]);
+    return;
   }
-  cylseen = -1;
-  if (dmk_iam_pos >= 0) {
-    dmk_awaiting_iam = 1;
+  stop_workers();
+  catweasel_free_controller(&c);
+  for (i = 0; i < MK3_MAX_CARDS; i++) {
+    catweasel_free_controller(&cards[i]);
   }
-  write_splice = 0;
 }
 
 
 void
-check_missing_dam(void)
+cleanup(void)
 {
-  if (dmk_awaiting_dam)
-    msg(OUT_ERRORS, "[missing DAM] ");
-  else if (dbyte > 0)
-    msg(OUT_ERRORS, "[incomplete sector data] ");
-  else
-    return;
+  read_ahead_finish(-1, -1);
+  release_hardware();
+}
+
+
+void
+handler(int sig)
+{
+  struct sigaction sa_dfl = { .sa_handler = SIG_DFL };
+
+  if (sig == SIGINT) {
+    if (menu_intr_enabled && !menu_requested) {
+      menu_requested = 1;
+      return;
+    }
+    sigaction(sig, &sa_dfl, NULL);
+  }
 
-  dmk_awaiting_dam = 0;
-  dmk_valid_id = 0;
-  dbyte = ibyte = ebyte = -1;
-  errcount++;
-  if (accum_sectors)
-    dmk_idam_p[-1] |= DMK_EXTRA_FLAG;
+  /* If the read ahead still has the hardware, read_ahead_finish will
+     let go of it and raise sig again, once the read is done */
+  if (read_ahead_busy(sig)) return;
+  release_hardware();
+#if __DJGPP__
+  sigaction(sig, &sa_dfl, NULL);
+#endif
+  raise(sig);
 }
 
 
+void
+set_kind(void)
+{
+  kind_desc* kd = &kinds[kind-1];
+  cwclock = kd->cwclock;
+  fmthresh = kd->fmthresh;
+  mfmthresh1 = kd->mfmthresh1;
+  mfmthresh2 = kd->mfmthresh2;
+  dmktracklen = kd->cwtracklen;
+  mfmshort = kd->mfmshort;
+}
+
+
+/* Do a histogram of a track, also counting the total
+   number of catweasel clocks to go around the track.
+*/
 int
-dmk_check_wraparound(void)
+do_histogram(int drive, int track, int side, int histogram[128],
+	     int* total_cycles, int* total_samples, float* first_peak)
 {
-  /* Once we've read 95% of the track, if we see a sector ID that's
-     identical to the first one we saw on the track, conclude that we
-     wrapped around and are seeing the first one again, and
-     retroactively ignore it. */
-  unsigned short first_idamp, last_idamp;
-  int cmplen;
-  if (dmk_data_p - dmk_track - DMK_TKHDR_SIZE <
-      (dmk_header.tracklen - DMK_TKHDR_SIZE) * 95 / 100) {
+  int i;
+
+  catweasel_lock(&c.drives[drive]);
+  catweasel_seek(&c.drives[drive], track);
+  /*
+   * Use index-to-index read without marking index edges.  Although
+   * this does count the width of the index pulse twice, it's fast and
+   * quite accurate enough for a histogram.
+   */
+  if (!catweasel_read(&c.drives[drive], side ^ reverse, 1, 0, 0)) {
+    catweasel_unlock(&c.drives[drive]);
     return 0;
   }
-  first_idamp = *(unsigned short*) dmk_track;
-  last_idamp = *(dmk_idam_p - 1);
-  if (first_idamp == last_idamp) return 0;
-  if ((first_idamp & DMK_DDEN_FLAG) != (last_idamp & DMK_DDEN_FLAG)) return 0;
-  if ((first_idamp & DMK_DDEN_FLAG) || (dmk_header.options & DMK_SDEN_OPT)) {
-    cmplen = 5;
-  } else {
-    cmplen = 10;
-  }
-  if (memcmp(&dmk_track[first_idamp & DMK_IDAMP_BITS],
-	     &dmk_track[last_idamp & DMK_IDAMP_BITS], cmplen) == 0) {
-    msg(OUT_ERRORS, "[wraparound] ");
-    *--dmk_idam_p = 0;
-    dmk_awaiting_dam = 0;
-    ibyte = -1;
-    dmk_full = 1;
-    return 1;
+  nsamples = catweasel_read_block(&c, samples, CW_MEMSIZE);
+  catweasel_unlock(&c.drives[drive]);
+  decode_histogram(samples, nsamples, histogram,
+		   total_cycles, total_samples, first_peak);
+
+  /* Print histogram for debugging */
+  for (i=0; i<128; i+=8) {
+    msg(OUT_SAMPLES, "%3d: %06d %06d %06d %06d %06d %06d %06d %06d\n",
+	i, histogram[i+0], histogram[i+1], histogram[i+2], histogram[i+3],
+	histogram[i+4], histogram[i+5], histogram[i+6], histogram[i+7]);
   }
-  return 0;
+  return 1;
 }
 
-// Get pointer to sector N in rotational order.
-unsigned char*
-dmk_get_phys_sector(unsigned char *track, int n)
+
+/* Guess the kind of drive and media in use */
+void
+detect_kind(int drive)
 {
-  int off;
+  int histogram[128];
+  int total_cycles, total_samples;
+  float peak, rpm, dclock;
+
+  if (!do_histogram(drive, 0, 0, histogram,
+		    &total_cycles, &total_samples, &peak)) {
+    if (hole) {
+      fatal_msg(1, "No index hole detected\n");
+    } else {
+      fatal_msg(1, "No index hole; can't detect drive and media type\n"
+		"  Try using the -k flag to specify the correct type\n");
+    }
+  }
 
-  if (n < 0 || n >= DMK_TKHDR_SIZE / 2)
-    return NULL;
+  if (peak < 0.0) {
+    /* Track is blank */
+    fatal_msg(1, "Track 0 side 0 is unformatted\n");
+  } else {
+    dclock = 7080.5 / peak;
+  }
 
-  off = ((short *)track)[n] & DMK_IDAMP_BITS;
-  // IDAM offsets skip over IDAM offset table so can never be 0.
-  if (off == 0)
-    return NULL;
+  /* Total cycles gives us the RPM */
+  rpm = 7080500.0 / ((float)total_cycles) * 60.0;
 
-  // Filter out bogus offset.  The mininum valid sector size here is really
-  // only avoiding very bad situations.
-  if (off < 0 || off > dmktracklen - 10)
-    return NULL;
+  msg(OUT_SAMPLES, "Data clock approx %f kHz\n", dclock);
+  msg(OUT_SAMPLES, "Drive speed approx %f RPM\n", rpm);
 
-  return track + off;
+  if (rpm > 270.0 && rpm < 330.0) {
+    /* 300 RPM */
+    if (dclock > 225.0 && dclock < 287.5) {
+      /* Data rate 250 kHz */
+      kind = 2;
+    } else if (dclock > 450.0 && dclock < 575.0) {
+      /* Data rate 500 kHz */
+      kind = 4;
+    }
+  } else if (rpm > 330.0 && rpm < 396.0) {
+    /* 360 RPM */
+    if (dclock > 270.0 && dclock < 345.0) {
+      /* Data rate 300 kHz */
+      kind = 1;
+    } else if (dclock > 450.0 && dclock < 575.0) {
+      /* Data rate 500 kHz */
+      kind = 3;
+    }
+  }
+
+  if (kind == -1) {
+    fatal_msg(1, "Failed to detect drive and media type\n"
+	      "  Data clock approx %f kHz\n"
+	      "  Drive speed approx %f RPM\n", dclock, rpm);
+  }
+  set_kind();
+
+  msg(OUT_QUIET + 1, "Detected %s\n", kinds[kind-1].description);
+  fflush(stdout);
 }
 
-// Get length of sector N in rotational order
+
+/* Check if back side is formatted */
 int
-dmk_get_phys_sector_len(unsigned char *track, int n, int tracklen)
+detect_sides(int drive)
 {
-  unsigned char* s0 = dmk_get_phys_sector(track, n);
-  unsigned char* s1 = dmk_get_phys_sector(track, n + 1);
+  int res = 1;
+  int histogram[128];
+  int total_cycles, total_samples;
+  float peak;
 
-  if (!s0)
-    return -1;
+  if (!do_histogram(drive, 0, 1, histogram,
+		    &total_cycles, &total_samples, &peak)) {
+    fatal_msg(1, "No index hole; can't detect if side 1 is formatted\n");
+  }
 
-  if (s1) {
-    if (s0 >= s1) {
-      #if 0
-      int i;
-      printf("\nphysical sector misordering from %d to %d .. "
-	     "off %d off %d max %d!\n",
-      	     n, n + 1, s0 - track, s1 - track, dmktracklen);
-      for (i = 0; i < 10; i++)
-	printf("%x ", ((short *)track)[i]);
-      printf("\n");
-      if (track == dmk_tmp_track) printf("TMP track\n");
-      if (track == dmk_track) printf("common track\n");
-      if (track == dmk_merged_track) printf("merged track\n");
-      #endif
-
-      return -1;
+  if (peak > 0.0) {
+    float dclock = 7080.5 / peak;
+    if (dclock > 225.0 && dclock < 575.0) {
+      res = 2;
     }
-
-    return s1 - s0;
   }
-
-  return tracklen - (s0 - (track + DMK_TKHDR_SIZE));
+  msg(OUT_QUIET + 1, "Detected side 1 %sformatted\n",
+      res == 1 ? "not " : "");
+  fflush(stdout);
+  return res;
 }
 
+
+/* The most detailed level of output going anywhere */
 int
-dmk_get_sector_num(unsigned char *secdata)
+log_level(void)
 {
-  // Single density repeats every byte in DMK format.  If we see a repeat
-  // of the sector ID then we know the sector number is at twice the offset.
-  return secdata[secdata[1] == 0xfe ? 6 : 3];
+  return (out_file && out_file_level > out_level) ? out_file_level : out_level;
 }
 
-int
-copy_preamble(unsigned char **dst, unsigned char *track)
-{
-  unsigned char *pre_end = dmk_get_phys_sector(track, 0);
-  int pre_len;
 
-  if (!pre_end || pre_end <= track + DMK_TKHDR_SIZE)
-    return 0;
+/*
+ * Copy the options into the decoder's settings, making the decoder
+ * the first time.  The rest of its state carries over.
+ */
+struct decode_params dec_params;
+
+void
+set_decoder(void)
+{
+  struct decode_params p;
+
+  p.uencoding = uencoding;
+  p.quirk = quirk;
+  p.maxsize = maxsize;
+  p.cwclock = cwclock;
+  p.fmthresh = fmthresh;
+  p.mfmthresh1 = mfmthresh1;
+  p.mfmthresh2 = mfmthresh2;
+  p.mfmshort = mfmshort;
+  p.postcomp = postcomp;
+  p.hole = hole;
+  p.fmtimes = fmtimes;
+  p.dmk_iam_pos = dmk_iam_pos;
+  p.dmk_ignore = dmk_ignore;
+  p.accum_sectors = accum_sectors;
+  p.tracklen = dmktracklen;
+  dec_params = p;
+
+  if (dec == NULL) {
+    dec = decoder_new(&p);
+  } else if (decoder_set_params(dec, &p) < 0) {
+    decoder_free(dec);
+    dec = NULL;
+  }
+  if (dec == NULL)
+    fatal_msg(1, "Out of memory\n");
+  decoder_set_msg(dec, decoder_msg, NULL, log_level());
+  decoder_set_trace(dec, trace_out);
+}
 
-  pre_len = pre_end - (track + DMK_TKHDR_SIZE);
-  memcpy(*dst, track + DMK_TKHDR_SIZE, pre_len);
-  *dst += pre_len;
 
-  return 1;
+/* Mark the start of a read in the event trace, if any */
+void
+trace_read(int track, int side, int pass)
+{
+  if (trace_out) {
+    trace_put(trace_out, 0, EV_READ, track, (side << 16) | pass);
+  }
 }
 
-// Go over the track we have read and replace any bad sectors with sectors
-// from any previous read attempts.
-// Takes a very simple-minded approach and cannot cope with a situation
-// where sectors appear to be missing because of damage to the IDAM or DAM
-// headers.
+
+/* Save the current read to the raw capture file and the SCP image,
+   if any */
 void
-dmk_merge_sectors(void)
+raw_save(int track, int side, int pass, int headpos)
 {
-  int tracklen = dmk_data_p - (dmk_track + DMK_TKHDR_SIZE);
-  unsigned char *tmp_data_p = dmk_tmp_track + DMK_TKHDR_SIZE;
-  short *idam_p = (short *)dmk_track;
-  short *tmp_idam_p = (short *)dmk_tmp_track;
-  short *merged_idam_p = (short *)dmk_merged_track;
-  unsigned char *dmk_sec;
-  int cur;
-  int overflow = 0;
-  int best_errcount;
-  int best_repair;
-  struct TrackStat tmp_stat;
-  enum Pick { Merged, Current, Tmp } best;
-
-  // As a special case, use the track as-is if it read without error.
-  if (errcount == 0) {
-    memcpy(dmk_merged_track, dmk_track, DMK_TKHDR_SIZE + tracklen);
-    dmk_merged_track_len = tracklen;
-    merged_stat.errcount = errcount;
-    merged_stat.good_sectors = good_sectors;
-    merged_stat.reused_sectors = 0;
-    memcpy(merged_stat.enc_count, enc_count, sizeof enc_count);
-    memcpy(merged_stat.enc_sec, enc_sec, sizeof enc_sec);
-    return;
+  if (raw_file &&
+      cwraw_write_pass(raw_file, track, side, pass, headpos,
+		       samples, nsamples) < 0) {
+    fatal_msg(1, "Error writing to '%s': %s\n", raw_name, strerror(errno));
   }
+  if (scp_out &&
+      scp_write_pass(scp_out, headpos, side, samples, nsamples) < 0) {
+    fatal_msg(1, "Error writing to '%s': %s\n", scp_name, strerror(errno));
+  }
+}
 
-  memset(dmk_tmp_track, 0, DMK_TKHDR_SIZE);
-  tmp_stat.errcount = errcount;
-  tmp_stat.good_sectors = good_sectors;
-  tmp_stat.reused_sectors = 0;
-  memcpy(tmp_stat.enc_count, enc_count, sizeof enc_count);
-  memcpy(tmp_stat.enc_sec, enc_sec, sizeof enc_sec);
-
-  for (cur = 0; (dmk_sec = dmk_get_phys_sector(dmk_track, cur)); cur++) {
-    int replaced = 0;
-    // Bad sector?  See if we can find a replacement
-    if (idam_p[cur] & DMK_EXTRA_FLAG) {
-      int secnum = dmk_get_sector_num(dmk_sec), prev;
-      unsigned char *prev_sec;
-      for (prev = 0;
-	   (prev_sec = dmk_get_phys_sector(dmk_merged_track, prev));
-	   prev++) {
-	int seclen = dmk_get_phys_sector_len(dmk_merged_track, prev,
-					     dmk_merged_track_len);
-	if (dmk_get_sector_num(prev_sec) != secnum)
-	  continue;
-
-	// Ignore previous sector if it had an error
-	if (merged_idam_p[prev] & DMK_EXTRA_FLAG)
-	  continue;
-
-	// The very first sector needs the pre-amble copied over, too.
-	// We only understand this if the first sector is replacing the first
-	// sector.  If not, then we skip because best not create bogus data.
-	if (cur == 0) {
-	  if (prev != 0)
-	    continue;
-
-	  if (!copy_preamble(&tmp_data_p, dmk_merged_track))
-	    continue;
-	}
 
-	// Don't overflow the merged track.
-	if (seclen <= 0 || tmp_data_p + seclen > dmk_tmp_track + dmktracklen)
-	  continue;
-
-	msg(OUT_ERRORS, "[reuse %02x] ", secnum);
-
-	*tmp_idam_p++ = (merged_idam_p[prev] & ~DMK_IDAMP_BITS) |
-	  ((tmp_data_p - dmk_tmp_track) & DMK_IDAMP_BITS);
-
-	memcpy(tmp_data_p, prev_sec, seclen);
-	tmp_data_p += seclen;
-	replaced = 1;
-	tmp_stat.reused_sectors++;
-	tmp_stat.enc_sec[cur] = merged_stat.enc_sec[cur];
-	tmp_stat.enc_count[merged_stat.enc_sec[cur]]++;
-	// There should be an error for every bad sector, but just
-	// to be careful.
-	if (tmp_stat.errcount > 0)
-	  tmp_stat.errcount--;
-	break;
-      }
-    }
+/* Find the samples of one read in a binary capture, or resample them
+   from a flux image.  Returns NULL if there is no such read. */
+const unsigned char *
+replay_find(cwraw_file *rf, int track, int side, int pass, int *n)
+{
+  static unsigned char *buf = NULL;
 
-    if (!replaced) {
-      // Copy the sector we have whether it be a good or bad read.
-      int seclen = dmk_get_phys_sector_len(dmk_track, cur, tracklen);
-
-      // Need to copy preamble if we are the first sector
-      if (cur == 0 && !copy_preamble(&tmp_data_p, dmk_track))
-	overflow = 1;
-      else if (seclen < 0 || tmp_data_p + seclen > dmk_tmp_track + dmktracklen)
-	overflow = 1;
-      else {
-	*tmp_idam_p++ = (idam_p[cur] & ~DMK_IDAMP_BITS) |
-      	  ((tmp_data_p - dmk_tmp_track) & DMK_IDAMP_BITS);
-	memcpy(tmp_data_p, dmk_sec, seclen);
-	tmp_data_p += seclen;
-      }
+  if (rf) return cwraw_find(rf, track, side, pass, n);
+  if (buf == NULL) {
+    buf = (unsigned char *) malloc(CW_MEMSIZE);
+    if (buf == NULL) fatal_msg(1, "Out of memory\n");
+  }
+  *n = flux_samples(flux_replay, track, side, pass - 1, cwclock,
+                    buf, CW_MEMSIZE);
+  return (*n < 0) ? NULL : buf;
+}
+
+
+/* Command-line parameters */
+int port = 0;
+int tracks = -1;
+int sides = -1;
+int steps = -1;
+int drive = -1;
+int alternate = 0;
+int min_sectors[MAX_TRACKS][2];
+int retries[MAX_TRACKS][2];
+int min_retries[MAX_TRACKS][2];
+int readtime = 0;
+int revtime = 0;  /* ms per revolution */
+int revs = 0;
+int defer = 0;
+
+
+/* Seek to headpos and read the given side, then drain the samples
+   into buf.  Return the number of samples, or -1 on a read error. */
+int
+read_track(int headpos, int side, unsigned char *buf)
+{
+  int cw_ret, n, i;
+
+  catweasel_lock(&c.drives[drive]);
+  catweasel_seek(&c.drives[drive], headpos);
+#if DEBUG5
+  if (c.mk == 1) {
+    catweasel_fillmem(&c, DEBUG5_BYTE);
+  }
+#endif
+  if (revs) {
+    /*
+     * Read revs revolutions starting at the index hole, plus
+     * enough more for a long sector that wraps past the hole.  The
+     * read starts right away with index holes stored, so it is
+     * already running when the hole comes by; the samples before
+     * the hole are discarded below.
+     */
+    cw_ret = catweasel_read_revs(&c.drives[drive], side ^ reverse, cwclock,
+                                 readtime, 1, revs + 1, 0, revtime/5);
+  } else if (hole) {
+    /*
+     * Do read from index hole to index hole.
+     */
+    cw_ret = catweasel_read(&c.drives[drive], side ^ reverse, cwclock, 0, 0);
+  } else {
+    /*
+     * Do read.  Store index holes in the data stream; this
+     * helps detect wraparound and avoid duplicating data.
+     * readtime covers 2 revolutions, but on MK4 we can stop at the
+     * second index pulse, as long as there is over one revolution
+     * plus a long sector's worth of data.
+     */
+    cw_ret = catweasel_read_revs(&c.drives[drive], side ^ reverse, cwclock,
+                                 readtime, 1, 2, revtime + revtime/5, 0);
+  }
+  n = cw_ret ? catweasel_read_block(&c, buf, CW_MEMSIZE) : -1;
+  catweasel_unlock(&c.drives[drive]);
+  if (n < 0) return -1;
+#if DEBUG5
+  if (c.mk == 1) {
+    static int ecount = 0;
+    for (i = 0; i < n; i++) {
+      if (buf[i] == DEBUG5_BYTE && ++ecount == 16)
+	error_msg("Catweasel memory error?! See cw2dmk.txt\n");
     }
   }
+#endif
 
-  // dmk_tmp_track has tmp_stat.errcount errors
-  // (or is unusable if overflow is set).
-  // dmk_merged_track has merged_stat.errcount errors.
-  // dmk_track has errcount errors.
-
-  // We want to keep the best as determined by the lowest error count and
-  // that will become our merged track.
-
-  best = Current;
-  best_errcount = errcount;
-  best_repair = 0;
-  // overflow means that the candidate merged track tmp is not viable.
-  if (!overflow && tmp_stat.errcount < best_errcount) {
-    best = Tmp;
-    best_errcount = tmp_stat.errcount;
-    best_repair = tmp_stat.reused_sectors;
-  }
-  // If we have a previous merged track, it may still be the best.
-  // Especially if it has fewer repairs.
-  if (dmk_merged_track_len > 0) {
-    if (merged_stat.errcount < best_errcount ||
-	(merged_stat.errcount == best_errcount &&
-	 merged_stat.reused_sectors < best_repair))
-    {
-      best = Merged;
-      best_errcount = merged_stat.errcount;
-      best_repair = merged_stat.reused_sectors;
+  if (revs) {
+    /* Start at the leading edge of the first complete index pulse */
+    for (i = 1; i < n - 1; i++) {
+      if ((buf[i] & 0x80) && !(buf[i-1] & 0x80)) {
+        n -= i;
+        memmove(buf, buf + i, n);
+        break;
+      }
     }
   }
+  return n;
+}
+
+
+/*
+ * Pipelined reading (-P1).  While the main thread decodes one read,
+ * a helper thread seeks to the next track/side we expect to want and
+ * reads it into the spare sample buffer.  If the decoder then wants
+ * something else (a retry, or a restart after a wrong guess), the
+ * read ahead is simply thrown away.  As that costs a read and two
+ * seeks, there is no reading ahead after a pass with errors, until a
+ * pass comes out clean.  Only one thread touches the Catweasel at a
+ * time: the main thread always waits for the helper before doing any
+ * hardware operation of its own.
+ */
+struct {
+  int active;       /* helper thread started and not yet joined */
+  int done;         /* helper thread finished with the Catweasel */
+  int headpos, side;
+  int nsamples;     /* result of read_track */
+  int skip;         /* last pass had errors; don't read ahead */
+  volatile sig_atomic_t sig;  /* caught while the helper was busy */
+#if HAVE_PIPELINE
+  pthread_t thread;
+#endif
+} ahead;
+
+#if HAVE_PIPELINE
+void *
+read_ahead_thread(void *arg)
+{
+  sigset_t set;
+
+  /* Leave signal handling to the main thread */
+  sigfillset(&set);
+  pthread_sigmask(SIG_BLOCK, &set, NULL);
 
-  //msg(OUT_ERRORS, "(%d,%d,%d) ", errcount, tmp_stat.errcount,
-  //    merged_stat.errcount);
-
-  switch (best) {
-  default:
-  case Current:
-    msg(OUT_ERRORS, "[using current] ");
-    memcpy(dmk_merged_track, dmk_track, DMK_TKHDR_SIZE + tracklen);
-    dmk_merged_track_len = tracklen;
-    merged_stat.good_sectors = good_sectors;
-    merged_stat.reused_sectors = 0;
-    memcpy(merged_stat.enc_count, enc_count, sizeof enc_count);
-    memcpy(merged_stat.enc_sec, enc_sec, sizeof enc_sec);
-    break;
-  case Tmp:
-    msg(OUT_ERRORS, "[using merged] ");
-    dmk_merged_track_len = tmp_data_p - (dmk_tmp_track + DMK_TKHDR_SIZE);
-    memcpy(dmk_merged_track, dmk_tmp_track,
-	   DMK_TKHDR_SIZE + dmk_merged_track_len);
-    merged_stat = tmp_stat;
-    break;
-  case Merged:
-    msg(OUT_ERRORS, "[using previous] ");
-    break;
-  }
-
-  merged_stat.errcount = best_errcount;
+  ahead.nsamples = read_track(ahead.headpos, ahead.side, (unsigned char *)arg);
+  __atomic_store_n(&ahead.done, 1, __ATOMIC_RELEASE);
+  return NULL;
 }
+#endif
 
+/* Start reading headpos/side into the spare buffer in the background */
 void
-init_decoder(void)
+read_ahead_start(int headpos, int side)
 {
-  accum = 0;
-  taccum = 0;
-  bits = 0;
-  ibyte = dbyte = ebyte = -1;
-  premark = 0;
-  mark_after = -1;
-  curenc = first_encoding;
+#if HAVE_PIPELINE
+  ahead.headpos = headpos;
+  ahead.side = side;
+  ahead.nsamples = -1;
+  ahead.done = 0;
+  __atomic_store_n(&ahead.active,
+                   pthread_create(&ahead.thread, NULL, read_ahead_thread,
+                                  (samples == sample_buf[0]) ?
+                                  sample_buf[1] : sample_buf[0]) == 0,
+                   __ATOMIC_RELEASE);
+#endif
 }
 
+/* Wait for any read ahead to finish.  If it read headpos/side
+   successfully, make it the current read and return its sample
+   count; otherwise return -1. */
+int
+read_ahead_finish(int headpos, int side)
+{
+  if (!ahead.active) return -1;
+#if HAVE_PIPELINE
+  pthread_join(ahead.thread, NULL);
+#endif
+  __atomic_store_n(&ahead.active, 0, __ATOMIC_RELEASE);
+  if (ahead.sig) {
+    /* The handler left this to us */
+    release_hardware();
+    raise(ahead.sig);
+  }
+  if (ahead.headpos != headpos || ahead.side != side ||
+      ahead.nsamples < 0) {
+    return -1;
+  }
+  samples = (samples == sample_buf[0]) ? sample_buf[1] : sample_buf[0];
+  return ahead.nsamples;
+}
 
+/* From a signal handler: if a read ahead still has the hardware, note
+   sig for read_ahead_finish and return 1.  The handler can't join the
+   helper, as pthread_join is not async-signal-safe. */
 int
-mfm_valid_clock(unsigned long long accum)
+read_ahead_busy(int sig)
 {
-  /* Check for valid clock bits */
-  unsigned int xclock = ~((accum >> 1) | (accum << 1)) & 0xaaaa;
-  unsigned int clock = accum & 0xaaaa;
-  if (xclock != clock) {
-    //msg(OUT_ERRORS, "[clock exp %04x got %04x]", xclock, clock);
-    return 0;
+  if (__atomic_load_n(&ahead.active, __ATOMIC_ACQUIRE) &&
+      !__atomic_load_n(&ahead.done, __ATOMIC_ACQUIRE)) {
+    ahead.sig = sig;
+    return 1;
   }
-  return 1;
+  return 0;
 }
 
 
-/* Window used to undo RX02 MFM transform */
-#if 1
-#define WINDOW 4   /* change aligned 1000 -> 0101 */
-#else
-#define WINDOW 12  /* change aligned x01000100010 -> x00101010100 */
+/*
+ * Decoding a capture on several threads (-J).  When replaying a -F
+ * capture or a flux image, every read is there from the start, so
+ * while the main loop works through the reads in order, worker
+ * threads decode the ones it is expected to want next, each in a
+ * decoder of its own: the first pass of the tracks ahead and, while
+ * a track is being retried, its next few passes.  How a read decodes
+ * depends on what the reads before it left in the decoder, which a
+ * worker can only guess from how things stood when it started on the
+ * read.  So the main loop takes a worker's result only if
+ * decode_same_start says the guess made no difference, and otherwise
+ * decodes the read itself.  The guess_* checks, -j merging, and the
+ * rest still happen in the main loop, in order, and the messages from
+ * a worker's decoder are logged when its result is taken, so the DMK
+ * file and the log come out exactly as they would without -J.
+ */
+#define POOL_MAX 64  /* most threads */
+
+enum { JOB_FREE, JOB_QUEUED, JOB_BUSY, JOB_DONE, JOB_HELD };
+
+struct job {
+  int state;
+  int drop;                /* no longer wanted; free it when done */
+  int track, side, pass;
+  unsigned char *samples;
+  int nsamples, size;
+  struct decoder *dec;
+  int ok;                  /* decoded without running out of memory */
+  char *log;               /* messages: level byte, length, text */
+  int loglen, logsize;
+};
+
+struct {
+  int threads;             /* 0 if not in use */
+  int njobs;
+  struct job *job;
+  cwraw_file *rf;          /* capture, or NULL for flux_replay */
+  struct job *held;        /* the read the main loop is on, if queued */
+  int track, side, pass;   /* that read */
+  int next_track, next_side;  /* next first pass to queue */
+  int next_pass;           /* next pass of track/side to queue, or 0 */
+#if HAVE_POOL
+  pthread_mutex_t lock;
+  pthread_cond_t work, done;
+  pthread_t thread[POOL_MAX];
 #endif
+} pool;
 
+/* Order of the reads in the main loop */
+long
+pool_key(int track, int side, int pass)
+{
+  return ((long) track * 2 + side) * 65536 + pass;
+}
 
+#if HAVE_POOL
+/* Keep a message from a worker's decoder until its result is taken */
 void
-change_enc(int newenc)
+pool_msg(void *arg, int level, const char *fmt, va_list ap)
 {
-  if (curenc != newenc) {
-    msg(OUT_ERRORS, "[%s->%s] ", enc_name[curenc], enc_name[newenc]);
-    curenc = newenc;
-  }
-}
+  struct job *j = (struct job *) arg;
+  int head = 1 + sizeof(int);
+  va_list args;
+  int n = 0, room;
 
+  for (;;) {
+    room = j->logsize - j->loglen - head;
+    if (room > 0) {
+      va_copy(args, ap);
+      n = vsnprintf(j->log + j->loglen + head, room, fmt, args);
+      va_end(args);
+      if (n < 0) return;
+      if (n < room) break;
+    }
+    j->logsize = 2 * j->logsize + head + n;
+    j->log = (char *) realloc(j->log, j->logsize);
+    if (j->log == NULL)
+      fatal_msg(1, "Out of memory\n");
+  }
+  j->log[j->loglen] = level;
+  memcpy(j->log + j->loglen + 1, &n, sizeof(int));
+  j->loglen += head + n + 1;
+}
 
-/*
- * Main routine of the FM/MFM/RX02 decoder.  The input is a stream of
- * alternating clock/data bits, passed in one by one.  See decoder.txt
- * for documentation on how the decoder works.
- */
-void
-process_bit(int bit)
+void *
+pool_thread(void *arg)
 {
-  static int curcyl = 0;
-  unsigned char val = 0;
+  sigset_t set;
+  struct job *j, *next;
   int i;
 
-  if (dmk_full) return;
-  accum = (accum << 1) + bit;
-  taccum = (taccum << 1) + bit;
-  bits++;
-  if (mark_after >= 0) mark_after--;
-  if (write_splice > 0) write_splice--;
-
-  /*
-   * Pre-detect address marks: we shift bits into the low-order end of
-   * our 64-bit shift register (accum), look for marks in the lower
-   * half, but decode data from the upper half.  When we recognize a
-   * mark (or certain other patterns), we repeat or drop some bits to
-   * achieve proper clock/data separatation and proper byte-alignment.
-   * Pre-detecting the marks lets us do this adjustment earlier and
-   * decode data more cleanly.
-   *
-   * We always sample bits at the MFM rate (twice the FM rate), but
-   * we look for both FM and MFM marks at the same time.  There is
-   * ambiguity here if we're dealing with normal (not DEC-modified)
-   * MFM, because FM marks can be legitimate MFM data.  So we don't
-   * look for FM marks while we think we're inside an MFM ID or data
-   * block, only in gaps.  With -e2, we don't look for FM marks at
-   * all.
-   */
+  /* Leave signal handling to the main thread */
+  sigfillset(&set);
+  pthread_sigmask(SIG_BLOCK, &set, NULL);
 
-  /*
-   * For FM and RX02 marks, we look at 9 data bits (including a
-   * leading 0), which ends up being 36 bits of accum (2x for clocks,
-   * another 2x for the double sampling rate).  We must not look
-   * inside a region that can contain standard MFM data.
-   */
-  if (uencoding != MFM && bits >= 36 && !write_splice &&
-      (curenc != MFM || (ibyte == -1 && dbyte == -1 && ebyte == -1 &&
-                         mark_after == -1))) {
-    switch (accum & 0xfffffffffULL) {
-    case 0x8aa222a88ULL:  /* 0xfc / 0xc7: Quirky index address mark */
-      if ((quirk & QUIRK_IAM) == 0) break;
-      /* fall through */
-    case 0x8aa2a2a88ULL:  /* 0xfc / 0xd7: Index address mark */
-    case 0x8aa222aa8ULL:  /* 0xfe / 0xc7: ID address mark */
-    case 0x8aa222888ULL:  /* 0xf8 / 0xc7: Standard deleted DAM */
-    case 0x8aa22288aULL:  /* 0xf9 / 0xc7: RX02 deleted DAM / WD1771 user DAM */
-    case 0x8aa2228a8ULL:  /* 0xfa / 0xc7: WD1771 user DAM */
-    case 0x8aa2228aaULL:  /* 0xfb / 0xc7: Standard DAM */
-    case 0x8aa222a8aULL:  /* 0xfd / 0xc7: RX02 DAM */
-      change_enc(FM);
-      if (bits < 64 && bits >= 48) {
-	msg(OUT_HEX, "(+%d)", 64-bits);
-	bits = 64; /* byte-align by repeating some bits */
-      } else if (bits < 48 && bits > 32) {
-	msg(OUT_HEX, "(-%d)", bits-32);
-	bits = 32; /* byte-align by dropping some bits */
+  pthread_mutex_lock(&pool.lock);
+  for (;;) {
+    /* Take the queued read that the main loop will get to first */
+    next = NULL;
+    for (i = 0; i < pool.njobs; i++) {
+      j = &pool.job[i];
+      if (j->state == JOB_QUEUED &&
+	  (next == NULL || pool_key(j->track, j->side, j->pass) <
+	   pool_key(next->track, next->side, next->pass))) {
+	next = j;
       }
-      mark_after = 32;
-      premark = 0; // doesn't apply to FM marks
-      break;
-
-    case 0xa222a8888ULL:  /* Backward 0xf8-0xfd DAM */
-      if (mark_after > 0) break; // avoid firing on quirky IAM
-      if (good_sectors > 0) break; // discourage firing on noise or splices
-      change_enc(FM);
-      backward_am++;
-      msg(OUT_ERRORS, "[backward AM] ");
-      break;
     }
-  }
+    if (next == NULL) {
+      pthread_cond_wait(&pool.work, &pool.lock);
+      continue;
+    }
+    next->state = JOB_BUSY;
+    pthread_mutex_unlock(&pool.lock);
 
-  /*
-   * For MFM premarks, we look at 16 data bits (two copies of the
-   * premark), which ends up being 32 bits of accum (2x for clocks).
-   */
-  if (uencoding != FM && uencoding != RX02 &&
-      bits >= 32 && !write_splice) {
-    switch (accum & 0xffffffff) {
-    case 0x52245224:
-      /* Pre-index mark, 0xc2c2 with missing clock between bits 3 & 4
-	 (using 0-origin big-endian counting!).  Would be 0x52a452a4
-	 without missing clock. */
-      change_enc(MFM);
-      premark = 0xc2;
-      if (bits < 64 && bits > 48) {
-	msg(OUT_HEX, "(+%d)", 64-bits);
-	bits = 64; /* byte-align by repeating some bits */
-      }
-      mark_after = bits;
-      break;
+    next->loglen = 0;
+    next->ok = decode_track(next->dec, next->samples, next->nsamples,
+			    NULL) >= 0;
 
-    case 0x448944a9:
-      /* Quirky pre-address mark, 0xa1a1 with missing clock in only the
-         first 0xa1. */
-      if ((quirk & QUIRK_PREMARK) == 0) break;
-      /* fall thru */
-
-    case 0x44894489:
-      /* Pre-address mark, 0xa1a1 with missing clock between bits 4 & 5
-	 (using 0-origin big-endian counting!).  Would be 0x44a944a9
-	 without missing clock.  Reading a pre-address mark backward
-	 also matches this pattern, but the following byte is then 0x80. */
-      change_enc(MFM);
-      premark = 0xa1;
-      if (bits < 64 && bits > 48) {
-	msg(OUT_HEX, "(+%d)", 64-bits);
-	bits = 64; /* byte-align by repeating some bits */
-      }
-      mark_after = bits;
-      break;
+    pthread_mutex_lock(&pool.lock);
+    next->state = next->drop ? JOB_FREE : JOB_DONE;
+    next->drop = 0;
+    pthread_cond_broadcast(&pool.done);
+  }
+  return NULL;
+}
 
-    case 0x55555555:
-      if ((quirk & QUIRK_EXTRA) == 0 && curenc == MFM && mark_after < 0 &&
-	  ibyte == -1 && dbyte == -1 && ebyte == -1 && !(bits & 1)) {
-	/* ff ff in gap.  This should probably be 00 00, so drop 1/2
-           bit to bit-align.  This heuristic is harmful if the disk
-           format has meaningful extra bytes in a gap following the
-           data CRC and prior to the write splice, so suppress it if
-           QUIRK_EXTRA is set.  We'll still bit-align when the premark
-           shows up, and if dmk2cw is used to write the disk back
-           later, it will force the bytes preceding the premark to be
-           00 then.  The DMK file just won't look as nice. */
-        msg(OUT_HEX, "(-1)");
-	bits--;
-      }
-      break;
+/* Queue a read for the workers; -1 if it is not in the replay */
+int
+pool_queue(struct job *j, int track, int side, int pass)
+{
+  const unsigned char *p;
+  int n;
+
+  p = replay_find(pool.rf, track, side, pass, &n);
+  if (p == NULL) return -1;
+  if (n > j->size) {
+    free(j->samples);
+    j->samples = (unsigned char *) malloc(n);
+    j->size = n;
+  }
+  if (j->dec == NULL) {
+    j->dec = decoder_new(&dec_params);
+    j->logsize = 4096;
+    j->log = (char *) malloc(j->logsize);
+  }
+  if (j->samples == NULL || j->dec == NULL || j->log == NULL ||
+      decoder_copy_state(j->dec, dec) < 0)
+    fatal_msg(1, "Out of memory\n");
+  decoder_set_msg(j->dec, pool_msg, j, log_level());
+  memcpy(j->samples, p, n);
+  j->nsamples = n;
+  j->track = track;
+  j->side = side;
+  j->pass = pass;
+  pthread_mutex_lock(&pool.lock);
+  j->state = JOB_QUEUED;
+  pthread_cond_signal(&pool.work);
+  pthread_mutex_unlock(&pool.lock);
+  return 0;
+}
 
-    case 0x92549254:
-      if ((quirk & QUIRK_EXTRA) == 0 &&
-          mark_after < 0 && ibyte == -1 && dbyte == -1 && ebyte == -1) {
-	/* 4e 4e in gap.  This should probably be byte-aligned, so do
-           so by dropping bits.  This heuristic needs to be suppressed
-           by QUIRK_EXTRA too, as the extra bytes could theoretically
-           contain valid data that looks like 4e 4e when read with
-           wrong alignment. */
-	change_enc(MFM);
-	if (bits < 64 && bits > 48) {
-	  msg(OUT_HEX, "(-%d)", bits-48);
-	  bits = 48;
+/* Give the free jobs to what the main loop may want next */
+void
+pool_fill(void)
+{
+  int i, end = pool.rf ? cwraw_tracks(pool.rf) : flux_tracks;
+
+  if (end > tracks) end = tracks;
+  for (i = 0; i < pool.njobs; i++) {
+    if (pool.job[i].state != JOB_FREE) continue;
+    for (;;) {
+      if (pool.next_pass > 0 && pool.next_pass <= pool.pass + pool.threads) {
+	/* Retrying; a good many passes may be wanted */
+	if (pool_queue(&pool.job[i], pool.track, pool.side,
+		       pool.next_pass++) == 0) break;
+	pool.next_pass = 0;
+      } else if (pool.next_track < end) {
+	int track = pool.next_track, side = pool.next_side;
+	if (++pool.next_side >= sides) {
+	  pool.next_side = 0;
+	  pool.next_track++;
 	}
+	if (pool_queue(&pool.job[i], track, side, 1) == 0) break;
+      } else {
+	return;
       }
-      break;
     }
   }
-
-  /* Undo RX02 DEC-modified MFM transform (in taccum) */
-#if WINDOW == 4
-  if (bits >= WINDOW && (bits & 1) == 0 && (accum & 0xfULL) == 0x8ULL) {
-    taccum = (taccum & ~0xfULL) | 0x5ULL;
-  }
-#else /* WINDOW == 12 */
-  if (bits >= WINDOW && (bits & 1) == 0 && (accum & 0x7ffULL) == 0x222ULL) {
-    taccum = (taccum & ~0x7ffULL) | 0x154ULL;
-  }
-#endif
-
-  if (bits < 64) return;
-
-  if (curenc == FM || curenc == MIXED) {
-    /* Heuristic to detect being off by some number of bits */
-    if (mark_after != 0 && ((accum >> 32) & 0xddddddddULL) != 0x88888888ULL) {
-      for (i = 1; i <= 3; i++) {
-	if (((accum >> (32 - i)) & 0xddddddddULL) == 0x88888888ULL) {
-	  /* Ignore oldest i bits */
-	  bits -= i;
-	  msg(OUT_HEX, "(-%d)", i);
-	  if (bits < 64) return;
-	  break;
-	}
-      }
-      if (i > 3) {
-#if 0 /* Bad idea: fires way too often in FM gaps. */
-	/* Check if it looks more like MFM */
-	if (uencoding != FM && uencoding != RX02 &&
-	    ibyte == -1 && dbyte == -1 && ebyte == -1 && !write_splice &&
-	    (accum & 0xaaaaaaaa00000000ULL) &&
-	    (accum & 0x5555555500000000ULL)) {
-	  for (i = 1; i <= 2; i++) {
-	    if (mfm_valid_clock(accum >> (48 - i))) {
-	      change_enc(MFM);
-	      bits -= i;
-	      msg(OUT_HEX, "(-%d)", i);
-	      return;
-	    }
-	  }
-	}
+}
 #endif
-	/* Note bad clock pattern.  This doesn't mean the next data
-           byte to be output actually has a bad clock pattern.  It
-           just means that we see a bad clock pattern in the top half
-           of accum, and we don't have a complete predetected mark
-           there that we're just about to output (that is, mark_after
-           != 0).  The bad clock pattern may get fixed by a bit drop
-           or repeat heuristic before we output the next data byte. */
-	msg(OUT_HEX, "?");
-      }
-    }
-    for (i=0; i<8; i++) {
-      val |= (accum & (1ULL << (4*i + 1 + 32))) >> (3*i + 1 + 32);
-    }
-    bits = 32;
-
-  } else if (curenc == MFM) {
-    for (i=0; i<8; i++) {
-      val |= (accum & (1ULL << (2*i + 48))) >> (i + 48);
-    }
-    bits = 48;
 
-  } else /* curenc == RX02 */ {
-    for (i=0; i<8; i++) {
-      val |= (taccum & (1ULL << (2*i + 48))) >> (i + 48);
-    }
-    bits = 48;
-  }
-
-  if (mark_after == 0) {
-    mark_after = -1;
-    switch (val) {
-    case 0xfc:
-      /* Index address mark */
-      if (curenc == MFM && premark != 0xc2) break;
-      check_missing_dam();
-      msg(OUT_IDS, "\n#fc ");
-      dmk_iam(0xfc, curenc);
-      ibyte = -1;
-      dbyte = -1;
-      ebyte = -1;
-      return;
-
-    case 0xfe:
-      /* ID address mark */
-      if (curenc == MFM && premark != 0xa1) break;
-      if (dmk_awaiting_iam) break;
-      check_missing_dam();
-      msg(OUT_IDS, "\n#fe ");
-      dmk_idam(0xfe, curenc);
-      /* For normal MFM, premark a1a1a1 is included in the ID CRC.
-       * With QUIRK_ID_CRC, it is omitted. */
-      crc = calc_crc1((curenc == MFM && (quirk & QUIRK_ID_CRC) == 0) ?
-                      0xcdb4 : 0xffff, val);
-      dbyte = -1;
-      ebyte = -1;
-      return;
+/* Start the worker threads for a replay, if -J allows */
+void
+pool_start(cwraw_file *rf)
+{
+#if HAVE_POOL
+  int i;
 
-    case 0xf8: /* Standard deleted data address mark */
-    case 0xf9: /* WD1771 user or RX02 deleted data address mark */
-    case 0xfa: /* WD1771 user data address mark */
-    case 0xfb: /* Standard data address mark */
-    case 0xfd: /* RX02 data address mark */
-      if (dmk_awaiting_track_start() || !dmk_in_range()) break;
-      if (curenc == MFM && premark != 0xa1) break;
-      if (!dmk_awaiting_dam) {
-	msg(OUT_ERRORS, "[unexpected DAM] ");
-	errcount++;
-	break;
-      }
-      dmk_awaiting_dam = 0;
-      msg(OUT_HEX, "\n");
-      msg(OUT_IDS, "#%2x ", val);
-      dmk_data(val, curenc);
-      if ((uencoding == MIXED || uencoding == RX02) &&
-	  (val == 0xfd ||
-	   (val == 0xf9 && (total_enc_count[RX02] + enc_count[RX02] > 0 ||
-			    uencoding == RX02)))) {
-	change_enc(RX02);
-        if (accum_sectors) {
-          enc_sec[(dmk_idam_p - (unsigned short *)dmk_track) - 1] = RX02;
-        }
-      }
-      /* For MFM, premark a1a1a1 is included in the data CRC.
-       * With QUIRK_DATA_CRC, it is omitted. */
-      crc = calc_crc1((curenc == MFM && (quirk & QUIRK_DATA_CRC) == 0) ?
-                      0xcdb4 : 0xffff, val);
-      ibyte = -1;
-      dbyte = secsize(sizecode, curenc, maxsize, quirk) + 2;
-      ebyte = -1;
-      return;
+  if (jobs == 0) {
+    jobs = sysconf(_SC_NPROCESSORS_ONLN);
+  }
+  if (jobs < 2 || trace_out) return;  /* the trace is not shared */
+  pool.threads = (jobs > POOL_MAX) ? POOL_MAX : jobs;
+  pool.njobs = 2 * pool.threads;
+  pool.job = (struct job *) calloc(pool.njobs, sizeof(struct job));
+  if (pool.job == NULL)
+    fatal_msg(1, "Out of memory\n");
+  pool.rf = rf;
+  pool.track = -1;
+  pthread_mutex_init(&pool.lock, NULL);
+  pthread_cond_init(&pool.work, NULL);
+  pthread_cond_init(&pool.done, NULL);
+  for (i = 0; i < pool.threads; i++) {
+    if (pthread_create(&pool.thread[i], NULL, pool_thread, NULL) != 0)
+      fatal_msg(1, "Can't start decoding threads\n");
+  }
+#endif
+}
 
-    case 0x80: /* MFM DAM or IDAM premark read backward */
-      if (curenc != MFM || premark != 0xc2) break;
-      backward_am++;
-      msg(OUT_ERRORS, "[backward AM] ");
-      break;
+/*
+ * The main loop is about to decode the given read.  If it was queued,
+ * wait for the worker to finish with it and return its samples as
+ * replay_find would; otherwise return NULL.  Then queue more.
+ */
+const unsigned char *
+pool_find(int track, int side, int pass, int *n)
+{
+#if HAVE_POOL
+  long want = pool_key(track, side, pass);
+  int restart = want < pool_key(pool.track, pool.side, pool.pass);
+  struct job *j;
+  long key;
+  int i;
 
-    default:
-      /* Premark with no mark */
-      msg(OUT_ERRORS, "[dangling premark] ");
-      dmk_data(val, curenc);
-      // probably wraparound or write splice, so don't inc errcount
-      break;
+  if (pool.threads == 0) return NULL;
+  pthread_mutex_lock(&pool.lock);
+  pool.held = NULL;
+  for (i = 0; i < pool.njobs; i++) {
+    j = &pool.job[i];
+    key = pool_key(j->track, j->side, j->pass);
+    if (j->state == JOB_QUEUED && key > want && !restart) {
+      /* Not started yet; the guess can still be brought up to date */
+      if (decoder_copy_state(j->dec, dec) < 0)
+	fatal_msg(1, "Out of memory\n");
+      continue;
     }
-  }
-
-  switch (ibyte) {
-  default:
-    break;
-  case 0:
-    msg(OUT_IDS, "cyl=");
-    curcyl = val;
-    break;
-  case 1:
-    msg(OUT_IDS, "side=");
-    break;
-  case 2:
-    msg(OUT_IDS, "sec=");
-    break;
-  case 3:
-    msg(OUT_IDS, "size=");
-    sizecode = val;
-    break;
-  case 4:
-    msg(OUT_HEX, "crc=");
-    break;
-  case 6:
-    if (crc == 0) {
-      msg(OUT_IDS, "[good ID CRC] ");
-      dmk_valid_id = 1;
-    } else {
-      msg(OUT_ERRORS, "[bad ID CRC] ");
-      errcount++;
-      if (accum_sectors)
-	dmk_idam_p[-1] |= DMK_EXTRA_FLAG;
-      ibyte = -1;
+    if (j->state == JOB_FREE || j->drop || (key > want && !restart)) {
+      continue;
     }
-    msg(OUT_HEX, "\n");
-    dmk_awaiting_dam = 1;
-    dmk_check_wraparound();
-    break;
-  case 18:
-    /* Done with post-ID gap */
-    ibyte = -1;
-    break;
-  }
-
-  if (ibyte == 2) {
-    msg(OUT_ERRORS, "%02x ", val);
-  } else if (ibyte >= 0 && ibyte <= 3) {
-    msg(OUT_IDS, "%02x ", val);
-  } else {
-    msg(OUT_SAMPLES, "<");
-    msg(OUT_HEX, "%02x", val);
-    msg(OUT_SAMPLES, ">");
-    msg(OUT_HEX, " ");
-    msg(OUT_RAW, "%c", val);
-  }
-
-  dmk_data(val, curenc);
-
-  if (ibyte >= 0) ibyte++;
-  if (dbyte > 0) dbyte--;
-  if (ebyte > 0) ebyte--;
-  crc = calc_crc1(crc, val);
-
-  if (dbyte == 0) {
-    if (crc == 0) {
-      msg(OUT_IDS, "[good data CRC] ");
-      if (dmk_valid_id) {
-	if (good_sectors == 0) first_encoding = curenc;
-	good_sectors++;
-	enc_count[curenc]++;
-	cylseen = curcyl;
+    if (key == want && (j->state == JOB_BUSY || j->state == JOB_DONE)) {
+      while (j->state == JOB_BUSY) {
+	pthread_cond_wait(&pool.done, &pool.lock);
       }
+      j->state = JOB_HELD;
+      pool.held = j;
+    } else if (j->state == JOB_BUSY) {
+      j->drop = 1;
     } else {
-      msg(OUT_ERRORS, "[bad data CRC] ");
-      errcount++;
-      if (accum_sectors) {
-	// Don't count both header and data CRC errors for a sector.
-	// Because otherwise dropping a single error for a replacement sector
-	// will not show it fully corrected.  Need to track errors/sector.
-	if (dmk_idam_p[-1] & DMK_EXTRA_FLAG)
-	  errcount--;
-	dmk_idam_p[-1] |= DMK_EXTRA_FLAG;
-      }
-    }
-    msg(OUT_HEX, "\n");
-    dbyte = -1;
-    dmk_valid_id = 0;
-    write_splice = WRITE_SPLICE;
-    if (curenc == RX02) {
-      change_enc(FM);
-    }
-    if (quirk & QUIRK_EXTRA_CRC) {
-      ebyte = 6;
-      crc = 0xffff;
+      /* Passed over, or not started; the main loop will do it */
+      j->state = JOB_FREE;
     }
   }
+  pthread_mutex_unlock(&pool.lock);
 
-  if (ebyte == 0) {
-    if (crc == 0) {
-      msg(OUT_IDS, "[good extra CRC] ");
-    } else {
-      msg(OUT_ERRORS, "[bad extra CRC] ");
-      errcount++;
-      if (accum_sectors) {
-	if (dmk_idam_p[-1] & DMK_EXTRA_FLAG)
-	  errcount--;
-	dmk_idam_p[-1] |= DMK_EXTRA_FLAG;
-      }
-    }
-    msg(OUT_HEX, "\n");
-    ebyte = -1;
-    write_splice = WRITE_SPLICE;
+  if (restart || track != pool.track || side != pool.side) {
+    pool.next_pass = 0;
+  }
+  if (pass > 1 && pool.next_pass <= pass) {
+    pool.next_pass = pass + 1;
+  }
+  if (restart || pool_key(pool.next_track, pool.next_side, 0) <= want) {
+    pool.next_track = track + (side + 1) / sides;
+    pool.next_side = (side + 1) % sides;
+  }
+  pool.track = track;
+  pool.side = side;
+  pool.pass = pass;
+  if (want > 1) {
+    /* The first read decides what the rest start from; wait for it */
+    pool_fill();
   }
 
-  /* Predetect bad MFM clock pattern.  Can't detect at decode time
-     because we need to look at 17 bits. */
-  if (curenc == MFM && bits == 48 && !mfm_valid_clock(accum >> 32)) {
-    if (mfm_valid_clock(accum >> 31)) {
-      msg(OUT_HEX, "(-1)");
-      bits--;
-    } else {
-      msg(OUT_HEX, "?");
-    }
+  if (pool.held) {
+    *n = pool.held->nsamples;
+    return pool.held->samples;
   }
+#endif
+  return NULL;
 }
 
-
 /*
- * Convert Catweasel samples to strings of alternating clock/data bits
- * and pass them to process_bit for further decoding.  Ad hoc method
- * using two fixed thresholds modified by a postcomp factor.
- *
- * The input is the distance in Catweasel clocks between the previous
- * magnetic transition (i.e., bit cell containing 1) and the current
- * transition.  The output is a 1 for the previous transition,
- * followed by a 0 for each empty bit cell prior to the current
- * transition.
- *
- * When decoding FM (single density) we still use double density sized
- * bit cells -- see decoder.txt -- so in the output a single density
- * bit cell that contains 1 ends up represented as 10, and a single
- * density bit cell that contains 0 ends up represented as 00.
- *
- * We assume (unless QUIRK_MFM_CLOCK is set) that there is never a
- * transition in two consecutive bit cells.  We also assume there are
- * never more than three empty bit cells between transitions.  These
- * assumptions are valid for correctly encoded MFM, and for FM
- * represented at the double data rate as explained in the previous
- * paragraph.  (Future: If we want to support MMFM, we will need to
- * extend this function to allow for as many as four empty bit cells
- * between transitions.)
+ * Decode the read pool_find returned, unless a worker already has and
+ * its result is the same as decoding it here would give.
  */
 void
-process_sample(int sample)
+pool_decode(void)
 {
-  static float adj = 0.0;
-  int len;
+  struct job *j = pool.held;
+  const char *p, *q, *end;
+  int n;
 
-  msg(OUT_SAMPLES, "%d", sample);
-  if (uencoding == FM) {
-    if (sample + adj <= fmthresh) {
-      /* Short: output 10 */
-      len = 2;
-    } else {
-      /* Long: output 1000 */
-      len = 4;
-    }
-  } else {
-    if ((quirk & QUIRK_MFM_CLOCK) && sample + adj <= mfmthresh1 * 0.6) {
-      /* Tiny: output 1 */
-      len = 1;
-    } else if (sample + adj <= mfmthresh1) {
-      /* Short: output 10 */
-      len = 2;
-    } else if (sample + adj <= mfmthresh2) {
-      /* Medium: output 100 */
-      len = 3;
-    } else {
-      /* Long: output 1000 */
-      len = 4;
+  if (j == NULL || !j->ok || !decode_same_start(j->dec, dec)) {
+    decode_track(dec, samples, nsamples, NULL);
+    return;
+  }
+  decoder_take(dec, j->dec);
+  for (p = j->log; p < j->log + j->loglen; p = end + 1) {
+    memcpy(&n, p + 1, sizeof(int));
+    q = p + 1 + sizeof(int);
+    end = q + n;
+    for (;;) {
+      /* -v7 raw bytes may include NULs */
+      msg(*p, "%s", q);
+      q += strlen(q);
+      if (q == end) break;
+      msg(*p, "%c", *q++);
     }
-
   }
-  adj = (sample - (len/2.0 * mfmshort * cwclock)) * postcomp;
+}
+
 
-  msg(OUT_SAMPLES, "%c ", "-tsml"[len]);
+/*
+ * Imaging several drives at once (-d with a list of drives).  The
+ * retry loop keeps its state in globals, so each drive gets a worker
+ * process of its own, forked after the cards are initialized; each
+ * worker then runs just as if cw2dmk had been started for that drive
+ * alone.  The workers take turns at each card with catweasel_lock,
+ * holding it only to seek and read, so while one drive has the
+ * card's bus and memory, the others on the card are decoding or
+ * spinning up.  Drives on different cards run fully in parallel.
+ * The parent copies the workers' output to its own, a whole line at
+ * a time, with the drive in front.
+ */
+struct relay {
+  int fd;          /* read end of a worker's stdout or stderr; -1 at EOF */
+  FILE *to;
+  int len;
+  char buf[1024];
+};
 
-  if (!dmk_full) {
-    process_bit(1);
-    while (--len) process_bit(0);
+/* Parse a -d list of drives, each "unit" or "card:unit" */
+int
+parse_drives(const char *s)
+{
+  int card, unit, n;
+
+  ndrives = 0;
+  for (;;) {
+    if (sscanf(s, "%d:%d%n", &card, &unit, &n) == 2) {
+      if (card < 0 || card >= MK3_MAX_CARDS) return 1;
+    } else if (sscanf(s, "%d%n", &unit, &n) == 1) {
+      card = -1;
+    } else {
+      return 1;
+    }
+    if (unit < 0 || unit > 1 || ndrives == MAX_DRIVES) return 1;
+    drv_card[ndrives] = card;
+    drv_unit[ndrives++] = unit;
+    s += n;
+    if (*s == '\0') return 0;
+    if (*s++ != ',') return 1;
   }
 }
 
-
-/* Push out any valid bits left in accum at end of track */
+/* Kill and reap any workers still running */
 void
-flush_bits(void)
+stop_workers(void)
 {
+#if HAVE_MULTI
   int i;
-  for (i=0; i<63; i++) {
-    process_bit(!(i&1));
+
+  for (i = 0; i < ndrives; i++) {
+    if (workers[i] > 0) {
+      kill(workers[i], SIGTERM);
+      waitpid(workers[i], NULL, 0);
+      workers[i] = 0;
+    }
   }
+#endif
 }
 
-
-/* Main program */
-
+#if HAVE_MULTI
+/* Copy whatever a worker has written, prefixing each line */
 void
-cleanup(void)
+relay_output(struct relay *r, const char *prefix)
 {
-  catweasel_free_controller(&c);
+  char *p, *nl;
+  int n;
+
+  n = read(r->fd, r->buf + r->len, sizeof(r->buf) - r->len);
+  if (n < 0 && errno == EINTR) return;
+  if (n <= 0) {
+    if (r->len > 0) {
+      fprintf(r->to, "%s%.*s\n", prefix, r->len, r->buf);
+    }
+    close(r->fd);
+    r->fd = -1;
+    fflush(r->to);
+    return;
+  }
+  r->len += n;
+  p = r->buf;
+  while ((nl = memchr(p, '\n', r->len - (p - r->buf))) != NULL) {
+    fprintf(r->to, "%s%.*s", prefix, (int) (nl + 1 - p), p);
+    p = nl + 1;
+  }
+  r->len -= p - r->buf;
+  if (r->len == sizeof(r->buf)) {
+    /* Very long line; let it go in pieces */
+    fprintf(r->to, "%s%.*s", prefix, r->len, r->buf);
+    r->len = 0;
+  } else {
+    memmove(r->buf, p, r->len);
+  }
+  fflush(r->to);
 }
 
+/*
+ * Fork a worker whose stdout and stderr go to pipes that the parent
+ * reads through *out and *err.  The worker closes the pipes in the
+ * nopen relays at open, which belong to other workers.  Returns 0 in
+ * the worker and its pid in the parent.
+ */
+pid_t
+spawn_worker(struct relay *out, struct relay *err,
+             struct relay *open, int nopen)
+{
+  int sigs[] = { SIGHUP, SIGINT, SIGQUIT, SIGPIPE, SIGTERM };
+  int opipe[2], epipe[2], k;
+  pid_t pid;
 
-void
-handler(int sig)
+  fflush(stdout);
+  fflush(stderr);
+  if (pipe(opipe) == -1 || pipe(epipe) == -1)
+    fatal_msg(1, "pipe failed: %s\n", strerror(errno));
+  pid = fork();
+  if (pid == -1)
+    fatal_msg(1, "fork failed: %s\n", strerror(errno));
+  if (pid == 0) {
+    struct sigaction sa_dfl = { .sa_handler = SIG_DFL };
+
+    /* Worker: signals and the other workers are the parent's business */
+    for (k = 0; k < sizeof(sigs)/sizeof(*sigs); ++k) {
+      sigaction(sigs[k], &sa_dfl, NULL);
+    }
+    for (k = 0; k < nopen; k++) {
+      if (open[k].fd >= 0) close(open[k].fd);
+    }
+    memset(workers, 0, sizeof(workers));
+    dup2(opipe[1], 1);
+    dup2(epipe[1], 2);
+    close(opipe[0]);
+    close(opipe[1]);
+    close(epipe[0]);
+    close(epipe[1]);
+    return 0;
+  }
+  close(opipe[1]);
+  close(epipe[1]);
+  out->fd = opipe[0];
+  out->to = stdout;
+  out->len = 0;
+  err->fd = epipe[0];
+  err->to = stderr;
+  err->len = 0;
+  return pid;
+}
+
+/*
+ * Initialize the cards and start a worker for each drive.  Returns
+ * in each worker, with c and drive set up for its drive, the index of
+ * its drive in the list.  In the parent, waits for all the workers and
+ * exits.
+ */
+int
+run_drives(char **names)
 {
-  struct sigaction sa_dfl = { .sa_handler = SIG_DFL };
+  static struct relay relays[2 * MAX_DRIVES];
+  struct pollfd pfd[2 * MAX_DRIVES];
+  char prefix[MAX_DRIVES][16];
+  int i, j, n, status, failed = 0;
+
+  if (atexit(cleanup))
+    fatal_msg(1, "Can't establish atexit() call.\n");
+
+  for (i = 0; i < ndrives; i++) {
+    int card = drv_card[i];
+    if (cards[card].iobase) continue;
+    if (card_port[card] <= 0)
+      fatal_msg(1, "Failed to detect Catweasel card %d\n", card);
+    if (!catweasel_init_controller(&cards[card], card_port[card],
+                                   card_mk[card], getenv("CW4FIRMWARE"),
+                                   step_ms, settle_ms) ||
+        !catweasel_memtest(&cards[card])) {
+      fatal_msg(1, "Failed to detect Catweasel at port 0x%x\n",
+                card_port[card]);
+    }
+    msg(OUT_SUMMARY, "Detected Catweasel MK%d at port 0x%x\n",
+        card_mk[card], card_port[card]);
+    if (card_mk[card] == 1 && cwclock == 4)
+      fatal_msg(1, "Catweasel MK1 does not support 4x clock\n");
+    if (!catweasel_share(&cards[card]))
+      fatal_msg(1, "Can't share Catweasel among drives\n");
+  }
+  fflush(stdout);
+  fflush(stderr);
+
+  for (i = 0; i < ndrives; i++) {
+    sprintf(prefix[i], "[%d:%d] ", drv_card[i], drv_unit[i]);
+    workers[i] = spawn_worker(&relays[2*i], &relays[2*i+1], relays, 2 * i);
+    if (workers[i] == 0) {
+      /* Worker: the cards are the parent's business */
+      c = cards[drv_card[i]];
+      c.drives[0].contr = &c;
+      c.drives[1].contr = &c;
+      drive = drv_unit[i];
+      return i;
+    }
+  }
 
-  if (sig == SIGINT) {
-    if (menu_intr_enabled && !menu_requested) {
-      menu_requested = 1;
-      return;
+  /* Parent: pass along the workers' output until they all finish */
+  for (;;) {
+    for (j = n = 0; j < 2 * ndrives; j++) {
+      pfd[j].fd = relays[j].fd;
+      pfd[j].events = POLLIN;
+      if (relays[j].fd >= 0) n++;
+    }
+    if (n == 0) break;
+    if (poll(pfd, 2 * ndrives, -1) == -1) {
+      if (errno == EINTR) continue;
+      fatal_msg(1, "poll failed: %s\n", strerror(errno));
+    }
+    for (j = 0; j < 2 * ndrives; j++) {
+      if (pfd[j].fd >= 0 && pfd[j].revents) {
+        relay_output(&relays[j], prefix[j/2]);
+      }
     }
-    sigaction(sig, &sa_dfl, NULL);
   }
 
-  cleanup();
-#if __DJGPP__
-  sigaction(sig, &sa_dfl, NULL);
-#endif
-  raise(sig);
+  msg(OUT_SUMMARY, "\n");
+  for (i = 0; i < ndrives; i++) {
+    waitpid(workers[i], &status, 0);
+    workers[i] = 0;
+    if (WIFEXITED(status) && WEXITSTATUS(status) == 0) {
+      msg(OUT_SUMMARY, "%s%s: done\n", prefix[i], names[i]);
+    } else {
+      failed++;
+      error_msg("%s%s: failed\n", prefix[i], names[i]);
+    }
+  }
+  exit(failed ? 1 : 0);
 }
+#endif
+
 
+/*
+ * Deferred retries (-D1).  Instead of retrying a failing track right
+ * away, the first pass writes what it got, notes the track, and moves
+ * on.  Once every track has been read, retry sweeps move the head back
+ * and forth across the disk, rereading each noted track once per
+ * sweep in head order, until it reads well enough or runs out of
+ * retries.  The track in the DMK file is rewritten in place whenever
+ * a retry improves on it.
+ */
+struct deferred {
+  int retry;                 /* retries done so far */
+  struct TrackStat written;  /* what is in the DMK file now */
+  unsigned char *merged;     /* with -j, the merged track and its state */
+  int merged_len;
+  struct TrackStat merged_stat;
+};
+struct deferred *deferred[MAX_TRACKS][2];
 
+/* Note what dmk_write just wrote, so that it can be taken back */
 void
-set_kind(void)
+dmk_note_written(struct TrackStat *w)
 {
-  kind_desc* kd = &kinds[kind-1];
-  cwclock = kd->cwclock;
-  fmthresh = kd->fmthresh;
-  mfmthresh1 = kd->mfmthresh1;
-  mfmthresh2 = kd->mfmthresh2;
-  dmktracklen = kd->cwtracklen;
-  mfmshort = kd->mfmshort;
-}
+  const struct TrackStat *stat = decode_stat(dec);
 
+  w->errcount = stat->errcount;
+  w->good_sectors = stat->good_sectors;
+  memcpy(w->enc_count, stat->enc_count, sizeof stat->enc_count);
+}
 
-/* Do a histogram of a track, also counting the total
-   number of catweasel clocks to go around the track.
-*/
-int
-do_histogram(int drive, int track, int side, int histogram[128],
-	     int* total_cycles, int* total_samples, float* first_peak)
+/* Take a track's stats back out of the totals before rewriting it */
+void
+dmk_unwrite(struct TrackStat *w)
 {
-  int b;
-  int i, tc, ts;
-  float peak;
-  int pwidth, psamps, psampsw;
+  int i;
 
-  tc = 0;
-  ts = 0;
-  for (i=0; i<128; i++) {
-    histogram[i] = 0;
+  total_good_sectors -= w->good_sectors;
+  total_errcount -= w->errcount;
+  if (w->errcount) {
+    err_tracks--;
+  } else if (w->good_sectors > 0) {
+    good_tracks--;
   }
-  catweasel_seek(&c.drives[drive], track);
-  /*
-   * Use index-to-index read without marking index edges.  Although
-   * this does count the width of the index pulse twice, it's fast and
-   * quite accurate enough for a histogram.
-   */
-  if (!catweasel_read(&c.drives[drive], side ^ reverse, 1, 0, 0)) {
-    return 0;
-  }
-  while ((b = catweasel_get_byte(&c)) != -1 && b < 0x80) {
-    histogram[b & 0x7f]++;
-    tc += b + 1;  /* not sure if the +1 is right */
-    ts++;
+  for (i = 0; i < N_ENCS; i++) {
+    total_enc_count[i] -= w->enc_count[i];
   }
+  decoder_set_rx02(dec, total_enc_count[RX02] > 0);
+}
 
-  /* Print histogram for debugging */
-  for (i=0; i<128; i+=8) {
-    msg(OUT_SAMPLES, "%3d: %06d %06d %06d %06d %06d %06d %06d %06d\n",
-	i, histogram[i+0], histogram[i+1], histogram[i+2], histogram[i+3],
-	histogram[i+4], histogram[i+5], histogram[i+6], histogram[i+7]);
+/* Note that the track just written needs more retries */
+void
+defer_track(int track, int side, int retry)
+{
+  struct deferred *d = (struct deferred *) calloc(1, sizeof(*d));
+
+  if (d == NULL)
+    fatal_msg(1, "Out of memory\n");
+  d->retry = retry;
+  dmk_note_written(&d->written);
+  if (accum_sectors) {
+    d->merged = (unsigned char *) malloc(dmktracklen);
+    if (d->merged == NULL)
+      fatal_msg(1, "Out of memory\n");
+    d->merged_len = decode_merge_save(dec, d->merged, &d->merged_stat);
   }
+  deferred[track][side] = d;
+}
+
+/* Forget a deferred track */
+void
+defer_drop(int track, int side)
+{
+  struct deferred *d = deferred[track][side];
 
-  /* Find first peak */
-  i = 0;
-  pwidth = 0;
-  psamps = 0;
-  psampsw = 0;
-  while (histogram[i] < 64 && i < 128) i++;
-  while (histogram[i] >= 64 && i < 128) {
-    pwidth++;
-    psamps += histogram[i];
-    psampsw += histogram[i] * i;
-    i++;
-  }
-  if (pwidth > 24) {
-    /* Track is blank */
-    peak = -1.0;
-  } else {
-    /* again not sure of +1.0 */
-    peak = ((float) psampsw) / psamps + 1.0;
+  if (d) {
+    free(d->merged);
+    free(d);
+    deferred[track][side] = NULL;
   }
+}
 
-  *total_cycles = tc;
-  *total_samples = ts;
-  *first_peak = peak;
-  return 1;
+/* Forget all deferred tracks */
+void
+defer_clear(void)
+{
+  int track;
+
+  for (track = 0; track < MAX_TRACKS; track++) {
+    defer_drop(track, 0);
+    defer_drop(track, 1);
+  }
 }
 
+/* Head position for the given track and retry */
+int
+retry_headpos(int track, int retry)
+{
+  int headpos = track * steps + ((steps == 2) ? (alternate & 1) : 0);
+
+  if ((steps == 2) && (alternate & 2) && (retry & 1)) {
+    headpos ^= 1;
+  }
+  return headpos;
+}
 
-/* Guess the kind of drive and media in use */
+/* Retry one deferred track.  next is the track * 2 + side to read
+   after this one, or -1. */
 void
-detect_kind(int drive)
+retry_deferred(int track, int side, int next)
 {
-  int histogram[128];
-  int total_cycles, total_samples;
-  float peak, rpm, dclock;
+  struct deferred *d = deferred[track][side];
+  const struct TrackStat *stat = decode_stat(dec);
+  int retry = ++d->retry;
+  int failing;
+
+  nsamples = read_ahead_finish(retry_headpos(track, retry), side);
+  if (nsamples < 0) {
+    nsamples = read_track(retry_headpos(track, retry), side, samples);
+  }
+  if (nsamples < 0)
+    fatal_msg(1, "Read error\n");
+  if (pipeline && next >= 0) {
+    read_ahead_start(retry_headpos(next / 2,
+                                   deferred[next / 2][next % 2]->retry + 1),
+                     next % 2);
+  }
+  total_retries++;
+  raw_save(track, side, retry + 1, retry_headpos(track, retry));
+
+  msg(OUT_TSUMMARY, "Track %d, side %d, pass %d:", track, side, retry + 1);
+  fflush(stdout);
+  trace_read(track, side, retry + 1);
+  decode_track(dec, samples, nsamples, NULL);
 
-  if (!do_histogram(drive, 0, 0, histogram,
-		    &total_cycles, &total_samples, &peak)) {
-    if (hole) {
-      fatal_msg(1, "No index hole detected\n");
-    } else {
-      fatal_msg(1, "No index hole; can't detect drive and media type\n"
-		"  Try using the -k flag to specify the correct type\n");
-    }
+  if (accum_sectors) {
+    decode_merge_restore(dec, d->merged, d->merged_len, &d->merged_stat);
+    decode_merge(dec);
+    d->merged_len = decode_merge_save(dec, d->merged, &d->merged_stat);
   }
 
-  if (peak < 0.0) {
-    /* Track is blank */
-    fatal_msg(1, "Track 0 side 0 is unformatted\n");
+  failing = ((accum_sectors ?
+	      d->merged_stat.errcount : stat->errcount) > 0 ||
+	     retry < min_retries[track][side] ||
+	     stat->good_sectors < min_sectors[track][side])
+	     && retry < retries[track][side];
+
+  if (accum_sectors) {
+    decode_use_merged(dec);
+  }
+  if (accum_sectors || stat->errcount <= d->written.errcount) {
+    /* Replace the track in the DMK file */
+    dmk_unwrite(&d->written);
+    if (fseek(dmk_file, sizeof(dmk_header) +
+	      (long) (track * sides + side) * dmk_header.tracklen,
+	      SEEK_SET) != 0)
+      fatal_msg(1, "Error seeking in DMK file\n");
+    dmk_write(min_sectors[track][side]);
+    dmk_note_written(&d->written);
   } else {
-    dclock = 7080.5 / peak;
+    msg(OUT_TSUMMARY, "[%d good, %d error%s; keeping earlier pass]\n",
+	stat->good_sectors, stat->errcount, plu(stat->errcount));
   }
+  fflush(stdout);
+  if (out_file) fflush(out_file);
 
-  /* Total cycles gives us the RPM */
-  rpm = 7080500.0 / ((float)total_cycles) * 60.0;
+  if (!failing) {
+    defer_drop(track, side);
+  }
+}
 
-  msg(OUT_SAMPLES, "Data clock approx %f kHz\n", dclock);
-  msg(OUT_SAMPLES, "Drive speed approx %f RPM\n", rpm);
+/* Run retry sweeps until no deferred tracks are left */
+void
+retry_sweeps(void)
+{
+  int list[2 * MAX_TRACKS];  /* track * 2 + side, in sweep order */
+  int n, i, ts, inward = 0;
 
-  if (rpm > 270.0 && rpm < 330.0) {
-    /* 300 RPM */
-    if (dclock > 225.0 && dclock < 287.5) {
-      /* Data rate 250 kHz */
-      kind = 2;
-    } else if (dclock > 450.0 && dclock < 575.0) {
-      /* Data rate 500 kHz */
-      kind = 4;
+  /* Let the DMK file be used while the sweeps run */
+  dmk_write_header();
+  fflush(dmk_file);
+
+  for (;;) {
+    /* The first pass left the head at the last track, so the first
+       sweep goes outward, and each later one turns around */
+    n = 0;
+    for (i = 0; i < 2 * dmk_header.ntracks; i++) {
+      ts = inward ? i : 2 * dmk_header.ntracks - 1 - i;
+      if (deferred[ts / 2][ts % 2]) {
+	list[n++] = ts;
+      }
     }
-  } else if (rpm > 330.0 && rpm < 396.0) {
-    /* 360 RPM */
-    if (dclock > 270.0 && dclock < 345.0) {
-      /* Data rate 300 kHz */
-      kind = 1;
-    } else if (dclock > 450.0 && dclock < 575.0) {
-      /* Data rate 500 kHz */
-      kind = 3;
+    if (n == 0) break;
+    msg(OUT_TSUMMARY, "Retry sweep %s, %d track%s\n",
+	inward ? "inward" : "outward", n, plu(n));
+    for (i = 0; i < n; i++) {
+      retry_deferred(list[i] / 2, list[i] % 2, (i + 1 < n) ? list[i + 1] : -1);
     }
+    inward = !inward;
   }
+  defer_clear();
+}
 
-  if (kind == -1) {
-    fatal_msg(1, "Failed to detect drive and media type\n"
-	      "  Data clock approx %f kHz\n"
-	      "  Drive speed approx %f RPM\n", dclock, rpm);
-  }
-  set_kind();
 
-  msg(OUT_QUIET + 1, "Detected %s\n", kinds[kind-1].description);
+/*
+ * Survey (not in replay mode).  Before the main pass, read a few
+ * tracks to settle the number of sides and the stepping, so that the
+ * main pass never has to restart from track 0 after a wrong guess.
+ * The number of tracks is still found by the main pass, which just
+ * stops at the first track past the end of the disk; that never needs
+ * a restart, and surveying it would cost seeks to the end and back.
+ * The survey decodes with the same rules the main pass uses (good
+ * sectors, cylinder numbers, sector size, backward marks), so it
+ * decides as the main pass would have; a histogram can't tell an
+ * unformatted track from the overlap of two wide-head tracks.  It has
+ * a decoder of its own, so that the main pass starts afresh, just as
+ * it does when replaying a capture of the disk.
+ */
+struct decoder *sdec;
+
+/* Read and decode one track for the survey; return good sectors */
+int
+survey_read(int headpos, int side)
+{
+  msg(OUT_ERRORS, "Survey head position %d, side %d:", headpos, side);
   fflush(stdout);
+  nsamples = read_track(headpos, side, samples);
+  if (nsamples < 0)
+    fatal_msg(1, "Read error\n");
+  decoder_set_encoding(sdec, uencoding == RX02 ? FM : uencoding);
+  decode_track(sdec, samples, nsamples, NULL);
+  msg(OUT_ERRORS, "[%d good, %d error%s]\n", decode_stat(sdec)->good_sectors,
+      decode_stat(sdec)->errcount, plu(decode_stat(sdec)->errcount));
+  return decode_stat(sdec)->good_sectors;
 }
 
-
-/* Check if back side is formatted */
-int
-detect_sides(int drive)
+void
+survey(int guess_sides, int guess_steps)
 {
-  int res = 1;
-  int histogram[128];
-  int total_cycles, total_samples;
-  float peak;
+  int t0s0ss = -1, track, headpos;
 
-  if (!do_histogram(drive, 0, 1, histogram,
-		    &total_cycles, &total_samples, &peak)) {
-    fatal_msg(1, "No index hole; can't detect if side 1 is formatted\n");
+  dmk_header.tracklen = dmktracklen;
+  set_decoder();
+  sdec = decoder_new(&dec_params);
+  if (sdec == NULL)
+    fatal_msg(1, "Out of memory\n");
+  decoder_set_msg(sdec, decoder_msg, NULL, log_level());
+
+  /* Track 0 side 0 gives the sector size to compare the sides by */
+  if (survey_read(0, 0) > 0) {
+    t0s0ss = decode_secsize(decode_sizecode(sdec), decode_encoding(sdec),
+			    maxsize, quirk);
+  }
+
+  if (sides == 2 && (guess_sides || check_compat_sides)) {
+    if (survey_read(0, 1) == 0) {
+      if (decode_backward_am(sdec) >= 9 &&
+	  decode_backward_am(sdec) > decode_stat(sdec)->errcount) {
+	msg(OUT_ERRORS, "[possibly a flippy disk]\n");
+	flippy = 1;
+      }
+      if (guess_sides) {
+	sides = 1;
+	msg(OUT_QUIET + 1, "[apparently single-sided]\n");
+      }
+    } else if (check_compat_sides && t0s0ss != 512 &&
+	       decode_secsize(decode_sizecode(sdec), decode_encoding(sdec),
+			      maxsize, quirk) == 512) {
+      sides = 1;
+      msg(OUT_QUIET + 1, "[Incompatible formats detected "
+	  "between sides; reading single-sided]\n");
+    }
   }
 
-  if (peak > 0.0) {
-    float dclock = 7080.5 / peak;
-    if (dclock > 225.0 && dclock < 575.0) {
-      res = 2;
+  if (guess_steps) {
+    for (track = 1; track <= 3; track += 2) {
+      if (steps == 1) {
+	/* A single-stepped disk has a track at every position */
+	if (survey_read(track, 0) == 0) {
+	  msg(OUT_QUIET + 1, "[double-stepping apparently needed]\n");
+	  steps = 2;
+	  break;
+	}
+      } else {
+	/* Double stepping over an 80-track disk skips cylinders */
+	headpos = track * 2 + (alternate & 1);
+	if (survey_read(headpos, 0) > 0 && decode_cylseen(sdec) == track * 2) {
+	  msg(OUT_QUIET + 1, "[single-stepping apparently needed]\n");
+	  steps = 1;
+	  break;
+	}
+      }
     }
   }
-  msg(OUT_QUIET + 1, "Detected side 1 %sformatted\n",
-      res == 1 ? "not " : "");
-  fflush(stdout);
-  return res;
+  decoder_free(sdec);
+  sdec = NULL;
 }
 
 
-/* Command-line parameters */
-int port = 0;
-int tracks = -1;
-int sides = -1;
-int steps = -1;
-int drive = -1;
-int alternate = 0;
-int min_sectors[MAX_TRACKS][2];
-int retries[MAX_TRACKS][2];
-int min_retries[MAX_TRACKS][2];
-
 void usage(void)
 {
-  printf("\nUsage: cw2dmk [options] file.dmk\n");
+  printf("\nUsage: cw2dmk [options] file.dmk [file.dmk...]\n");
   printf("\n Options [defaults in brackets]:\n");
   printf(" -d drive      Drive unit, 0 or 1, or -1 to autodetect [%d]\n",
 	 drive);
+  printf("               or a list of [card:]unit, e.g. 0,1 or 0:0,1:0,\n");
+  printf("               to read several drives at once, one file each\n");
   printf(" -v verbosity  Amount of output [%d]\n", out_level);
   printf("               0 = No output\n");
   printf("               1 = Summary of disk\n");
@@ -1570,12 +1635,22 @@ void usage(void)
   printf("               7 = like 5, but with Catweasel samples too\n");
   printf("               21 = level 2 to logfile, 1 to screen, etc.\n");
   printf(" -u logfile    Log output to the given file [none]\n");
-  printf(" -R logfile    Replay a level 7 log instead of reading from disk\n");
+  printf(" -R file       Replay a level 7 log, -F capture, or SCP, KryoFlux,\n");
+  printf("               or HFE flux image instead of the disk\n");
+  printf(" -J jobs       Decode a replay on jobs threads [#cpus]\n");
+  printf(" -F rawfile    Also save every read's raw samples to rawfile\n");
+  printf(" -Z level      Compress rawfile, zlib level 1-9 or 0 for none [%d]\n",
+         raw_compress);
+  printf(" -E scpfile    Also save every read as a SuperCard Pro flux image\n");
+  printf(" -B tracefile  Also write the decoder's events to tracefile\n");
+  printf("               (print with cwtrace)\n");
   printf(" -M {i,e,d}    Menu control [d]\n");
   printf("               i = Interrupt (^C) invokes menu\n");
   printf("               e = Errors equals retries invokes menu\n");
   printf("               d = Disables invoking menu\n");
   printf(" -C {0,1}      Compare sides for incompatible formats [1]\n");
+  printf(" -P {0,1}      Read next track while decoding this one [%d]\n",
+         pipeline);
   printf("\n Options to manually set values that are normally autodetected\n");
   printf(" -p port       I/O port base (MK1) or card number (MK3/4) [%d]\n",
 	 port);
@@ -1601,10 +1676,14 @@ void usage(void)
   printf("               2 = even, then odd\n");
   printf("               3 = odd, then even\n");
   printf(" -j            Join sectors between retries\n");
+  printf(" -D {0,1}      Defer retries to sweeps after the first pass [%d]\n",
+	 defer);
   printf(" -o postcomp   Amount of read-postcompensation (0.0-1.0) [%.2f]\n",
 	 postcomp);
   printf(" -h hole       Track start: 1 = index hole, 0 = anywhere [%d]\n",
 	 hole);
+  printf(" -n revs       Read revs revolutions from index hole; 0 = off [%d]\n",
+	 revs);
   printf(" -g ign        Ignore first ign bytes of track [%d]\n", dmk_ignore);
   printf(" -i ipos       Force IAM to ipos from track start; "
 	 "if -1, don't [%d]\n", dmk_iam_pos);
@@ -1848,13 +1927,17 @@ strtod_strict(const char *nptr, const char *name)
 int
 main(int argc, char** argv)
 {
-  int ch, track, side, headpos, readtime = 0, i;
+  int ch, track, side, headpos, i;
   int guess_sides = 0, guess_steps = 0, guess_tracks = 0, x_given = 0;
   int T_given = 0;
   int cw_mk = 1;
   char *replay = NULL;
   FILE *replay_file = NULL;
+  log_reader *replay_log = NULL;
+  cwraw_file *raw_replay = NULL;  /* replaying a binary capture */
   char optname[3] = "-?";
+  char *dmk_name;
+  const struct TrackStat *stat;
 
   for (int i = 0; i < COUNT_OF(retries); ++i) {
     retries[i][0] = RETRIES_DEFAULT;
@@ -1865,7 +1948,7 @@ main(int argc, char** argv)
   for (;;) {
     ch = getopt(argc, argv,
 		"p:d:v:u:k:m:t:s:e:w:x:a:o:h:g:i:z:r:q:c:"
-		"1:2:f:l:jM:C:R:S:X:T:");
+		"1:2:f:l:jn:M:C:P:R:S:X:T:D:F:Z:J:E:B:");
     if (ch == -1) break;
     optname[1] = ch;
     switch (ch) {
@@ -1880,8 +1963,17 @@ main(int argc, char** argv)
       }
       break;
     case 'd':
+      if (strpbrk(optarg, ",:")) {
+        if (parse_drives(optarg)) usage();
+        if (ndrives == 1) {
+          if (drv_card[0] != -1) port = drv_card[0];
+          drive = drv_unit[0];
+        }
+        break;
+      }
       drive = strtol_strict(optarg, 0, optname);
       if (drive < -1 || drive > 1) usage();
+      ndrives = 1;
       break;
     case 'v':
       out_level = strtol_strict(optarg, 0, optname);
@@ -1935,6 +2027,10 @@ main(int argc, char** argv)
       hole = strtol_strict(optarg, 0, optname);
       if (hole < 0 || hole > 1) usage();
       break;
+    case 'n':
+      revs = strtol_strict(optarg, 0, optname);
+      if (revs < 0) usage();
+      break;
     case 'g':
       dmk_ignore = strtol_strict(optarg, 0, optname);
       break;
@@ -2001,9 +2097,38 @@ main(int argc, char** argv)
     case 'C':
       check_compat_sides = strtol_strict(optarg, 0, optname);
       break;
+    case 'P':
+      pipeline = strtol_strict(optarg, 0, optname);
+#if !HAVE_PIPELINE
+      if (pipeline) {
+        fatal_msg(1, "-P1 is not supported on this platform\n");
+      }
+#endif
+      break;
     case 'R':
       replay = optarg;
       break;
+    case 'J':
+      jobs = strtol_strict(optarg, 0, optname);
+      if (jobs < 1) usage();
+      break;
+    case 'F':
+      raw_name = optarg;
+      break;
+    case 'E':
+      scp_name = optarg;
+      break;
+    case 'B':
+      trace_name = optarg;
+      break;
+    case 'Z':
+      raw_compress = strtol_strict(optarg, 0, optname);
+      if (raw_compress < 0 || raw_compress > 9) usage();
+      break;
+    case 'D':
+      defer = strtol_strict(optarg, 0, optname);
+      if (defer < 0 || defer > 1) usage();
+      break;
     case 'S':
       if (parse_tracks(optarg, min_sectors)) usage();
       break;
@@ -2021,10 +2146,37 @@ main(int argc, char** argv)
     }
   }
 
-  if (replay) {
-    if (kind == -1) {
-      fatal_msg(1, "Replay (-R) mode requires -k option\n");
+  if (ndrives > 1) {
+#if !HAVE_MULTI
+    fatal_msg(1, "Multiple drives are not supported on this platform\n");
+#endif
+    if (replay || menu_intr_enabled || menu_err_enabled || out_file_name ||
+        raw_name || scp_name || trace_name) {
+      fatal_msg(1, "Multiple drives can't be used with options "
+                "-R, -M, -u, -F, -E, or -B\n");
+    }
+    if (port >= MK1_MIN_PORT) {
+      fatal_msg(1, "Multiple drives need a Catweasel MK3 or MK4\n");
+    }
+    if (argc - optind != ndrives) {
+      fatal_msg(1, "%d drives given, but %d DMK files\n",
+                ndrives, argc - optind);
     }
+    for (i = 0; i < ndrives; i++) {
+      if (drv_card[i] == -1) drv_card[i] = port;
+      for (ch = 0; ch < i; ch++) {
+        if (drv_card[ch] == drv_card[i] && drv_unit[ch] == drv_unit[i]) {
+          fatal_msg(1, "Drive %d:%d given twice\n", drv_card[i], drv_unit[i]);
+        }
+      }
+    }
+  }
+
+  if (defer && (replay || menu_intr_enabled || menu_err_enabled)) {
+    fatal_msg(1, "Deferred retries (-D1) can't be used with -R or -M\n");
+  }
+
+  if (replay) {
     if (steps != -1 || menu_intr_enabled != 0 || menu_err_enabled != 0 ||
         drive != -1 || port != 0 || alternate != 0 ||
         reverse != 0 || x_given != 0 || T_given != 0) {
@@ -2042,24 +2194,7 @@ main(int argc, char** argv)
   if (optind >= argc) {
     usage();
   }
-
-  if (out_file_name && out_file_level == OUT_QUIET) {
-    /* Default: log to file at same level as screen */
-    out_file_level = out_level;
-  }
-  if (!out_file_name && out_file_level > OUT_QUIET) {
-    char *p;
-    int len;
-
-    p = strrchr(argv[optind], '.');
-    if (p == NULL) {
-      len = strlen(argv[optind]);
-    } else {
-      len = p - argv[optind];
-    }
-    out_file_name = (char *) malloc(len + 5);
-    sprintf(out_file_name, "%.*s.log", len, argv[optind]);
-  }
+  dmk_name = argv[optind];
 
   /* Keep drive from spinning endlessly on (expected) signals */
   struct sigaction sa_def = { .sa_handler = handler, .sa_flags = SA_RESETHAND };
@@ -2071,13 +2206,21 @@ main(int argc, char** argv)
       fatal_msg(1, "sigaction failed for signal %d.\n", sigs[s]);
   }
 
-  if (!replay) {
+  char *simfile = getenv("CWSIM");
+  if (!replay && !simfile) {
 #if linux
     if (geteuid() != 0)
       fatal_msg(1, "Must be setuid to root or be run as root\n");
 #endif
     /* Detect PCI catweasel */
-    if (port < 10) {
+    if (ndrives > 1) {
+      for (i = 0; i < ndrives; i++) {
+        if (card_port[drv_card[i]] == 0) {
+          card_port[drv_card[i]] =
+            pci_find_catweasel(drv_card[i], &card_mk[drv_card[i]]);
+        }
+      }
+    } else if (port < 10) {
       port = pci_find_catweasel(port, &cw_mk);
     }
 
@@ -2086,7 +2229,7 @@ main(int argc, char** argv)
     /* We avoid opening files and calling msg() before this point */
     if ((cw_mk == 1 &&
          ioperm(port == -1 ? MK1_DEFAULT_PORT : port, 8, 1) == -1) ||
-        (cw_mk >= 3 && iopl(3) == -1)) {
+        ((cw_mk >= 3 || ndrives > 1) && iopl(3) == -1)) {
       fatal_msg(1, "No access to I/O ports\n");
     }
 #endif
@@ -2096,11 +2239,78 @@ main(int argc, char** argv)
     fatal_msg(1, "setuid failed: %s\n", strerror(errno));
 #endif
 
+  /* Use the simulated Catweasel if requested */
+  if (!replay && simfile) {
+    port = cwsim_init(simfile, &cw_mk);
+    if (port == -1)
+      fatal_msg(1, "Failed to start Catweasel simulator\n");
+    card_port[0] = port;
+    card_mk[0] = cw_mk;
+  }
+
+#if HAVE_MULTI
+  /* Start a worker process for each drive */
+  if (ndrives > 1) {
+    dmk_name = argv[optind + run_drives(argv + optind)];
+  }
+#endif
+
+  if (out_file_name && out_file_level == OUT_QUIET) {
+    /* Default: log to file at same level as screen */
+    out_file_level = out_level;
+  }
+  if (!out_file_name && out_file_level > OUT_QUIET) {
+    char *p;
+    int len;
+
+    p = strrchr(dmk_name, '.');
+    if (p == NULL) {
+      len = strlen(dmk_name);
+    } else {
+      len = p - dmk_name;
+    }
+    out_file_name = (char *) malloc(len + 5);
+    sprintf(out_file_name, "%.*s.log", len, dmk_name);
+  }
+
+
   /* Open replay file if specified */
   if (replay) {
-    replay_file = fopen(replay, "r");
-    if (replay_file == NULL)
+    cwraw_info info;
+    flux_info finfo;
+
+    raw_replay = cwraw_open(replay, &info);
+    if (raw_replay) {
+      /* A binary capture records its kind and clock */
+      if (kind == -1) {
+        if (info.kind < 1 || info.kind > 4)
+          fatal_msg(1, "Bad kind %d in '%s'\n", info.kind, replay);
+        kind = info.kind;
+        set_kind();
+        cwclock = info.cwclock;
+      }
+    } else if (errno != EINVAL) {
       fatal_msg(1, "Failed to open '%s': %s\n", replay, strerror(errno));
+    } else if ((flux_replay = flux_open(replay, &finfo)) != NULL) {
+      /* A flux image from other hardware; resample it as it is read */
+      if (kind == -1) {
+        kind = flux_kind(flux_replay);
+        if (kind == -1)
+          fatal_msg(1, "No tracks in '%s'\n", replay);
+        set_kind();
+      }
+      flux_tracks = finfo.tracks;
+    } else {
+      if (kind == -1) {
+        fatal_msg(1, "Replay (-R) of a log file requires -k option\n");
+      }
+      replay_file = fopen(replay, "r");
+      if (replay_file == NULL)
+        fatal_msg(1, "Failed to open '%s': %s\n", replay, strerror(errno));
+      replay_log = log_reader_new(replay_file);
+      if (replay_log == NULL)
+        fatal_msg(1, "Out of memory\n");
+    }
   }
 
   /* Open log file if needed */
@@ -2118,7 +2328,7 @@ main(int argc, char** argv)
   }
   msg(OUT_ERRORS, "\n");
 
-  if (!replay) {
+  if (!replay && !c.shared) {
     /* Finish detecting and initializing Catweasel */
     if (port == -1) {
       port = MK1_DEFAULT_PORT;
@@ -2138,7 +2348,9 @@ main(int argc, char** argv)
     if (cw_mk == 1 && cwclock == 4) {
       fatal_msg(1, "Catweasel MK1 does not support 4x clock\n");
     }
+  }
 
+  if (!replay) {
     if (atexit(cleanup))
       fatal_msg(1, "Can't establish atexit() call.\n");
 
@@ -2147,7 +2359,9 @@ main(int argc, char** argv)
       for (drive = 0; drive < 2; drive++) {
         msg(OUT_SUMMARY, "Looking for drive %d...", drive);
         fflush(stdout);
+        catweasel_lock(&c.drives[drive]);
         catweasel_detect_drive(&c.drives[drive]);
+        catweasel_unlock(&c.drives[drive]);
         if (c.drives[drive].type == 1) {
           msg(OUT_SUMMARY, "detected\n");
           break;
@@ -2160,7 +2374,9 @@ main(int argc, char** argv)
     } else {
       msg(OUT_SUMMARY, "Looking for drive %d...", drive);
       fflush(stdout);
+      catweasel_lock(&c.drives[drive]);
       catweasel_detect_drive(&c.drives[drive]);
+      catweasel_unlock(&c.drives[drive]);
       if (c.drives[drive].type == 1) {
         msg(OUT_SUMMARY, "detected\n");
       } else {
@@ -2170,8 +2386,9 @@ main(int argc, char** argv)
     }
 
     /* Select drive, start motor, wait for spinup */
-    catweasel_select(&c, !drive, drive);
+    catweasel_lock(&c.drives[drive]);
     catweasel_set_motor(&c.drives[drive], 1);
+    catweasel_unlock(&c.drives[drive]);
     catweasel_usleep(500000);
 
     /* Guess or detect various parameters if not supplied */
@@ -2189,8 +2406,15 @@ main(int argc, char** argv)
       guess_steps = 1;
     }
 
+    /* Let waits for the end of a read sleep through most of it */
+    revtime = kinds[kind-1].readtime;
+    c.rev_us = revtime * 1000;
+
     /* Set parameters for reading with or without an index hole. */
-    if (hole) {
+    if (revs) {
+      /* Up to a revolution awaiting the hole, then revs plus a bit */
+      readtime = (revs + 2) * revtime;
+    } else if (hole) {
       /* Use hardware hole-to-hole read */
       readtime = 0;
     } else {
@@ -2199,6 +2423,14 @@ main(int argc, char** argv)
     }
   }
 
+  /* Settle sides and stepping before the main pass */
+  if (!replay &&
+      (guess_sides || guess_steps || (check_compat_sides && sides == 2))) {
+    survey(guess_sides, guess_steps);
+    guess_sides = 0;
+    guess_steps = 0;
+  }
+
   /* Guess tracks if not supplied */
   if (tracks == -1) {
     tracks = TRACKS_GUESS / steps;
@@ -2206,27 +2438,63 @@ main(int argc, char** argv)
   }
 
   /* Open output file */
-  dmk_file = fopen(argv[optind], "wb");
+  dmk_file = fopen(dmk_name, "wb");
   if (dmk_file == NULL)
-    fatal_msg(1, "Failed to open '%s': %s\n", argv[optind], strerror(errno));
+    fatal_msg(1, "Failed to open '%s': %s\n", dmk_name, strerror(errno));
+
+  /* Open raw capture file if specified */
+  if (raw_name) {
+    cwraw_info info;
+    info.mk = replay ? 0 : c.mk;
+    info.cwclock = cwclock;
+    info.kind = kind;
+    info.steps = steps;
+    info.compress = raw_compress;
+    raw_file = cwraw_create(raw_name, &info);
+    if (raw_file == NULL)
+      fatal_msg(1, "Failed to open '%s': %s\n", raw_name, strerror(errno));
+  }
+
+  /* Open SCP flux image if specified */
+  if (scp_name) {
+    scp_out = scp_create(scp_name, cwclock,
+                         (kind == 1 || kind == 3) ? 360 : 300);
+    if (scp_out == NULL)
+      fatal_msg(1, "Failed to open '%s': %s\n", scp_name, strerror(errno));
+  }
+
+  /* Open decoder event trace if specified */
+  if (trace_name) {
+    trace_out = decode_trace_create(trace_name);
+    if (trace_out == NULL)
+      fatal_msg(1, "Failed to open '%s': %s\n", trace_name, strerror(errno));
+  }
+
+  /* Decode ahead on other threads, if the reads are all there */
+  if (raw_replay || flux_replay) {
+    pool_start(raw_replay);
+  }
 
  restart:
   if (guess_sides || guess_steps || guess_tracks) {
     msg(OUT_SUMMARY,
 	"Trying %d side%s, %d tracks/side, %s stepping, %s encoding\n",
 	sides, plu(sides), tracks, (steps == 1) ? "single" : "double",
-	enc_name[uencoding]);
+	decode_enc_name(uencoding));
   }
   fflush(stdout);
+  defer_clear();
+  set_decoder();
   total_errcount = 0;
   total_retries = 0;
   total_good_sectors = 0;
   for (i = 0; i < N_ENCS; i++) {
     total_enc_count[i] = 0;
   }
+  decoder_set_rx02(dec, 0);
   good_tracks = 0;
   err_tracks = 0;
-  first_encoding = (uencoding == RX02 ? FM : uencoding);
+  decoder_set_encoding(dec, uencoding == RX02 ? FM : uencoding);
 
   /* Set DMK parameters */
   memset(&dmk_header, 0, sizeof(dmk_header));
@@ -2237,41 +2505,61 @@ main(int argc, char** argv)
 		       ((uencoding == RX02) ? DMK_RX02_OPT : 0);
   dmk_header.quirks = quirk;
   dmk_write_header();
-  if (dmk_track) free(dmk_track);
-  dmk_track = (unsigned char*) malloc(dmktracklen);
-  if (accum_sectors) {
-    if (dmk_merged_track) free(dmk_merged_track);
-    dmk_merged_track = (unsigned char*) malloc(dmktracklen);
-    dmk_merged_track_len = 0;
-    memset(dmk_merged_track, 0, dmktracklen);
-    if (dmk_tmp_track) free(dmk_tmp_track);
-    dmk_tmp_track = (unsigned char*) malloc(dmktracklen);
-  }
 
   /* Loop over tracks */
   for (track=0; track<tracks; track++) {
-    prevcylseen = cylseen;
+    prevcylseen = decode_cylseen(dec);
     headpos = track * steps + ((steps == 2) ? (alternate & 1) : 0);
 
     /* Loop over sides */
     for (side=0; side<sides; side++) {
       int retry = 0;
       int failing;
+      int deferring = 0;
 
       if (accum_sectors) {
-	dmk_merged_track_len = 0;
-	memset(dmk_merged_track, 0, dmktracklen);
-	// Do not have to initialize merged_stat as dmk_merged_track_len == 0
-	// will stop us from using that information.
+	decode_merge_start(dec);
       }
 
       /* Loop over retries */
       do {
        try_start:
-        if (replay) {
+        if (raw_replay || flux_replay) {
+          /* Go straight to this pass in the capture */
+          const unsigned char *p;
+          int n;
+          p = pool_find(track, side, retry + 1, &n);
+          if (p == NULL) {
+            p = replay_find(raw_replay, track, side, retry + 1, &n);
+          }
+          if (p == NULL) {
+            if (retry > 0) {
+              /* No more passes; done with retries. */
+              break;
+            } else if (track >= (raw_replay ? cwraw_tracks(raw_replay)
+                                            : flux_tracks)) {
+              msg(OUT_ERRORS, "[end of replay data]\n");
+              dmk_header.ntracks = track;
+              goto done;
+            } else if (sides == 2 && track == 0 && side == 1 &&
+                       replay_find(raw_replay, 1, 0, 1, &n)) {
+              /* Capture has only one side. */
+              sides = 1;
+              dmk_header.options |= DMK_SSIDE_OPT;
+              msg(OUT_ERRORS, "[apparently single-sided]\n");
+              goto track_done;
+            }
+            /* This track/side is missing; decode it as empty. */
+            nsamples = 0;
+          } else {
+            /* Decode in place; nothing writes to the samples. */
+            samples = (unsigned char *) p;
+            nsamples = n;
+          }
+        } else if (replay) {
           /* Get track to replay */
           int rtrack, rside, rpass;
-          rtrack = parse_track(replay_file, &rside, &rpass);
+          rtrack = parse_track(replay_log, &rside, &rpass);
           if (rtrack == EOF) {
             msg(OUT_ERRORS, "[end of replay data]\n");
             if (retry == 0) {
@@ -2300,7 +2588,7 @@ main(int argc, char** argv)
                      (rtrack == track && rside < side)) {
             /* This is a retry of the previous track; not needed. */
             msg(OUT_ERRORS, "[skipping unneeded retry]\n");
-            parse_sample(replay_file); // discard a sample to skip track
+            parse_sample(replay_log); // discard a sample to skip track
             goto try_start;
           } else if (rtrack != track) {
 	    fatal_msg(1, "Unexpected replay, track %d, side %d, pass %d\n",
@@ -2311,123 +2599,59 @@ main(int argc, char** argv)
           if ((steps == 2) && (retry > 0) && (alternate & 2)) {
             headpos ^= 1;
           }
-          catweasel_seek(&c.drives[drive], headpos);
-#if DEBUG5
-          if (c.mk == 1) {
-            catweasel_fillmem(&c, DEBUG5_BYTE);
-          }
-#endif
-          int cw_ret;
-          if (hole) {
-            /*
-             * Do read from index hole to index hole.
-             */
-            cw_ret = catweasel_read(&c.drives[drive], side ^ reverse, cwclock,
-                                    0, 0);
-          } else {
-            /*
-             * Do read.  Store index holes in the data stream; this
-             * helps detect wraparound and avoid duplicating data.
-             */
-            cw_ret = catweasel_read(&c.drives[drive], side ^ reverse, cwclock,
-                                    readtime, 1);
+          nsamples = read_ahead_finish(headpos, side);
+          if (nsamples < 0) {
+            nsamples = read_track(headpos, side, samples);
           }
-          if (!cw_ret)
+          if (nsamples < 0)
 	    fatal_msg(1, "Read error\n");
+          if (pipeline && !ahead.skip) {
+            /* Guess that this read will be good and start on the next */
+            if (side + 1 < sides) {
+              read_ahead_start(headpos, side + 1);
+            } else if (track + 1 < tracks) {
+              read_ahead_start((track + 1) * steps +
+                               ((steps == 2) ? (alternate & 1) : 0), 0);
+            }
+          }
         }
 
-	msg(OUT_TSUMMARY, "Track %d, side %d, pass %d:",
-	    track, side, retry + 1);
-	fflush(stdout);
-
-#if DEBUG3
-	int histogram[128], i;
-	for (i=0; i<128; i++) histogram[i] = 0;
-#endif
-	dmk_init_track();
-	init_decoder();
-
-	/* Loop over samples */
-	int b = 0;
-	int oldb = 0;
-	index_edge = 0;
-	while (!dmk_full ||
-               out_level >= OUT_SAMPLES || out_file_level >= OUT_SAMPLES) {
-          if (replay) {
-            b = parse_sample(replay_file);
-          } else {
-            b = catweasel_get_byte(&c);
+        if (replay_log) {
+          /* Collect the samples exactly as the hardware path would */
+          int r, oldr = 0;
+          nsamples = 0;
+          while (nsamples < CW_MEMSIZE &&
+                 (r = parse_sample(replay_log)) != -1 &&
+                 !(r == 0x00 && oldr == 0x80)) {
+            samples[nsamples++] = r;
+            oldr = r;
           }
-	  if (b == -1 || (b == 0x00 && oldb == 0x80)) {
-	    msg(OUT_HEX, "[end of data] ");
-	    break;
-	  }
-#if DEBUG5
-	  if (c.mk == 1 && b == DEBUG5_BYTE) {
-	    static int ecount = 0;
-	    ecount++;
-	    if (ecount == 16)
-	      error_msg("Catweasel memory error?! See cw2dmk.txt\n");
-	  }
-#endif
-	  /*
-	   * Index hole edge check.
-	   */
-	  if ((oldb ^ b) & 0x80) {
-	    index_edge++;
-	    msg(OUT_HEX, (b & 0x80) ? "{" : "}");
-	  }
-	  oldb = b;
-	  b &= 0x7f;
-#if DEBUG3
-	  histogram[b]++;
-#endif
+        }
 
-	  /* Process this sample */
-	  process_sample(b);
-	}
+	raw_save(track, side, retry + 1, headpos);
 
-	/*
-	 * All samples read; finish up this (re)try.
-	 */
-#if DEBUG3
-	/* Print histogram for debugging */
-	for (i=0; i<128; i+=8) {
-	  printf("%3d: %06d %06d %06d %06d %06d %06d %06d %06d\n", i,
-		 histogram[i+0], histogram[i+1], histogram[i+2],
-		 histogram[i+3], histogram[i+4], histogram[i+5],
-		 histogram[i+6], histogram[i+7]);
-	}
-#endif
-	flush_bits();
-	check_missing_dam();
-	if (ibyte != -1) {
-	  /* Ignore incomplete sector IDs; assume they are wraparound */
-	  msg(OUT_IDS, "[wraparound] ");
-	  *--dmk_idam_p = 0;
-	}
-	if (dbyte != -1) {
-	  errcount++;
-	  msg(OUT_ERRORS, "[incomplete sector data] ");
-	}
-        if (ebyte != -1) {
-	  errcount++;
-	  msg(OUT_ERRORS, "[incomplete extra data] ");
-        }
-	msg(OUT_IDS, "\n");
-	if (track == 0 && side == 1 && good_sectors == 0 &&
-	    backward_am >= 9 && backward_am > errcount) {
+	msg(OUT_TSUMMARY, "Track %d, side %d, pass %d:",
+	    track, side, retry + 1);
+	fflush(stdout);
+	trace_read(track, side, retry + 1);
+	pool_decode();
+	stat = decode_stat(dec);
+	if (track == 0 && side == 1 && stat->good_sectors == 0 &&
+	    decode_backward_am(dec) >= 9 &&
+	    decode_backward_am(dec) > stat->errcount) {
 	  msg(OUT_ERRORS, "[possibly a flippy disk] ");
 	  flippy = 1;
 	}
-	if (check_compat_sides && sides == 2 &&
-	  track == 0 && good_sectors > 0) {
+	/* Outside replay mode, the survey has already checked this */
+	if (replay && check_compat_sides && sides == 2 &&
+	  track == 0 && stat->good_sectors > 0) {
 	  static int t0s0ss = -1;
+	  int ss = decode_secsize(decode_sizecode(dec), decode_encoding(dec),
+				  maxsize, quirk);
 	  if (side == 0) {
-	    t0s0ss = secsize(sizecode, curenc, maxsize, quirk);
+	    t0s0ss = ss;
 	  } else {
-	    if (t0s0ss != 512 &&
-                secsize(sizecode, curenc, maxsize, quirk) == 512) {
+	    if (t0s0ss != 512 && ss == 512) {
 	      msg(OUT_QUIET + 1, "[Incompatible formats detected "
 		"between sides; restarting single-sided]\n");
 	      t0s0ss = -1;
@@ -2436,40 +2660,10 @@ main(int argc, char** argv)
 	    }
 	  }
 	}
-	if (guess_sides && side == 1) {
-	  guess_sides = 0;
-	  if (good_sectors == 0) {
-	    sides = 1;
-	    dmk_header.options |= DMK_SSIDE_OPT;
-	    msg(OUT_QUIET + 1, "[apparently single-sided]\n");
-	    goto track_done;
-	  }
-	}
-	if (guess_steps) {
-	  if (track == 3) guess_steps = 0;
-	  if (steps == 1) {
-	    if ((track & 1) && (good_sectors == 0)) {
-	      msg(OUT_QUIET + 1,
-		  "[double-stepping apparently needed; restarting]\n");
-	      guess_steps = 0;
-	      steps = 2;
-	      if (guess_tracks) tracks = TRACKS_GUESS / steps;
-	      goto restart;
-	    }
-	  } else {
-	    if (good_sectors && track > 0 && cylseen == track * 2) {
-	      msg(OUT_QUIET + 1,
-		"[single-stepping apparently needed; restarting]\n");
-	      steps = 1;
-	      if (guess_tracks) tracks = TRACKS_GUESS / steps;
-	      goto restart;
-	    }
-	  }
-	}
 	if (guess_tracks && (track == 35 || track >= 40) &&
-	    (good_sectors == 0 ||
-	     (side == 0 && cylseen == prevcylseen) ||
-	     (side == 0 && track >= 80 && cylseen == track/2))) {
+	    (stat->good_sectors == 0 ||
+	     (side == 0 && decode_cylseen(dec) == prevcylseen) ||
+	     (side == 0 && track >= 80 && decode_cylseen(dec) == track/2))) {
 	  msg(OUT_QUIET + 1, "[apparently only %d tracks; done]\n", track);
 	  dmk_header.ntracks = track;
 	  goto done;
@@ -2484,34 +2678,47 @@ main(int argc, char** argv)
 	  if (!fp)
 	    error_msg("Could not write to '%s'\n", filename);
 	  else {
-	    if (fwrite(dmk_track, dmk_data_p - dmk_track, 1, fp) != 1)
+	    if (fwrite(decode_dmk_track(dec), decode_dmk_used(dec), 1, fp) != 1)
 	      error_msg("Error writing track to '%s'\n", filename);
 	    if (fclose(fp))
 	      error_msg("Error closing '%s'\n", filename);
 	  }
 	  #endif
 
-	  dmk_merge_sectors();
+	  decode_merge(dec);
 	}
 
-	failing = ((accum_sectors ? merged_stat.errcount : errcount) > 0 ||
+	failing = ((accum_sectors ?
+		    decode_merged_stat(dec)->errcount : stat->errcount) > 0 ||
 		   retry < min_retries[track][side] ||
-		   good_sectors < min_sectors[track][side])
+		   stat->good_sectors < min_sectors[track][side])
 		   && (replay || retry < retries[track][side]);
 
+	/* After errors, a retry is likely; don't read ahead for it */
+	ahead.skip = !defer && (failing || stat->errcount > 0);
+
+	if (failing && defer) {
+	  /* Come back to it in a retry sweep */
+	  msg(OUT_TSUMMARY, "[deferred]");
+	  deferring = 1;
+	  break;
+	}
+
 	// Generally just reporting on the latest read.
 	if (failing) {
 	  if (min_sectors[track][side] &&
-	      (good_sectors != min_sectors[track][side]))
-	    msg(OUT_TSUMMARY, "[%d/%d", good_sectors, min_sectors[track][side]);
+	      (stat->good_sectors != min_sectors[track][side]))
+	    msg(OUT_TSUMMARY, "[%d/%d", stat->good_sectors,
+		min_sectors[track][side]);
 	  else
-	    msg(OUT_TSUMMARY, "[%d", good_sectors);
+	    msg(OUT_TSUMMARY, "[%d", stat->good_sectors);
 	  msg(OUT_TSUMMARY, " good, %d error%s]\n",
-	      errcount, plu(errcount));
+	      stat->errcount, plu(stat->errcount));
 	}
 
 	if (menu_requested || (menu_err_enabled &&
 	    (retry >= retries[track][side]))) {
+	  read_ahead_finish(-1, -1);
 	  catweasel_set_motor(&c.drives[drive], 0);
 	  switch (menu(failing)) {
 	    case MENU_NOCHANGE:
@@ -2537,25 +2744,21 @@ main(int argc, char** argv)
       fflush(stdout);
       if (out_file) fflush(out_file);
       if (accum_sectors) {
-	short *idam_p = (short *)dmk_track;
-	int i;
-      	memset(dmk_track, (curenc == MFM) ? 0x4e : 0xff, dmk_header.tracklen);
-	memcpy(dmk_track, dmk_merged_track,
-	       DMK_TKHDR_SIZE + dmk_merged_track_len);
-	for (i = 0; i < DMK_TKHDR_SIZE / 2; i++)
-	  *idam_p++ &= ~DMK_EXTRA_FLAG;
-
-	errcount = merged_stat.errcount;
-	good_sectors = merged_stat.good_sectors;
-	reused_sectors = merged_stat.reused_sectors;
-	memcpy(enc_count, merged_stat.enc_count, sizeof enc_count);
-	memcpy(enc_sec, merged_stat.enc_sec, sizeof enc_sec);
+	decode_use_merged(dec);
       }
       dmk_write(min_sectors[track][side]);
+      if (deferring) {
+	defer_track(track, side, retry);
+      }
     }
    track_done:;
   }
  done:
+  read_ahead_finish(-1, -1);
+  if (defer) {
+    retry_sweeps();
+    read_ahead_finish(-1, -1);
+  }
 
   if (!replay) {
     cleanup();
@@ -2570,17 +2773,36 @@ main(int argc, char** argv)
     dmk_header.options |= DMK_RX02_OPT;
   }
   dmk_write_header(); // rewrite to pick up any detected changes
+  if (raw_file && cwraw_close(raw_file) < 0)
+    fatal_msg(1, "Error writing to '%s': %s\n", raw_name, strerror(errno));
+  if (scp_out && scp_close(scp_out) < 0)
+    fatal_msg(1, "Error writing to '%s': %s\n", scp_name, strerror(errno));
+  if (trace_out && decode_trace_close(trace_out) < 0)
+    fatal_msg(1, "Error writing to '%s': %s\n", trace_name, strerror(errno));
+  if (raw_replay) {
+    cwraw_close(raw_replay);
+    samples = sample_buf[0];
+  }
+  if (flux_replay) {
+    flux_close(flux_replay);
+  }
   msg(OUT_SUMMARY, "\nTotals:\n");
   msg(OUT_SUMMARY,
       "%d good track%s, %d good sector%s (%d FM + %d MFM + %d RX02)\n",
       good_tracks, plu(good_tracks),
       total_good_sectors, plu(total_good_sectors),
-      total_enc_count[FM], total_enc_count[MFM], total_enc_count[RX02]);
+      total_enc_count[FM], total_enc_count[MFM],
+      total_enc_count[RX02]);
   msg(OUT_SUMMARY, "%d bad track%s, %d unrecovered error%s, %d retr%s\n",
       err_tracks, plu(err_tracks), total_errcount, plu(total_errcount),
       total_retries, (total_retries == 1) ? "y" : "ies");
   if (flippy) {
     msg(OUT_SUMMARY, "Possibly a flippy disk; check reverse side too\n");
   }
+  if (!replay) {
+    msg(OUT_TSUMMARY, "Waited %.1f s for Catweasel: %.1f s sleeping, "
+        "%.1f s spinning\n", (c.sleep_us + c.spin_us) / 1e6,
+        c.sleep_us / 1e6, c.spin_us / 1e6);
+  }
   return 0;
 }
@@ -23,6 +23,10 @@ typedef struct catweasel_contr {
     catweasel_drive drives[2];     /* max. two drives on each controller */
     int private[4];                /* private data */
     unsigned int step_us, settle_us;
+    unsigned int rev_us;           /* revolution time if known, else 0 */
+    unsigned long long spin_us;    /* time spent busy-waiting on hardware */
+    unsigned long long sleep_us;   /* time spent sleeping while waiting */
+    void *shared;                  /* state shared between processes */
 } catweasel_contr;
 
 /* Initialize a Catweasel controller.  Return true on success. */
@@ -58,6 +62,15 @@ int catweasel_write_protected(catweasel_drive *d);
 /* Inserts a 0x80 0x00 sequence at the end of the buffer if there is room. */
 int catweasel_read(catweasel_drive *d, int side, int clock, int time, int idx);
 
+/* MK4 only: timed read like catweasel_read, but watch the index
+   sensor while the read is running and stop as soon as revs index
+   pulses have gone by, at least mintime ms have passed, and at least
+   tail ms have passed since the last pulse.  Stops after time ms (or
+   when memory is full) regardless.  On MK1/MK3 this is the same as
+   catweasel_read. */
+int catweasel_read_revs(catweasel_drive *d, int side, int clock, int time,
+			int idx, int revs, int mintime, int tail);
+
 /* Write data -- msdelay will be used */
 /* If time = 0, write from index hole to index hole */
 /* Return values:
@@ -86,6 +99,15 @@ void catweasel_set_hd(catweasel_contr *c, int hd);
    technically ambiguous, it should be very rare in real data. */
 int catweasel_get_byte(catweasel_contr *c);
 
+/* Drain samples from Catweasel memory into buf, stopping at the 0x80
+   0x00 sequence that catweasel_read puts at the end of partial reads,
+   at the end of memory, or after maxlen samples.  Returns the number
+   of samples stored.  The samples are the same ones that repeated
+   calls to catweasel_get_byte would return, including the 0x80 of
+   the end mark but not the 0x00.  Uses string I/O where available,
+   so it is much faster than calling catweasel_get_byte per sample. */
+int catweasel_read_block(catweasel_contr *c, unsigned char *buf, int maxlen);
+
 /* Reset Catweasel memory pointer */
 void catweasel_reset_pointer(catweasel_contr *c);
 
@@ -97,9 +119,39 @@ int catweasel_put_byte(catweasel_contr *c, unsigned char val);
    already full, meaning some of the sector will be lost. */
 int catweasel_sector_end(catweasel_contr *c);
 
+/* Reset the memory pointer and upload len bytes from buf, as if by
+   repeated calls to catweasel_put_byte.  sectend is the offset just
+   past the last sector's data, as catweasel_sector_end would have
+   recorded it.  Returns 0 if OK, -1 if buf or some sector data did
+   not fit in memory. */
+int catweasel_write_block(catweasel_contr *c, const unsigned char *buf,
+			  int len, int sectend);
+
+/* Let several processes (for example one per drive, forked after
+   the controller is initialized) use controller c.  Call once before
+   forking.  Afterward, each process must bracket its use of the
+   controller with catweasel_lock and catweasel_unlock, so that only
+   one drive at a time has the Shugart bus and the card's memory.
+   Returns true on success, or false if this isn't supported here. */
+int catweasel_share(catweasel_contr *c);
+
+/* Wait for our turn at the controller, then select drive d.  A turn
+   left unfinished by a process that died passes to the next.  Does
+   nothing but select d if the controller is not shared. */
+void catweasel_lock(catweasel_drive *d);
+
+/* Let the next waiting process have the controller */
+void catweasel_unlock(catweasel_drive *d);
+
 /* Working version of usleep */
 unsigned int catweasel_usleep(unsigned int _useconds);
 
+/* Microseconds from an arbitrary starting point; never goes backward */
+long long catweasel_clock_us(void);
+
+/* Size of Catweasel memory; no read can return more samples */
+#define CW_MEMSIZE 131072
+
 /* Catweasel min sample rate.
  * MK1 supports 1x and 2x; MK3 and MK4 support 1x, 2x, 4x */
 #define CWHZ 7080500.0
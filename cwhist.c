@@ -92,6 +92,7 @@
 #endif
 #include "cwfloppy.h"
 #include "cwpci.h"
+#include "cwsim.h"
 #include "parselog.h"
 
 FILE *binoutf;
@@ -107,9 +108,10 @@ static void cw_initialize(int port, int drive)
 {
   int cw_mk = 1;
   int ret;
+  char *simfile = getenv("CWSIM");
 
   /* Start Catweasel */
-  if (port < 10) {
+  if (port < 10 && !simfile) {
     port = pci_find_catweasel(port, &cw_mk);
     if (port == -1) {
       port = MK1_DEFAULT_PORT;
@@ -118,8 +120,8 @@ static void cw_initialize(int port, int drive)
     }
   }
 #if linux
-  if ((cw_mk == 1 && ioperm(port, 8, 1) == -1) ||
-      (cw_mk >= 3 && iopl(3) == -1)) {
+  if (!simfile && ((cw_mk == 1 && ioperm(port, 8, 1) == -1) ||
+                   (cw_mk >= 3 && iopl(3) == -1))) {
     fprintf(stderr, "cwhisto: No access to I/O ports\n");
     exit(1);
   }
@@ -128,6 +130,10 @@ static void cw_initialize(int port, int drive)
     exit(1);
   }
 #endif
+  if (simfile) {
+    port = cwsim_init(simfile, &cw_mk);
+    if (port == -1) exit(1);
+  }
   ret = catweasel_init_controller(&c, port, cw_mk, getenv("CW4FIRMWARE"),
                                   6, 0)
     && catweasel_memtest(&c);
@@ -163,8 +169,9 @@ static void cw_finalize(int drive)
 static void cw_histo_track(int drive, int track, int side, int passes,
                            unsigned int *buf)
 {
+  static unsigned char samples[CW_MEMSIZE];
   int b;
-  int i;
+  int i, j, n;
 
   catweasel_seek(&c.drives[drive], track);
 
@@ -181,7 +188,8 @@ static void cw_histo_track(int drive, int track, int side, int passes,
       exit(2);
     }
     if (binoutf) putc(0x80 + i, binoutf); // mark start of ith read
-    while((b = catweasel_get_byte(&c)) != -1 && b < 0x80) {
+    n = catweasel_read_block(&c, samples, CW_MEMSIZE);
+    for (j = 0; j < n && (b = samples[j]) < 0x80; j++) {
       b &= 0x7f;
       buf[b]++;
       if (binoutf) putc(b, binoutf);
@@ -400,6 +408,7 @@ int main(int argc, char **argv)
   } else {
     int pass;
     FILE *infile;
+    log_reader *lr;
 
     if (strcmp(replay_fname, "-") == 0) {
       infile = stdin;
@@ -410,6 +419,7 @@ int main(int argc, char **argv)
         exit(1);
       }
     }
+    lr = log_reader_new(infile);
 
     /*
      * Read the entire log file and histogram everything in it.  If
@@ -419,7 +429,7 @@ int main(int argc, char **argv)
     track = side = pass = -2;
     for (;;) {
       int rtrack, rside, rpass;
-      rtrack = parse_track(infile, &rside, &rpass);
+      rtrack = parse_track(lr, &rside, &rpass);
       if (rtrack != track || rside != side || split) {
         /* Encountered a new track: (rtrack,rside) */
         if (track >= 0) {
@@ -454,7 +464,7 @@ int main(int argc, char **argv)
       for (;;) {
         int sample;
 
-        sample = parse_sample(infile);
+        sample = parse_sample(lr);
         /*
          * Stop on parse_sample end of data indication (-1) or
          * catweasel_read's end of data marker (0x80).
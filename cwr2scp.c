@@ -0,0 +1,155 @@
+/*
+ * cwr2scp: Convert a raw capture file to a SuperCard Pro flux image
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+
+/*
+ * Usage:
+ *
+ *     cwr2scp [-v verbosity] file.cwr [file.scp]
+ *
+ * Every read in a capture written by cw2dmk -F (or log2cwr) is split
+ * into revolutions at its index marks, and the revolutions of all the
+ * reads of each track and side are written to the SCP image, as
+ * cw2dmk -E would have written them during the read.  Interval times
+ * are converted from the Catweasel clock to SCP's 25ns units.  If
+ * file.scp is not given, it is formed from file.cwr by replacing the
+ * extension with ".scp".
+ *
+ * Each read is placed at the head position it was made at, as
+ * recorded in the capture, so reads made with cw2dmk -a land where
+ * -E would have put them.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+
+#include "cwraw.h"
+#include "flux.h"
+
+int verbose = 1;
+
+void
+usage(void)
+{
+  printf("\nUsage: cwr2scp [options] file.cwr [file.scp]\n");
+  printf(" Options [defaults in brackets]:\n");
+  printf(" -v verbosity  0 = errors only, 1 = summary, 2 = each read [%d]\n",
+	 verbose);
+  exit(1);
+}
+
+int
+main(int argc, char **argv)
+{
+  char *cwr_name, *scp_name;
+  cwraw_file *rf;
+  cwraw_info info;
+  scp_file *sf;
+  const unsigned char *samples;
+  int ch, track, side, pass, n, r;
+  int reads = 0, revs = 0;
+
+  opterr = 0;
+  for (;;) {
+    ch = getopt(argc, argv, "v:");
+    if (ch == -1) break;
+    switch (ch) {
+    case 'v':
+      verbose = strtol(optarg, NULL, 0);
+      break;
+    default:
+      usage();
+      break;
+    }
+  }
+
+  switch (argc - optind) {
+  case 2:
+    cwr_name = argv[optind];
+    scp_name = argv[optind+1];
+    break;
+
+  case 1: {
+    char *p;
+    int len;
+
+    cwr_name = argv[optind];
+    p = strrchr(cwr_name, '.');
+    if (p == NULL) {
+      len = strlen(cwr_name);
+    } else {
+      len = p - cwr_name;
+    }
+    scp_name = (char *) malloc(len + 5);
+    sprintf(scp_name, "%.*s.scp", len, cwr_name);
+    break; }
+
+  default:
+    usage();
+  }
+
+  rf = cwraw_open(cwr_name, &info);
+  if (rf == NULL) {
+    if (errno == EINVAL) {
+      fprintf(stderr, "cwr2scp: %s is not a capture file\n", cwr_name);
+    } else {
+      perror(cwr_name);
+    }
+    exit(1);
+  }
+
+  sf = scp_create(scp_name, info.cwclock,
+		  (info.kind == 1 || info.kind == 3) ? 360 : 300);
+  if (sf == NULL) {
+    perror(scp_name);
+    exit(1);
+  }
+
+  for (track = 0; track < cwraw_tracks(rf); track++) {
+    for (side = 0; side < 2; side++) {
+      for (pass = 1;
+	   (samples = cwraw_find(rf, track, side, pass, &n)) != NULL;
+	   pass++) {
+	r = scp_write_pass(sf, cwraw_headpos(rf, track, side, pass), side,
+			   samples, n);
+	if (r < 0) {
+	  perror(scp_name);
+	  exit(1);
+	}
+	if (verbose >= 2) {
+	  printf("Track %d, side %d, pass %d: %d revolution%s\n",
+		 track, side, pass, r, r == 1 ? "" : "s");
+	}
+	reads++;
+	revs += r;
+      }
+    }
+  }
+  cwraw_close(rf);
+  if (scp_close(sf) < 0) {
+    perror(scp_name);
+    exit(1);
+  }
+  if (verbose >= 1) {
+    printf("%d reads, %d revolutions, kind %d, clock %d\n",
+	   reads, revs, info.kind, info.cwclock);
+  }
+  return 0;
+}
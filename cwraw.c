@@ -0,0 +1,612 @@
+/*
+ * cwraw.c: Binary raw-flux capture files.  See cwraw.h for the format.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#if linux
+#include <pthread.h>
+#include <zlib.h>
+#define HAVE_ZLIB 1
+#define HAVE_THREADS 1
+#endif
+#include "cwraw.h"
+#include "mapfile.h"
+
+#define MAX_TRACK 256
+#define QUEUE_LEN 16  /* reads waiting to be compressed */
+
+/* One read waiting to be written */
+typedef struct cwraw_job {
+  int track, side, pass, headpos;
+  unsigned char *samples;
+  int nsamples;
+} cwraw_job;
+
+/* One record, as listed in the index */
+typedef struct cwraw_entry {
+  int track, side, pass, headpos;
+  int nsamples;
+  unsigned long long offset;  /* of the samples */
+  unsigned long len;          /* bytes stored there */
+  int seq;                    /* order in file */
+} cwraw_entry;
+
+struct cwraw_file {
+  int compress;               /* zlib level, or 0 if not compressed */
+
+  /* Writing */
+  FILE *f;
+  unsigned long long pos;
+  int err;                    /* errno of first write error, or 0 */
+#if HAVE_ZLIB
+  z_stream zs;
+  int zs_ready;
+#endif
+#if HAVE_THREADS
+  /* Compression runs on a separate thread, fed through a queue */
+  pthread_t thread;
+  pthread_mutex_t lock;
+  pthread_cond_t nonempty, nonfull;
+  cwraw_job queue[QUEUE_LEN];
+  int head, queued, quit, threaded;
+#endif
+
+  /* Index; built while writing, or loaded (or rebuilt) when reading */
+  cwraw_entry *index;
+  int nindex, maxindex;
+
+  /* Reading */
+  const unsigned char *data;
+  size_t size;
+  int mapped;
+  int first[MAX_TRACK][2];    /* first index entry for track/side, or -1 */
+  int count[MAX_TRACK][2];
+  int tracks;
+  unsigned char *ubuf;        /* decompressed samples */
+  unsigned long ubufsize;
+};
+
+static int
+add_entry(cwraw_file *rf, int track, int side, int pass, int headpos,
+	  int nsamples, unsigned long long offset, unsigned long len)
+{
+  cwraw_entry *e;
+
+  if (rf->nindex == rf->maxindex) {
+    int max = rf->maxindex ? rf->maxindex * 2 : 256;
+    e = (cwraw_entry *) realloc(rf->index, max * sizeof(cwraw_entry));
+    if (e == NULL) return -1;
+    rf->index = e;
+    rf->maxindex = max;
+  }
+  e = &rf->index[rf->nindex];
+  e->track = track;
+  e->side = side;
+  e->pass = pass;
+  e->headpos = headpos;
+  e->nsamples = nsamples;
+  e->offset = offset;
+  e->len = len;
+  e->seq = rf->nindex++;
+  return 0;
+}
+
+/* Write one record.  Called from the compression thread if there is
+   one, so touches nothing else in rf. */
+static int
+write_record(cwraw_file *rf, cwraw_job *job)
+{
+  unsigned char rec[CWRAW_REC_SIZE + 4];
+  const unsigned char *data = job->samples;
+  unsigned long len = job->nsamples;
+  int hlen = CWRAW_REC_SIZE;
+#if HAVE_ZLIB
+  unsigned char *zbuf = NULL;
+#endif
+
+  memset(rec, 0, sizeof(rec));
+  rec[0] = job->track;
+  rec[1] = job->side;
+  put16(rec + 2, job->pass);
+  rec[4] = job->headpos;
+  put32(rec + 8, job->nsamples);
+#if HAVE_ZLIB
+  if (rf->compress) {
+    /*
+     * Samples are mostly a few values with some jitter, and long
+     * repeats are rare except on unformatted tracks, so run-length
+     * matching does about as well as full deflate in a fraction of
+     * the time.
+     */
+    uLongf zlen;
+    if (!rf->zs_ready) {
+      if (deflateInit2(&rf->zs, rf->compress, Z_DEFLATED, 15, 9,
+		       Z_RLE) != Z_OK) {
+	errno = ENOMEM;
+	return -1;
+      }
+      rf->zs_ready = 1;
+    }
+    zlen = deflateBound(&rf->zs, len);
+    zbuf = (unsigned char *) malloc(zlen);
+    if (zbuf == NULL) {
+      errno = ENOMEM;
+      return -1;
+    }
+    rf->zs.next_in = (unsigned char *) data;
+    rf->zs.avail_in = len;
+    rf->zs.next_out = zbuf;
+    rf->zs.avail_out = zlen;
+    if (deflate(&rf->zs, Z_FINISH) != Z_STREAM_END) {
+      free(zbuf);
+      errno = ENOMEM;
+      return -1;
+    }
+    zlen = rf->zs.total_out;
+    deflateReset(&rf->zs);
+    rec[5] = CWRAW_DEFLATE;
+    put32(rec + CWRAW_REC_SIZE, zlen);
+    hlen += 4;
+    data = zbuf;
+    len = zlen;
+  }
+#endif
+  if (fwrite(rec, hlen, 1, rf->f) != 1 ||
+      (len > 0 && fwrite(data, len, 1, rf->f) != 1) ||
+      add_entry(rf, job->track, job->side, job->pass, job->headpos,
+		job->nsamples,
+		rf->pos + hlen, len) < 0) {
+    if (errno == 0) errno = ENOMEM;
+#if HAVE_ZLIB
+    free(zbuf);
+#endif
+    return -1;
+  }
+  rf->pos += hlen + len;
+#if HAVE_ZLIB
+  free(zbuf);
+#endif
+  return 0;
+}
+
+#if HAVE_THREADS
+/* Compression thread: write queued reads in order */
+static void *
+compressor(void *arg)
+{
+  cwraw_file *rf = (cwraw_file *) arg;
+  cwraw_job *job;
+  int failed, err;
+
+  pthread_mutex_lock(&rf->lock);
+  for (;;) {
+    while (rf->queued == 0 && !rf->quit) {
+      pthread_cond_wait(&rf->nonempty, &rf->lock);
+    }
+    if (rf->queued == 0) break;
+    job = &rf->queue[rf->head];
+    failed = rf->err;
+    pthread_mutex_unlock(&rf->lock);
+
+    /* After an error, just discard the rest */
+    errno = err = 0;
+    if (!failed && write_record(rf, job) < 0) {
+      err = errno;
+    }
+    free(job->samples);
+
+    pthread_mutex_lock(&rf->lock);
+    if (err && !rf->err) rf->err = err;
+    rf->head = (rf->head + 1) % QUEUE_LEN;
+    rf->queued--;
+    pthread_cond_signal(&rf->nonfull);
+  }
+  pthread_mutex_unlock(&rf->lock);
+  return NULL;
+}
+#endif
+
+cwraw_file *
+cwraw_create(const char *name, const cwraw_info *info)
+{
+  unsigned char hdr[CWRAW_HDR_SIZE];
+  cwraw_file *rf;
+
+#if !HAVE_ZLIB
+  if (info->compress) {
+    errno = ENOSYS;
+    return NULL;
+  }
+#endif
+  rf = (cwraw_file *) calloc(1, sizeof(cwraw_file));
+  if (rf == NULL) return NULL;
+  rf->f = fopen(name, "wb");
+  if (rf->f == NULL) {
+    free(rf);
+    return NULL;
+  }
+  rf->compress = info->compress;
+
+  memset(hdr, 0, sizeof(hdr));
+  memcpy(hdr, CWRAW_MAGIC, 4);
+  hdr[4] = CWRAW_VERSION;
+  hdr[5] = info->mk;
+  hdr[6] = info->cwclock;
+  hdr[7] = info->kind;
+  hdr[8] = info->steps;
+  hdr[9] = rf->compress ? CWRAW_DEFLATE : CWRAW_STORED;
+  if (fwrite(hdr, sizeof(hdr), 1, rf->f) != 1) {
+    cwraw_close(rf);
+    return NULL;
+  }
+  rf->pos = sizeof(hdr);
+
+#if HAVE_THREADS
+  if (rf->compress) {
+    pthread_mutex_init(&rf->lock, NULL);
+    pthread_cond_init(&rf->nonempty, NULL);
+    pthread_cond_init(&rf->nonfull, NULL);
+    if (pthread_create(&rf->thread, NULL, compressor, rf) != 0) {
+      /* Compress on this thread instead */
+      pthread_mutex_destroy(&rf->lock);
+      pthread_cond_destroy(&rf->nonempty);
+      pthread_cond_destroy(&rf->nonfull);
+    } else {
+      rf->threaded = 1;
+    }
+  }
+#endif
+  return rf;
+}
+
+int
+cwraw_write_pass(cwraw_file *rf, int track, int side, int pass, int headpos,
+		 const unsigned char *samples, int nsamples)
+{
+  cwraw_job job;
+
+  job.track = track;
+  job.side = side;
+  job.pass = pass;
+  job.headpos = headpos;
+  job.samples = (unsigned char *) samples;
+  job.nsamples = nsamples;
+
+#if HAVE_THREADS
+  if (rf->threaded) {
+    /* Hand a copy to the compression thread */
+    job.samples = (unsigned char *) malloc(nsamples ? nsamples : 1);
+    if (job.samples == NULL) {
+      errno = ENOMEM;
+      return -1;
+    }
+    memcpy(job.samples, samples, nsamples);
+    pthread_mutex_lock(&rf->lock);
+    while (rf->queued == QUEUE_LEN) {
+      pthread_cond_wait(&rf->nonfull, &rf->lock);
+    }
+    if (rf->err) {
+      errno = rf->err;
+      pthread_mutex_unlock(&rf->lock);
+      free(job.samples);
+      return -1;
+    }
+    rf->queue[(rf->head + rf->queued) % QUEUE_LEN] = job;
+    rf->queued++;
+    pthread_cond_signal(&rf->nonempty);
+    pthread_mutex_unlock(&rf->lock);
+    return 0;
+  }
+#endif
+  if (rf->err) {
+    errno = rf->err;
+    return -1;
+  }
+  if (write_record(rf, &job) < 0) {
+    rf->err = errno;
+    return -1;
+  }
+  return 0;
+}
+
+/* Append the index and trailer */
+static int
+write_index(cwraw_file *rf)
+{
+  unsigned char buf[CWRAW_IDX_SIZE];
+  int i;
+
+  for (i = 0; i < rf->nindex; i++) {
+    cwraw_entry *e = &rf->index[i];
+    memset(buf, 0, sizeof(buf));
+    buf[0] = e->track;
+    buf[1] = e->side;
+    put16(buf + 2, e->pass);
+    put32(buf + 4, e->nsamples);
+    put64(buf + 8, e->offset);
+    if (fwrite(buf, sizeof(buf), 1, rf->f) != 1) return -1;
+  }
+  memcpy(buf, CWRAW_IDX_MAGIC, 4);
+  put32(buf + 4, rf->nindex);
+  put64(buf + 8, rf->pos);
+  if (fwrite(buf, sizeof(buf), 1, rf->f) != 1) return -1;
+  return 0;
+}
+
+int
+cwraw_close(cwraw_file *rf)
+{
+  int ret = 0;
+
+#if HAVE_THREADS
+  if (rf->threaded) {
+    /* Let the compression thread finish the queue */
+    pthread_mutex_lock(&rf->lock);
+    rf->quit = 1;
+    pthread_cond_signal(&rf->nonempty);
+    pthread_mutex_unlock(&rf->lock);
+    pthread_join(rf->thread, NULL);
+    pthread_mutex_destroy(&rf->lock);
+    pthread_cond_destroy(&rf->nonempty);
+    pthread_cond_destroy(&rf->nonfull);
+  }
+#endif
+#if HAVE_ZLIB
+  if (rf->zs_ready) deflateEnd(&rf->zs);
+#endif
+  if (rf->err) {
+    errno = rf->err;
+    ret = -1;
+  }
+  if (rf->f) {
+    if (rf->pos > 0 && write_index(rf) < 0) ret = -1;
+    if (ferror(rf->f)) ret = -1;
+    if (fclose(rf->f) != 0) ret = -1;
+  }
+  if (rf->data) unmap_file(rf->data, rf->size, rf->mapped);
+  free(rf->index);
+  free(rf->ubuf);
+  free(rf);
+  return ret;
+}
+
+/* Load the index from the trailer.  Return 0 if OK, -1 if there is no
+   usable index. */
+static int
+load_index(cwraw_file *rf)
+{
+  const unsigned char *t, *p;
+  unsigned long long ioff, off;
+  unsigned long n, i, len;
+  int ns, hlen = CWRAW_REC_SIZE + (rf->compress ? 4 : 0);
+
+  if (rf->size < CWRAW_HDR_SIZE + CWRAW_IDX_SIZE) return -1;
+  t = rf->data + rf->size - CWRAW_IDX_SIZE;
+  if (memcmp(t, CWRAW_IDX_MAGIC, 4) != 0) return -1;
+  n = get32(t + 4);
+  ioff = get64(t + 8);
+  if (ioff < CWRAW_HDR_SIZE || ioff > rf->size ||
+      (rf->size - ioff) / CWRAW_IDX_SIZE != n + 1 ||
+      (rf->size - ioff) % CWRAW_IDX_SIZE != 0) {
+    return -1;
+  }
+  for (i = 0, p = rf->data + ioff; i < n; i++, p += CWRAW_IDX_SIZE) {
+    ns = get32(p + 4);
+    off = get64(p + 8);
+    if (ns < 0 || off < CWRAW_HDR_SIZE + hlen || off > ioff) {
+      return -1;
+    }
+    len = rf->compress ? get32(rf->data + off - 4) : ns;
+    if (ioff - off < len) {
+      return -1;
+    }
+    /* The index has no head position; take it from the record */
+    if (add_entry(rf, p[0], p[1], get16(p + 2), rf->data[off - hlen + 4],
+		  ns, off, len) < 0) {
+      return -1;
+    }
+  }
+  return 0;
+}
+
+/* No index (perhaps cw2dmk was killed); rebuild it by hopping from
+   record to record.  A truncated last record is dropped. */
+static int
+scan_records(cwraw_file *rf)
+{
+  unsigned long long off = CWRAW_HDR_SIZE;
+  const unsigned char *p;
+  unsigned long ns, len;
+  int hlen = CWRAW_REC_SIZE + (rf->compress ? 4 : 0);
+
+  rf->nindex = 0;
+  while (rf->size - off >= hlen) {
+    p = rf->data + off;
+    ns = get32(p + 8);
+    len = rf->compress ? get32(p + CWRAW_REC_SIZE) : ns;
+    off += hlen;
+    if (rf->size - off < len || ns > 0x7fffffff) break;
+    if (add_entry(rf, p[0], p[1], get16(p + 2), p[4], ns, off, len) < 0) {
+      return -1;
+    }
+    off += len;
+  }
+  return 0;
+}
+
+/* Sort by track, side, pass, then order in the file */
+static int
+compare_entries(const void *a, const void *b)
+{
+  const cwraw_entry *x = (const cwraw_entry *) a;
+  const cwraw_entry *y = (const cwraw_entry *) b;
+
+  if (x->track != y->track) return x->track - y->track;
+  if (x->side != y->side) return x->side - y->side;
+  if (x->pass != y->pass) return x->pass - y->pass;
+  return x->seq - y->seq;
+}
+
+cwraw_file *
+cwraw_open(const char *name, cwraw_info *info)
+{
+  cwraw_file *rf;
+  int i, j, ts;
+
+  rf = (cwraw_file *) calloc(1, sizeof(cwraw_file));
+  if (rf == NULL) return NULL;
+
+  if (map_file(name, &rf->data, &rf->size, &rf->mapped) < 0) {
+    free(rf);
+    return NULL;
+  }
+
+  if (rf->size < CWRAW_HDR_SIZE ||
+      memcmp(rf->data, CWRAW_MAGIC, 4) != 0 ||
+      rf->data[4] != CWRAW_VERSION) {
+    cwraw_close(rf);
+    errno = EINVAL;
+    return NULL;
+  }
+  info->mk = rf->data[5];
+  info->cwclock = rf->data[6];
+  info->kind = rf->data[7];
+  info->steps = rf->data[8];
+  info->compress = 0;
+  if (rf->data[9] == CWRAW_DEFLATE) {
+#if HAVE_ZLIB
+    rf->compress = info->compress = Z_DEFAULT_COMPRESSION;
+#else
+    cwraw_close(rf);
+    errno = ENOSYS;
+    return NULL;
+#endif
+  } else if (rf->data[9] != CWRAW_STORED) {
+    cwraw_close(rf);
+    errno = EINVAL;
+    return NULL;
+  }
+
+  if (load_index(rf) < 0 && scan_records(rf) < 0) {
+    cwraw_close(rf);
+    errno = ENOMEM;
+    return NULL;
+  }
+
+  /* Sort the index, keeping only the last record of any duplicate
+     track/side/pass, and note where each track/side starts */
+  qsort(rf->index, rf->nindex, sizeof(cwraw_entry), compare_entries);
+  for (i = j = 0; i < rf->nindex; i++) {
+    if (i + 1 < rf->nindex &&
+	rf->index[i].track == rf->index[i+1].track &&
+	rf->index[i].side == rf->index[i+1].side &&
+	rf->index[i].pass == rf->index[i+1].pass) {
+      continue;
+    }
+    rf->index[j++] = rf->index[i];
+  }
+  rf->nindex = j;
+  for (ts = 0; ts < MAX_TRACK * 2; ts++) {
+    rf->first[ts / 2][ts % 2] = -1;
+  }
+  for (i = 0; i < rf->nindex; i++) {
+    cwraw_entry *e = &rf->index[i];
+    if (e->side > 1) continue;
+    if (rf->first[e->track][e->side] == -1) {
+      rf->first[e->track][e->side] = i;
+    }
+    rf->count[e->track][e->side]++;
+    if (e->track >= rf->tracks) rf->tracks = e->track + 1;
+  }
+  return rf;
+}
+
+/* Find the index entry of one read, or return NULL */
+static cwraw_entry *
+find_entry(cwraw_file *rf, int track, int side, int pass)
+{
+  int first, lo, hi, mid;
+
+  if (track < 0 || track >= MAX_TRACK || side < 0 || side > 1) return NULL;
+  first = rf->first[track][side];
+  if (first == -1) return NULL;
+
+  /* Passes are normally numbered 1, 2, ...; check there first */
+  lo = 0;
+  hi = rf->count[track][side] - 1;
+  mid = pass - 1;
+  if (mid < lo || mid > hi || rf->index[first + mid].pass != pass) {
+    mid = -1;
+    while (lo <= hi) {
+      int m = (lo + hi) / 2;
+      if (rf->index[first + m].pass == pass) {
+	mid = m;
+	break;
+      } else if (rf->index[first + m].pass < pass) {
+	lo = m + 1;
+      } else {
+	hi = m - 1;
+      }
+    }
+    if (mid == -1) return NULL;
+  }
+  return &rf->index[first + mid];
+}
+
+const unsigned char *
+cwraw_find(cwraw_file *rf, int track, int side, int pass, int *nsamples)
+{
+  cwraw_entry *e = find_entry(rf, track, side, pass);
+
+  if (e == NULL) return NULL;
+  *nsamples = e->nsamples;
+#if HAVE_ZLIB
+  if (rf->compress) {
+    /* Decompress just this read */
+    uLongf ulen = e->nsamples;
+    if (rf->ubufsize < ulen) {
+      unsigned char *nbuf = (unsigned char *) realloc(rf->ubuf, ulen);
+      if (nbuf == NULL) return NULL;
+      rf->ubuf = nbuf;
+      rf->ubufsize = ulen;
+    }
+    if (uncompress(rf->ubuf, &ulen, rf->data + e->offset, e->len) != Z_OK ||
+	ulen != e->nsamples) {
+      return NULL;
+    }
+    return rf->ubuf;
+  }
+#endif
+  return rf->data + e->offset;
+}
+
+int
+cwraw_headpos(cwraw_file *rf, int track, int side, int pass)
+{
+  cwraw_entry *e = find_entry(rf, track, side, pass);
+
+  return e ? e->headpos : -1;
+}
+
+int
+cwraw_tracks(cwraw_file *rf)
+{
+  return rf->tracks;
+}
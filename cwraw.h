@@ -0,0 +1,126 @@
+/*
+ * cwraw.h: Binary raw-flux capture files.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+
+#ifndef _CWRAW_H
+#define _CWRAW_H
+
+#include <stdio.h>
+
+/*
+ * A capture file holds the Catweasel samples of every read cw2dmk
+ * made, exactly as drained from the card: bit 7 is the index hole
+ * flag (if index storage was on) and the low 7 bits are the sample.
+ * All numbers are little-endian.
+ *
+ * File header, 16 bytes:
+ *   0   "CWRF"
+ *   4   format version (1)
+ *   5   Catweasel model (1, 3, 4), or 0 if unknown
+ *   6   Catweasel clock multiplier (1, 2, 4)
+ *   7   drive/media kind (cw2dmk -k)
+ *   8   step multiplier (cw2dmk -m)
+ *   9   how samples are stored: 0 as is, 1 compressed
+ *  10   reserved, 0
+ *
+ * Then one record per read, each a 12 byte header followed by the
+ * samples:
+ *   0   track
+ *   1   side
+ *   2   pass (2 bytes), 1 for the first read of a track/side
+ *   4   head position
+ *   5   how samples are stored, as in the file header
+ *   6   reserved, 0
+ *   8   number of samples (4 bytes)
+ * In a compressed file, each record header is followed by the length
+ * of the compressed samples (4 bytes) and then a separate zlib stream
+ * holding just that read's samples, so any read can be decompressed
+ * on its own.
+ *
+ * When the file is closed, an index of the records is appended so a
+ * reader can go straight to any read without scanning.  Each entry is
+ * 16 bytes:
+ *   0   track
+ *   1   side
+ *   2   pass (2 bytes)
+ *   4   number of samples (4 bytes)
+ *   8   file offset of the (possibly compressed) samples (8 bytes)
+ * and a 16 byte trailer ends the file:
+ *   0   "CWRI"
+ *   4   number of index entries (4 bytes)
+ *   8   file offset of the index (8 bytes)
+ * The index is optional; a file without one (e.g., from an interrupted
+ * run) is still read, by walking the record headers.
+ */
+
+#define CWRAW_MAGIC "CWRF"
+#define CWRAW_VERSION 1
+#define CWRAW_HDR_SIZE 16
+#define CWRAW_REC_SIZE 12
+#define CWRAW_IDX_MAGIC "CWRI"
+#define CWRAW_IDX_SIZE 16
+#define CWRAW_STORED 0
+#define CWRAW_DEFLATE 1
+
+typedef struct cwraw_info {
+  int mk;        /* Catweasel model, or 0 if unknown */
+  int cwclock;   /* clock multiplier */
+  int kind;      /* drive/media kind */
+  int steps;     /* step multiplier */
+  int compress;  /* zlib level 1-9, or 0 not to compress; when
+                    reading, nonzero if compressed */
+} cwraw_info;
+
+typedef struct cwraw_file cwraw_file;
+
+/* Create a capture file and write its header.  Returns NULL on error,
+   with errno set. */
+cwraw_file *cwraw_create(const char *name, const cwraw_info *info);
+
+/* Append one read.  When compressing, the samples are copied and
+   compressed and written on a separate thread where possible.
+   Returns 0 if OK, -1 on a write error (possibly from an earlier
+   read). */
+int cwraw_write_pass(cwraw_file *rf, int track, int side, int pass,
+		     int headpos, const unsigned char *samples, int nsamples);
+
+/* Open a capture file for reading and fill in *info from its header.
+   The file is mapped into memory where possible.  Returns NULL on
+   error, with errno set (EINVAL if it is not a capture file). */
+cwraw_file *cwraw_open(const char *name, cwraw_info *info);
+
+/* Find the samples of one read.  Returns a pointer to them and sets
+   *nsamples, or returns NULL if there is no such read (or it cannot
+   be decompressed).  If the same read was recorded more than once,
+   the last one wins.  The samples of a compressed file are
+   decompressed on demand and are valid only until the next call. */
+const unsigned char *cwraw_find(cwraw_file *rf, int track, int side,
+				int pass, int *nsamples);
+
+/* Returns the head position of one read, as recorded when it was
+   made, or -1 if there is no such read */
+int cwraw_headpos(cwraw_file *rf, int track, int side, int pass);
+
+/* Returns one more than the highest track number in the file */
+int cwraw_tracks(cwraw_file *rf);
+
+/* Finish and close a capture file.  When writing, this waits for any
+   compression to finish and appends the index.  Returns 0 if OK, -1
+   on error. */
+int cwraw_close(cwraw_file *rf);
+
+#endif /* _CWRAW_H */
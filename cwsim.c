@@ -0,0 +1,589 @@
+/*
+ * cwsim.c: Register-level software simulation of a Catweasel MK3/MK4.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+
+/*
+ * The simulator stands in for the card at the level of inb/outb, so
+ * everything in catweasl.c above that runs unchanged: memory and
+ * pointer, control/status register, clock and index options, timed
+ * and index-to-index reads and writes, the MK4 firmware load and
+ * pointer readout, stepping, track 0, and side select.  The disk is
+ * loaded from a level 7 log (the same files -R replays); each logged
+ * pass of a track becomes one revolution of flux, and successive
+ * reads of a track cycle through its passes, so retries see the
+ * retries that were logged.  Tracks that are not in the log read
+ * back as no flux at all.
+ *
+ * It is enabled by setting CWSIM to the log file name.  Optional
+ * environment variables:
+ *
+ *   CWSIM_MK=3|4     Catweasel model to simulate [4]
+ *   CWSIM_CLOCK=n    Clock multiplier the log was captured with [2]
+ *   CWSIM_STEPS=n    Head steps per logged track [1]
+ *   CWSIM_RPM=n      Disk rotation speed [300]
+ *   CWSIM_WP=1       Disk is write protected
+ *   CWSIM_FAST=1     Use virtual time: sleeps take no real time and
+ *                    each port access takes 1us, so runs are fast
+ *                    and repeatable
+ *   CWSIM_OUT=file   At exit, write the tracks that were written to
+ *                    the simulated disk to file as a level 7 log
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <limits.h>
+#include "cwfloppy.h"
+#include "cwsim.h"
+#include "parselog.h"
+
+#define SIM_PORT 0xc000  /* made-up I/O base */
+#define SIM_TRACKS 86
+#define SIM_PASSES 16
+#define INDEX_US 2000    /* width of index pulse */
+#define IO_US 1          /* virtual time per port access */
+
+int cwsim_on = 0;
+
+/* One side of one track: up to SIM_PASSES revolutions of samples,
+   each starting at the index hole, with the index bit stripped. */
+typedef struct {
+  unsigned char *s[SIM_PASSES];
+  int len[SIM_PASSES];
+  long total[SIM_PASSES];  /* sum of (sample + 1) ticks */
+  int npasses;
+  int nreads;
+  int written;
+} sim_track;
+
+static sim_track disk[SIM_TRACKS][2];
+static sim_track blank;
+
+enum { OP_NONE, OP_READ, OP_WRITE };
+
+static struct {
+  /* Configuration */
+  int mk, clock, steps, wp, fast;
+  long long rev_us;
+  char *outname;
+
+  /* Card state */
+  unsigned char mem[CW_MEMSIZE];
+  int ptr;
+  unsigned char ctrl;
+  unsigned char option[8];
+  int bank;
+  int fwcount;
+  int head;
+  long long vclock, epoch;
+
+  /* Read or write in progress */
+  int op, toindex, idx, mult;
+  long long start, end;
+  sim_track *t;
+  int pass, i;
+  long long rev0;    /* time of the index at the start of this rev */
+  long cum;          /* ticks in this rev before sample i */
+  long long wnext;   /* time the next written byte is done */
+  long long wticks;  /* ticks written so far */
+  long wpending;     /* ticks of written gap not yet ended by a flux */
+  unsigned char *wbuf;
+  int wlen, wsize;
+} sim;
+
+static long long
+real_us(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (long long) ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
+
+long long
+cwsim_clock_us(void)
+{
+  return sim.fast ? sim.vclock : real_us();
+}
+
+void
+cwsim_usleep(unsigned int usec)
+{
+  if (sim.fast) {
+    sim.vclock += usec;
+  } else {
+    usleep(usec);
+  }
+}
+
+static int
+env_int(const char *name, int dflt)
+{
+  char *v = getenv(name);
+  return v ? strtol(v, NULL, 0) : dflt;
+}
+
+/* Time of the most recent index hole at or before now */
+static long long
+last_index(long long now)
+{
+  return now - (now - sim.epoch) % sim.rev_us;
+}
+
+static int
+clock_mult(void)
+{
+  switch (sim.option[0] & 0xc0) {
+  case 0x00: return 1;
+  case 0x80: return 2;
+  default:   return 4;
+  }
+}
+
+static sim_track *
+cur_track(void)
+{
+  int t = sim.head / sim.steps;
+  int side = (sim.ctrl & 0x40) ? 0 : 1;
+  sim_track *st;
+
+  if (sim.head % sim.steps == 0 && t < SIM_TRACKS) {
+    st = &disk[t][side];
+    if (st->npasses > 0) return st;
+  }
+  return &blank;
+}
+
+/* Store a sample as the hardware would, stopping when memory fills */
+static void
+acquire(int v)
+{
+  sim.mem[sim.ptr++] = v;
+  if (sim.ptr >= CW_MEMSIZE) {
+    sim.op = OP_NONE;
+  }
+}
+
+/* Advance a read to the given time */
+static void
+run_read(long long now)
+{
+  sim_track *t = sim.t;
+  long long when, stop = (now < sim.end) ? now : sim.end;
+  int v;
+
+  if (now < sim.start) return;
+  for (;;) {
+    if (sim.i >= t->len[sim.pass]) {
+      sim.i = 0;
+      sim.cum = 0;
+      sim.rev0 += sim.rev_us;
+    }
+    v = t->s[sim.pass][sim.i];
+    when = sim.rev0 + (sim.cum + v + 1) * sim.rev_us / t->total[sim.pass];
+    if (when > stop) break;
+    sim.cum += v + 1;
+    sim.i++;
+    /* Rescale from the log's clock to the one selected for this read */
+    v = ((v + 1) * sim.mult + sim.clock / 2) / sim.clock - 1;
+    if (v < 0) v = 0;
+    if (v > 0x7f) v = 0x7f;
+    if (sim.idx && when - sim.rev0 < INDEX_US) v |= 0x80;
+    acquire(v);
+    if (sim.op == OP_NONE) return;
+  }
+  if (now >= sim.end) {
+    sim.op = OP_NONE;
+  }
+}
+
+/* Turn what was written into one revolution of read samples */
+static void
+finish_write(void)
+{
+  sim_track *st;
+  int t = sim.head / sim.steps, side = (sim.ctrl & 0x40) ? 0 : 1, i;
+
+  if (sim.head % sim.steps != 0 || t >= SIM_TRACKS || sim.wlen == 0) {
+    free(sim.wbuf);
+    sim.wbuf = NULL;
+    sim.wlen = sim.wsize = 0;
+    return;
+  }
+  st = &disk[t][side];
+  for (i = 0; i < st->npasses; i++) {
+    free(st->s[i]);
+  }
+  st->s[0] = sim.wbuf;
+  st->len[0] = sim.wlen;
+  st->total[0] = 0;
+  for (i = 0; i < sim.wlen; i++) {
+    st->total[0] += sim.wbuf[i] + 1;
+  }
+  st->npasses = 1;
+  st->nreads = 0;
+  st->written = 1;
+  sim.wbuf = NULL;
+  sim.wlen = sim.wsize = 0;
+}
+
+/* Advance a write to the given time */
+static void
+run_write(long long now)
+{
+  long long stop = (now < sim.end) ? now : sim.end;
+  long ticks;
+  int b, v;
+
+  if (now < sim.start) return;
+  while (sim.wnext <= stop) {
+    if (sim.ptr >= CW_MEMSIZE || (b = sim.mem[sim.ptr]) == 0xff) {
+      sim.end = sim.wnext;
+      break;
+    }
+    sim.ptr++;
+    if (b >= 0x80) {
+      /* no flux transition for a full count */
+      ticks = 128;
+      sim.wpending += ticks;
+    } else {
+      ticks = 129 - b;
+      v = ((sim.wpending + ticks) * sim.clock + sim.mult / 2) / sim.mult - 1;
+      if (v < 0) v = 0;
+      if (v > 0x7f) v = 0x7f;
+      sim.wpending = 0;
+      if (sim.wlen == sim.wsize) {
+        sim.wsize = sim.wsize ? 2 * sim.wsize : 65536;
+        sim.wbuf = realloc(sim.wbuf, sim.wsize);
+      }
+      sim.wbuf[sim.wlen++] = v;
+    }
+    sim.wticks += ticks;
+    sim.wnext = sim.start + sim.wticks * 1000000LL / (long long) (CWHZ * sim.mult);
+  }
+  if (now >= sim.end) {
+    finish_write();
+    sim.op = OP_NONE;
+  }
+}
+
+static void
+update(void)
+{
+  long long now;
+
+  if (sim.fast) sim.vclock += IO_US;
+  now = cwsim_clock_us();
+  if (sim.op == OP_READ) {
+    run_read(now);
+  } else if (sim.op == OP_WRITE) {
+    run_write(now);
+  }
+}
+
+static void
+start_read(int toindex)
+{
+  long long now = cwsim_clock_us();
+  sim_track *t = cur_track();
+  long long when;
+
+  sim.op = OP_READ;
+  sim.toindex = toindex;
+  sim.idx = (sim.option[2] & 0x80) != 0;
+  sim.mult = clock_mult();
+  sim.t = t;
+  sim.pass = t->nreads++ % t->npasses;
+  sim.i = 0;
+  sim.cum = 0;
+  sim.rev0 = last_index(now);
+  if (toindex) {
+    sim.rev0 += sim.rev_us;
+    sim.start = sim.rev0;
+    sim.end = sim.start + sim.rev_us;
+  } else {
+    /* Skip the part of this revolution that has already gone by */
+    sim.start = now;
+    sim.end = LLONG_MAX;
+    for (;;) {
+      when = sim.rev0 + (sim.cum + t->s[sim.pass][sim.i] + 1) *
+        sim.rev_us / t->total[sim.pass];
+      if (when >= now || sim.i == t->len[sim.pass] - 1) break;
+      sim.cum += t->s[sim.pass][sim.i] + 1;
+      sim.i++;
+    }
+  }
+}
+
+static void
+start_write(int toindex)
+{
+  long long now = cwsim_clock_us();
+
+  sim.op = OP_WRITE;
+  sim.toindex = toindex;
+  sim.mult = clock_mult();
+  sim.start = toindex ? last_index(now) + sim.rev_us : now;
+  sim.end = toindex ? sim.start + sim.rev_us : LLONG_MAX;
+  sim.wnext = sim.start;
+  sim.wticks = 0;
+  sim.wpending = 0;
+  free(sim.wbuf);
+  sim.wbuf = NULL;
+  sim.wlen = 0;
+  sim.wsize = 0;
+}
+
+static void
+stop(void)
+{
+  if (sim.op == OP_WRITE) {
+    finish_write();
+  }
+  sim.op = OP_NONE;
+}
+
+static unsigned char
+status(void)
+{
+  long long now = cwsim_clock_us();
+  unsigned char v = 0x21;  /* disk in drive, density in */
+
+  if (!(sim.op == OP_READ && now >= sim.start)) v |= 0x80;
+  if (!(sim.op == OP_WRITE && now >= sim.start)) v |= 0x40;
+  if (!sim.wp) v |= 0x08;
+  if (sim.head != 0) v |= 0x04;
+  if (now - last_index(now) >= INDEX_US) v |= 0x02;
+  return v;
+}
+
+static void
+control(unsigned char val)
+{
+  /* Step on the falling edge of the step bit */
+  if ((sim.ctrl & 0x80) && !(val & 0x80)) {
+    if (val & 0x10) {
+      if (sim.head > 0) sim.head--;
+    } else {
+      if (sim.head < SIM_TRACKS - 1) sim.head++;
+    }
+  }
+  sim.ctrl = val;
+}
+
+unsigned char
+cwsim_inb(unsigned short port)
+{
+  unsigned char v = 0xff;
+
+  update();
+  switch (port - SIM_PORT) {
+  case 0x07:
+    /* MK4 FPGA status: ready, and loaded if any firmware was sent */
+    v = 0x08 | (sim.fwcount > 0 ? 0x04 : 0);
+    break;
+  case 0xd0:
+  case 0xd4:
+  case 0xd8:
+    if (sim.bank == 0xc1) {
+      v = sim.ptr >> (8 * (2 - (port - SIM_PORT - 0xd0) / 4));
+    }
+    break;
+  case 0xe0:
+    v = sim.mem[sim.ptr];
+    sim.ptr = (sim.ptr + 1) % CW_MEMSIZE;
+    break;
+  case 0xe4:
+    stop();
+    break;
+  case 0xe8:
+    v = status();
+    break;
+  case 0xf0:
+    start_read(0);
+    break;
+  case 0xf4:
+    start_read(1);
+    break;
+  }
+  return v;
+}
+
+void
+cwsim_outb(unsigned char val, unsigned short port)
+{
+  update();
+  switch (port - SIM_PORT) {
+  case 0x03:
+    if (val == 0x00) sim.fwcount = 0;  /* FPGA reset */
+    sim.bank = val;
+    break;
+  case 0xc0:
+    sim.fwcount++;
+    break;
+  case 0xe0:
+    sim.mem[sim.ptr] = val;
+    sim.ptr = (sim.ptr + 1) % CW_MEMSIZE;
+    break;
+  case 0xe4:
+    sim.ptr = 0;
+    break;
+  case 0xe8:
+    control(val);
+    break;
+  case 0xec:
+    if (sim.ptr < 8) sim.option[sim.ptr] = val;
+    break;
+  case 0xf0:
+    start_write(1);
+    break;
+  case 0xf4:
+    start_write(0);
+    break;
+  }
+}
+
+/* Write the tracks that were written as a level 7 log */
+static void
+save_written(void)
+{
+  FILE *f;
+  int t, side, i;
+  sim_track *st;
+
+  f = fopen(sim.outname, "w");
+  if (f == NULL) {
+    perror(sim.outname);
+    return;
+  }
+  fprintf(f, "cwsim written tracks\n");
+  for (t = 0; t < SIM_TRACKS; t++) {
+    for (side = 0; side < 2; side++) {
+      st = &disk[t][side];
+      if (!st->written) continue;
+      fprintf(f, "\nTrack %d, side %d, pass 1:\n", t, side);
+      for (i = 0; i < st->len[0]; i++) {
+        fprintf(f, " %ds%s", st->s[0][i], (i % 16 == 15) ? "\n" : "");
+      }
+      fprintf(f, "\n");
+    }
+  }
+  fclose(f);
+}
+
+/* Keep the part of a logged read from its first index hole to its
+   second; if it has fewer than two, use what's there. */
+static void
+add_pass(int track, int side, unsigned char *s, int len)
+{
+  sim_track *st;
+  int i, e1 = -1, e2 = len, n;
+
+  for (i = 0; i < len; i++) {
+    if ((s[i] & 0x80) && (i == 0 || !(s[i-1] & 0x80))) {
+      if (e1 < 0) {
+        e1 = i;
+      } else {
+        e2 = i;
+        break;
+      }
+    }
+  }
+  if (e1 < 0 || e2 == len) e1 = 0;
+  n = e2 - e1;
+  if (track >= SIM_TRACKS || n == 0) return;
+  st = &disk[track][side];
+  if (st->npasses == SIM_PASSES) return;
+  st->s[st->npasses] = malloc(n);
+  st->len[st->npasses] = n;
+  st->total[st->npasses] = 0;
+  for (i = 0; i < n; i++) {
+    st->s[st->npasses][i] = s[e1 + i] & 0x7f;
+    st->total[st->npasses] += (s[e1 + i] & 0x7f) + 1;
+  }
+  st->npasses++;
+}
+
+int
+cwsim_init(const char *spec, int *cw_mk)
+{
+  FILE *f;
+  log_reader *lr;
+  int track, side, pass, v, len, size = 0, i, rpm;
+  unsigned char *s = NULL;
+
+  sim.mk = env_int("CWSIM_MK", 4);
+  sim.clock = env_int("CWSIM_CLOCK", 2);
+  sim.steps = env_int("CWSIM_STEPS", 1);
+  sim.wp = env_int("CWSIM_WP", 0);
+  sim.fast = env_int("CWSIM_FAST", 0);
+  rpm = env_int("CWSIM_RPM", 300);
+  sim.outname = getenv("CWSIM_OUT");
+  if ((sim.mk != 3 && sim.mk != 4) || sim.steps < 1 || sim.steps > 2 ||
+      (sim.clock != 1 && sim.clock != 2 && sim.clock != 4) || rpm <= 0) {
+    fprintf(stderr, "cwsim: bad CWSIM_MK, CWSIM_STEPS, CWSIM_CLOCK, "
+	    "or CWSIM_RPM\n");
+    return -1;
+  }
+  sim.rev_us = 60000000LL / rpm;
+
+  f = fopen(spec, "r");
+  if (f == NULL) {
+    perror(spec);
+    return -1;
+  }
+  lr = log_reader_new(f);
+  while ((track = parse_track(lr, &side, &pass)) != EOF) {
+    len = 0;
+    while ((v = parse_sample(lr)) != EOF) {
+      if (len == size) {
+        size = size ? 2 * size : 65536;
+        s = realloc(s, size);
+      }
+      s[len++] = v;
+    }
+    if (side >= 0 && side <= 1) {
+      add_pass(track, side, s, len);
+    }
+  }
+  free(s);
+  log_reader_free(lr);
+  fclose(f);
+
+  /* A track with no flux transitions at all */
+  len = sim.rev_us * CWHZ * sim.clock / 1000000 / 128;
+  blank.s[0] = malloc(len);
+  memset(blank.s[0], 0x7f, len);
+  blank.len[0] = len;
+  blank.total[0] = (long) len * 128;
+  blank.npasses = 1;
+
+  sim.head = 10;
+  sim.ctrl = 0xff;
+  sim.vclock = 0;
+  sim.epoch = cwsim_clock_us();
+  for (i = 0; i < CW_MEMSIZE; i++) {
+    sim.mem[i] = 0;
+  }
+  if (sim.outname) {
+    atexit(save_written);
+  }
+  cwsim_on = 1;
+  *cw_mk = sim.mk;
+  return SIM_PORT;
+}
@@ -0,0 +1,42 @@
+/*
+ * cwsim.h: Register-level software simulation of a Catweasel MK3/MK4.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+
+#ifndef _CWSIM_H
+#define _CWSIM_H
+
+/* Nonzero once cwsim_init has succeeded; catweasl.c then sends all
+   port I/O to the simulator instead of the hardware. */
+extern int cwsim_on;
+
+/*
+ * Start the simulator, loading the disk from the level 7 log named by
+ * spec.  Returns the simulated card's I/O port base and sets *cw_mk,
+ * as pci_find_catweasel would, or returns -1 after printing a message
+ * on failure.  Other settings come from the environment; see cwsim.c.
+ */
+int cwsim_init(const char *spec, int *cw_mk);
+
+/* Simulated port I/O */
+unsigned char cwsim_inb(unsigned short port);
+void cwsim_outb(unsigned char val, unsigned short port);
+
+/* Simulated clock and sleep; these use virtual time if CWSIM_FAST=1 */
+long long cwsim_clock_us(void);
+void cwsim_usleep(unsigned int usec);
+
+#endif /* _CWSIM_H */
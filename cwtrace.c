@@ -0,0 +1,176 @@
+/*
+ * cwtrace: Print a binary trace of the decoder's events as text
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+
+/*
+ * Usage:
+ *
+ *     cwtrace [-v verbosity] [-s] file.trace
+ *
+ * Reads a trace written by cw2dmk -B and prints the decoder's events
+ * as cw2dmk would have logged them at the given verbosity (3 to 7, 7
+ * by default), with a "Track t, side s, pass p:" line starting each
+ * read.  The per-read summaries that cw2dmk itself prints are not
+ * in the trace.  With -s, each event is preceded by the index of the
+ * sample it was reported at, in brackets.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+
+#include "decoder.h"
+#include "trace.h"
+
+int level = OUT_SAMPLES;
+int show_sample = 0;
+long pending = -1;  /* sample index not yet shown for this event */
+int skip = 0;       /* in samples that only a level 7 log has */
+
+void
+usage(void)
+{
+  printf("\nUsage: cwtrace [options] file.trace\n");
+  printf(" Options [defaults in brackets]:\n");
+  printf(" -v verbosity  Message level, as for cw2dmk -v [%d]\n", level);
+  printf(" -s            Show the sample index of each event\n");
+  exit(1);
+}
+
+/* Read a number written 7 bits at a time; -1 at the end of the file */
+int
+get_number(FILE *f, unsigned int *n)
+{
+  int c, shift = 0;
+
+  *n = 0;
+  do {
+    c = getc(f);
+    if (c == EOF || shift > 28) return -1;
+    *n |= (unsigned int) (c & 0x7f) << shift;
+    shift += 7;
+  } while (c & 0x80);
+  return 0;
+}
+
+/* Read the next event; 0 at the end of the file, -1 if cut short */
+int
+get_event(FILE *f, unsigned int *sample, int *type, int *a, int *b)
+{
+  unsigned int step, ua, ub;
+  int c;
+
+  c = getc(f);
+  if (c == EOF) return 0;
+  if (c & 0x80) {
+    /* A sample, at the sample after the last event */
+    *type = EV_SAMPLE;
+    *a = c & 0x7f;
+    *b = getc(f);
+    ++*sample;
+    return (*b == EOF) ? -1 : 1;
+  }
+  *type = c;
+  if (get_number(f, &step) < 0 || get_number(f, &ua) < 0 ||
+      get_number(f, &ub) < 0) return -1;
+  *sample += (step >> 1) ^ -(step & 1);
+  *a = ua;
+  *b = ub;
+  return 1;
+}
+
+/* Print the pieces of an event's text that cw2dmk would at level */
+void
+print_msg(void *arg, int msg_level, const char *fmt, va_list ap)
+{
+  if (msg_level > level ||
+      (msg_level == OUT_RAW && level != OUT_RAW) ||
+      (msg_level == OUT_HEX && level == OUT_RAW)) return;
+  if (pending >= 0) {
+    printf("[@%ld]", pending);
+    pending = -1;
+  }
+  vprintf(fmt, ap);
+}
+
+int
+main(int argc, char **argv)
+{
+  FILE *f;
+  unsigned char hdr[TRACE_HDR_SIZE];
+  unsigned int sample = 0;
+  int ch, reads = 0, type, a, b, ret;
+
+  opterr = 0;
+  for (;;) {
+    ch = getopt(argc, argv, "v:s");
+    if (ch == -1) break;
+    switch (ch) {
+    case 'v':
+      level = strtol(optarg, NULL, 0);
+      if (level < OUT_QUIET || level > OUT_SAMPLES) usage();
+      break;
+    case 's':
+      show_sample = 1;
+      break;
+    default:
+      usage();
+      break;
+    }
+  }
+  if (argc - optind != 1) usage();
+
+  f = fopen(argv[optind], "rb");
+  if (f == NULL) {
+    perror(argv[optind]);
+    exit(1);
+  }
+  if (fread(hdr, sizeof(hdr), 1, f) != 1 ||
+      memcmp(hdr, TRACE_MAGIC, 4) != 0 ||
+      hdr[4] != TRACE_VERSION) {
+    fprintf(stderr, "cwtrace: %s is not a trace file I can read\n",
+	    argv[optind]);
+    exit(1);
+  }
+
+  while ((ret = get_event(f, &sample, &type, &a, &b)) > 0) {
+    if (type >= N_EVENTS) {
+      ret = -1;
+      break;
+    }
+    if (type == EV_READ) {
+      if (reads++ > 0 && level >= OUT_TSUMMARY) putchar('\n');
+    }
+    if (type == EV_PAST_FULL && level < OUT_SAMPLES) skip = 1;
+    if (type == EV_PAST_FULL_END) skip = 0;
+    if (skip) continue;
+    if (show_sample && type != EV_READ) pending = sample;
+    decode_event_print(type, a, b, print_msg, NULL);
+  }
+  if (reads > 0 && level >= OUT_TSUMMARY) putchar('\n');
+  if (ferror(f)) {
+    perror(argv[optind]);
+    exit(1);
+  }
+  if (ret != 0) {
+    fprintf(stderr, "cwtrace: %s is damaged or cut short\n", argv[optind]);
+    exit(1);
+  }
+  fclose(f);
+  return 0;
+}
@@ -0,0 +1,2174 @@
+/*
+ * decoder.c: FM/MFM/RX02 decoder from Catweasel samples to DMK tracks.
+ * Copyright (C) 2000 Timothy Mann
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include "crc.h"
+#include "dmk.h"
+#include "decoder.h"
+
+static const char *const enc_name[N_ENCS] = {
+  "autodetect", "FM", "MFM", "RX02"
+};
+
+#include "secsize.c"
+
+typedef void markscan_fn(const unsigned long long *buf,
+			 unsigned long long *cand, long k0, long k1,
+			 unsigned long long fm, unsigned long long mfm);
+
+typedef void decode_kernel_fn(struct decoder *d);
+
+/*
+ * Decoder state.  Everything the decoder reads or writes while
+ * turning one read into a DMK track is kept here and passed in
+ * explicitly.  Callers see only the functions in decoder.h.
+ */
+struct decoder {
+  struct decode_params p;
+
+  /* Messages go to msg, if set, up to level msg_level */
+  decode_msg_fn *msg;
+  void *msg_arg;
+  int msg_level;
+
+  /* Events also go to trace, if set, whatever msg_level is.  Only this
+     decoder may use it while it is set. */
+  struct trace *trace;
+  unsigned int sample_index;  /* of the sample being decoded */
+
+  /* Bit and byte decoding */
+  unsigned long long accum, taccum;
+  int bits;
+  int ibyte, dbyte, ebyte;
+  unsigned short crc;
+  int sizecode;
+  unsigned char premark;
+  int mark_after;
+  int write_splice;      /* bit counter, >0 if we may be in a write splice */
+  int curenc;
+  int first_encoding;    /* first encoding to try on next track */
+  int curcyl;            /* cylinder in the last sector ID */
+  float adj;             /* postcomp adjustment for the next sample */
+  int index_edge;
+  int backward_am;
+  int cylseen;
+
+  /* What the last read started from (see decode_same_start) */
+  int start_encoding, start_rx02, start_sample;
+  float start_adj;
+
+  /* DMK track being built */
+  unsigned char *dmk_track;
+  unsigned short *dmk_idam_p;
+  unsigned char *dmk_data_p;
+  int dmk_valid_id, dmk_awaiting_dam, dmk_awaiting_iam;
+  int dmk_ignored;
+  int dmk_full;
+  struct TrackStat stat;
+  int enc_sec_used;       /* stat.enc_sec entries set by this read */
+  struct decode_sector sector[DMK_TKHDR_SIZE / 2];
+  int nsectors;
+  int rx02_seen;          /* RX02 sectors on earlier tracks */
+
+  /* Bitstream between the two decoding stages (see decode_bits) */
+  unsigned long long *bitbuf;
+  long bitbuf_words;
+  unsigned long nbits;     /* bits classified */
+  unsigned long pos;       /* bits decoded */
+  unsigned long full_pos;  /* bit that filled the DMK track */
+  unsigned long long cur;  /* bits not yet stored in bitbuf */
+  int oldb;                /* last sample, for the index hole edges */
+  unsigned long long *markbuf;  /* where marks may end */
+  unsigned long scanned;   /* bits markscan has been over */
+  markscan_fn *markscan;
+  decode_kernel_fn *kernel;  /* stage 2 for this read */
+  int pext;                /* use pext in the kernels */
+
+  /* Merging sectors from several reads (-j) */
+  unsigned char *dmk_merged_track;
+  int dmk_merged_track_len;
+  unsigned char *dmk_tmp_track;
+  struct TrackStat merged_stat;
+};
+
+/* Suppress FM address mark detection for a few bit times after each
+   data CRC is seen.  Helps prevent seeing bogus marks in write
+   splices. */
+#define WRITE_SPLICE 32
+
+#define X(type, level, fmt) level,
+static const int event_level[N_EVENTS] = { TRACE_EVENTS };
+#undef X
+#define X(type, level, fmt) fmt,
+static const char *const event_fmt[N_EVENTS] = { TRACE_EVENTS };
+#undef X
+
+#ifdef __GNUC__
+static void devt_out(struct decoder *d, int type, int a, int b)
+  __attribute__((noinline, cold));
+#endif
+
+/* Code for particular x86-64 CPU features, picked at run time */
+#if defined(__GNUC__) && defined(__x86_64__)
+#define HAVE_CPU_DISPATCH 1
+#endif
+
+/*
+ * Report an event: add it to the trace, if any, and log its text
+ * through the hook if its level is on.  The level is checked inline,
+ * so an event that is off costs a compare or two and no call;
+ * process_bit and process_sample report several per bit cell at the
+ * higher levels.  Missing arguments are passed as 0.
+ */
+#define devt(d, type, ...) devt2((d), (type), ##__VA_ARGS__, 0, 0)
+#define devt2(d, type, a, b, ...) \
+  do { \
+    if ((d)->trace) { \
+      trace_put((d)->trace, (d)->sample_index, (type), (a), (b)); \
+    } \
+    if (event_level[type] <= (d)->msg_level && (d)->msg) { \
+      devt_out((d), (type), (a), (b)); \
+    } \
+  } while (0)
+
+/* Pass one piece of an event's text to the hook if its level is on */
+static void
+dmsg_filter(void *arg, int level, const char *fmt, va_list ap)
+{
+  struct decoder *d = (struct decoder *) arg;
+
+  if (level <= d->msg_level) {
+    d->msg(d->msg_arg, level, fmt, ap);
+  }
+}
+
+static void
+devt_out(struct decoder *d, int type, int a, int b)
+{
+  decode_event_print(type, a, b, dmsg_filter, d);
+}
+
+#ifdef __GNUC__
+static void emit(decode_msg_fn *fn, void *arg, int level, const char *fmt, ...)
+  __attribute__((format(printf,4,5)));
+#endif
+
+static void
+emit(decode_msg_fn *fn, void *arg, int level, const char *fmt, ...)
+{
+  va_list args;
+
+  va_start(args, fmt);
+  fn(arg, level, fmt, args);
+  va_end(args);
+}
+
+void
+decode_event_print(int type, int a, int b, decode_msg_fn *fn, void *arg)
+{
+  if (type < 0 || type >= N_EVENTS) return;
+  switch (type) {
+  case EV_READ:
+    emit(fn, arg, OUT_TSUMMARY, "Track %d, side %d, pass %d:",
+	 a, b >> 16, b & 0xffff);
+    break;
+  case EV_ENC_CHANGE:
+    emit(fn, arg, OUT_ERRORS, "[%s->%s] ",
+	 enc_name[a & (N_ENCS - 1)], enc_name[b & (N_ENCS - 1)]);
+    break;
+  case EV_PAST_FULL:
+  case EV_PAST_FULL_END:
+    break;
+  case EV_BYTE:
+    /* Parts of a byte's text appear at different levels */
+    emit(fn, arg, OUT_SAMPLES, "<");
+    emit(fn, arg, OUT_HEX, "%02x", a);
+    emit(fn, arg, OUT_SAMPLES, ">");
+    emit(fn, arg, OUT_HEX, " ");
+    emit(fn, arg, OUT_RAW, "%c", a);
+    break;
+  default:
+    emit(fn, arg, event_level[type], event_fmt[type], a, b);
+    break;
+  }
+}
+
+
+/* True if we are ignoring data while waiting for an iam or for the
+   first idam */
+static int
+dmk_awaiting_track_start(struct decoder *d)
+{
+  if (d->p.dmk_iam_pos == -1) {
+    return !d->p.hole && (unsigned char*) d->dmk_idam_p == d->dmk_track;
+  } else {
+    return d->dmk_awaiting_iam;
+  }
+}
+
+
+static int
+dmk_in_range(struct decoder *d)
+{
+  if (d->dmk_full) return 0;
+  if (d->dmk_ignored < d->p.dmk_ignore) {
+    d->dmk_ignored++;
+    return 0;
+  }
+  /* Stop at leading edge of last index unless in sector data. */
+  if (d->p.hole && d->index_edge >= 3 && d->dbyte == -1 && d->ebyte == -1) {
+    devt(d, EV_INDEX_EDGE, d->index_edge);
+    d->dmk_full = 1;
+    return 0;
+  }
+  return 1;
+}
+
+
+static void
+dmk_data(struct decoder *d, unsigned char byte, int encoding)
+{
+  if (!dmk_in_range(d)) return;
+  if (d->dmk_awaiting_dam && byte >= 0xf8 && byte <= 0xfd) {
+    /* Kludge: DMK doesn't tag DAMs, so noise after the ID bytes
+       but before the DAM must not have the data bit pattern of a DAM */
+    byte = 0xf0;
+  }
+  if (d->dmk_data_p - d->dmk_track <= d->p.tracklen - 2) {
+    *d->dmk_data_p++ = byte;
+    if (encoding == FM && d->p.fmtimes == 2) {
+      *d->dmk_data_p++ = byte;
+    }
+  }
+  if (d->dmk_data_p - d->dmk_track > d->p.tracklen - 2) {
+    /* No room for more bytes after this one */
+    devt(d, EV_TRACK_FULL);
+    d->dmk_full = 1;
+  }
+}
+
+
+/* Status of the sector whose IDAM was seen last */
+static struct decode_sector *
+last_sector(struct decoder *d)
+{
+  return &d->sector[(d->dmk_idam_p - (unsigned short *)d->dmk_track) - 1];
+}
+
+
+static void
+dmk_idam(struct decoder *d, unsigned char byte, int encoding)
+{
+  unsigned short idamp;
+  int i;
+  if (!dmk_in_range(d)) return;
+
+  if (!d->dmk_awaiting_iam && dmk_awaiting_track_start(d)) {
+    /* In this mode, we position the first IDAM a nominal distance
+       from the start of the track, to make sure that (1) the whole
+       track will fit and (2) if dmk2cw is used to write the image
+       back to a real disk, the first IDAM won't be too close to the
+       index hole.  */
+#define GAP1PLUS 48
+    int bytesread = d->dmk_data_p - (d->dmk_track + DMK_TKHDR_SIZE);
+    if (bytesread < GAP1PLUS) {
+      /* Not enough bytes read yet.  Move read bytes forward and add fill. */
+      memmove(d->dmk_track + DMK_TKHDR_SIZE + GAP1PLUS - bytesread,
+	      d->dmk_track + DMK_TKHDR_SIZE,
+	      bytesread);
+      memset(d->dmk_track + DMK_TKHDR_SIZE,
+	     (encoding == MFM) ? 0x4e : 0xff,
+	     GAP1PLUS - bytesread);
+    } else {
+      /* Too many bytes read.  Move last GAP1PLUS back and throw rest away. */
+      memmove(d->dmk_track + DMK_TKHDR_SIZE,
+	      d->dmk_track + DMK_TKHDR_SIZE + bytesread - GAP1PLUS,
+	      GAP1PLUS);
+    }
+    d->dmk_data_p = d->dmk_track + DMK_TKHDR_SIZE + GAP1PLUS;
+  }
+
+  d->dmk_awaiting_dam = 0;
+  d->dmk_valid_id = 0;
+  idamp = d->dmk_data_p - d->dmk_track;
+  if (encoding == MFM) {
+    idamp |= DMK_DDEN_FLAG;
+  }
+  if (d->dmk_data_p < d->dmk_track + d->p.tracklen) {
+    if ((unsigned char*) d->dmk_idam_p >= d->dmk_track + DMK_TKHDR_SIZE) {
+      devt(d, EV_TOO_MANY_AMS);
+      d->stat.errcount++;
+    } else {
+      i = d->dmk_idam_p - (unsigned short *)d->dmk_track;
+      if (d->p.accum_sectors) {
+        /* Initially set enc_sec[] for this sector to the current
+         * encoding.  However, if the disk is RX02 format and the
+         * sector is double density, then the current encoding is FM,
+         * but the sector data encoding is RX02.  In this case enc_sec
+         * will be updated after we read the DAM to detect the sector
+         * data encoding.
+         */
+	d->stat.enc_sec[i] = encoding;
+	if (d->enc_sec_used <= i) d->enc_sec_used = i + 1;
+      }
+      memset(&d->sector[i], 0, sizeof(d->sector[i]));
+      d->sector[i].encoding = encoding;
+      *d->dmk_idam_p++ = idamp;
+      d->ibyte = 0;
+      dmk_data(d, byte, encoding);
+    }
+  }
+}
+
+
+static void
+dmk_iam(struct decoder *d, unsigned char byte, int encoding)
+{
+  if (!dmk_in_range(d)) return;
+
+  if (d->p.dmk_iam_pos >= 0) {
+    /* If the user told us where to position the IAM...*/
+    int bytesread = d->dmk_data_p - (d->dmk_track + DMK_TKHDR_SIZE);
+    if (d->dmk_awaiting_iam ||
+	(unsigned char*) d->dmk_idam_p == d->dmk_track) {
+      /* First IAM.  (Or a subsequent IAM with no IDAMs in between --
+	 in the latter case, we assume the previous IAM(s) were
+	 garbage.)  Position the IAM as instructed.  This can result
+	 in data loss if an IAM appears somewhere in the middle of the
+	 track, unless the read was for twice the track length as the
+	 hole=0 (-h0) flag sets it. */
+      int iam_pos = d->p.dmk_iam_pos;
+      if (encoding == FM && d->p.fmtimes == 2) {
+	iam_pos *= 2;
+      }
+      if (bytesread < iam_pos) {
+	/* Not enough bytes read yet.  Move read bytes forward and add fill. */
+	memmove(d->dmk_track + DMK_TKHDR_SIZE + iam_pos - bytesread,
+		d->dmk_track + DMK_TKHDR_SIZE,
+		bytesread);
+	memset(d->dmk_track + DMK_TKHDR_SIZE,
+	       (encoding == MFM) ? 0x4e : 0xff,
+	       iam_pos - bytesread);
+      } else {
+	/* Too many bytes read.  Move last iam_pos back and throw rest away. */
+	memmove(d->dmk_track + DMK_TKHDR_SIZE,
+		d->dmk_track + DMK_TKHDR_SIZE + bytesread - iam_pos,
+		iam_pos);
+      }
+      d->dmk_data_p = d->dmk_track + DMK_TKHDR_SIZE + iam_pos;
+      d->dmk_awaiting_iam = 0;
+    } else {
+      /* IAM that follows another IAM and one or more IDAMs.  If we're
+	 >95% of the way around the track, assume it's actually the
+	 first one again and stop here.  XXX This heuristic might be
+	 useful even when the user isn't having us position by IAM. */
+      if (bytesread > (d->p.tracklen - DMK_TKHDR_SIZE) * 95 / 100) {
+	devt(d, EV_SECOND_IAM);
+	d->dmk_full = 1;
+	return;
+      }
+    }
+  }
+
+  d->dmk_awaiting_dam = 0;
+  d->dmk_valid_id = 0;
+  dmk_data(d, byte, encoding);
+}
+
+
+static void
+dmk_init_track(struct decoder *d)
+{
+  int i;
+
+  memset(d->dmk_track, 0, d->p.tracklen);
+  d->dmk_idam_p = (unsigned short*) d->dmk_track;
+  d->dmk_data_p = d->dmk_track + DMK_TKHDR_SIZE;
+  d->dmk_awaiting_dam = 0;
+  d->dmk_valid_id = 0;
+  d->dmk_full = 0;
+  d->stat.good_sectors = 0;
+  if (d->p.accum_sectors)
+    d->stat.reused_sectors = 0;
+  for (i = 0; i < N_ENCS; i++) {
+    d->stat.enc_count[i] = 0;
+  }
+  d->stat.errcount = 0;
+  d->enc_sec_used = 0;
+  d->backward_am = 0;
+  d->dmk_ignored = 0;
+  if (d->p.dmk_ignore < 0) {
+    i = d->p.dmk_ignore;
+    while (i++) *d->dmk_data_p++ = 0xff;
+  }
+  d->cylseen = -1;
+  if (d->p.dmk_iam_pos >= 0) {
+    d->dmk_awaiting_iam = 1;
+  }
+  d->write_splice = 0;
+}
+
+
+static void
+check_missing_dam(struct decoder *d)
+{
+  if (d->dmk_awaiting_dam)
+    devt(d, EV_MISSING_DAM);
+  else if (d->dbyte > 0)
+    devt(d, EV_INCOMPLETE_DATA);
+  else
+    return;
+
+  d->dmk_awaiting_dam = 0;
+  d->dmk_valid_id = 0;
+  d->dbyte = d->ibyte = d->ebyte = -1;
+  d->stat.errcount++;
+  if (d->p.accum_sectors)
+    d->dmk_idam_p[-1] |= DMK_EXTRA_FLAG;
+}
+
+
+static int
+dmk_check_wraparound(struct decoder *d)
+{
+  /* Once we've read 95% of the track, if we see a sector ID that's
+     identical to the first one we saw on the track, conclude that we
+     wrapped around and are seeing the first one again, and
+     retroactively ignore it. */
+  unsigned short first_idamp, last_idamp;
+  int cmplen;
+  if (d->dmk_data_p - d->dmk_track - DMK_TKHDR_SIZE <
+      (d->p.tracklen - DMK_TKHDR_SIZE) * 95 / 100) {
+    return 0;
+  }
+  first_idamp = *(unsigned short*) d->dmk_track;
+  last_idamp = *(d->dmk_idam_p - 1);
+  if (first_idamp == last_idamp) return 0;
+  if ((first_idamp & DMK_DDEN_FLAG) != (last_idamp & DMK_DDEN_FLAG)) return 0;
+  if ((first_idamp & DMK_DDEN_FLAG) || d->p.fmtimes == 1) {
+    cmplen = 5;
+  } else {
+    cmplen = 10;
+  }
+  if (memcmp(&d->dmk_track[first_idamp & DMK_IDAMP_BITS],
+	     &d->dmk_track[last_idamp & DMK_IDAMP_BITS], cmplen) == 0) {
+    devt(d, EV_WRAPAROUND);
+    *--d->dmk_idam_p = 0;
+    d->dmk_awaiting_dam = 0;
+    d->ibyte = -1;
+    d->dmk_full = 1;
+    return 1;
+  }
+  return 0;
+}
+
+// Get pointer to sector N in rotational order.
+static unsigned char*
+dmk_get_phys_sector(struct decoder *d, unsigned char *track, int n)
+{
+  int off;
+
+  if (n < 0 || n >= DMK_TKHDR_SIZE / 2)
+    return NULL;
+
+  off = ((short *)track)[n] & DMK_IDAMP_BITS;
+  // IDAM offsets skip over IDAM offset table so can never be 0.
+  if (off == 0)
+    return NULL;
+
+  // Filter out bogus offset.  The mininum valid sector size here is really
+  // only avoiding very bad situations.
+  if (off < 0 || off > d->p.tracklen - 10)
+    return NULL;
+
+  return track + off;
+}
+
+// Get length of sector N in rotational order
+static int
+dmk_get_phys_sector_len(struct decoder *d, unsigned char *track, int n,
+			int tracklen)
+{
+  unsigned char* s0 = dmk_get_phys_sector(d, track, n);
+  unsigned char* s1 = dmk_get_phys_sector(d, track, n + 1);
+
+  if (!s0)
+    return -1;
+
+  if (s1) {
+    if (s0 >= s1) {
+      #if 0
+      int i;
+      printf("\nphysical sector misordering from %d to %d .. "
+	     "off %d off %d max %d!\n",
+      	     n, n + 1, s0 - track, s1 - track, d->p.tracklen);
+      for (i = 0; i < 10; i++)
+	printf("%x ", ((short *)track)[i]);
+      printf("\n");
+      if (track == d->dmk_tmp_track) printf("TMP track\n");
+      if (track == d->dmk_track) printf("common track\n");
+      if (track == d->dmk_merged_track) printf("merged track\n");
+      #endif
+
+      return -1;
+    }
+
+    return s1 - s0;
+  }
+
+  return tracklen - (s0 - (track + DMK_TKHDR_SIZE));
+}
+
+static int
+dmk_get_sector_num(unsigned char *secdata)
+{
+  // Single density repeats every byte in DMK format.  If we see a repeat
+  // of the sector ID then we know the sector number is at twice the offset.
+  return secdata[secdata[1] == 0xfe ? 6 : 3];
+}
+
+static int
+copy_preamble(struct decoder *d, unsigned char **dst, unsigned char *track)
+{
+  unsigned char *pre_end = dmk_get_phys_sector(d, track, 0);
+  int pre_len;
+
+  if (!pre_end || pre_end <= track + DMK_TKHDR_SIZE)
+    return 0;
+
+  pre_len = pre_end - (track + DMK_TKHDR_SIZE);
+  memcpy(*dst, track + DMK_TKHDR_SIZE, pre_len);
+  *dst += pre_len;
+
+  return 1;
+}
+
+// Go over the track we have read and replace any bad sectors with sectors
+// from any previous read attempts.
+// Takes a very simple-minded approach and cannot cope with a situation
+// where sectors appear to be missing because of damage to the IDAM or DAM
+// headers.
+void
+decode_merge(struct decoder *d)
+{
+  int tracklen = d->dmk_data_p - (d->dmk_track + DMK_TKHDR_SIZE);
+  unsigned char *tmp_data_p = d->dmk_tmp_track + DMK_TKHDR_SIZE;
+  short *idam_p = (short *)d->dmk_track;
+  short *tmp_idam_p = (short *)d->dmk_tmp_track;
+  short *merged_idam_p = (short *)d->dmk_merged_track;
+  unsigned char *dmk_sec;
+  int cur;
+  int overflow = 0;
+  int best_errcount;
+  int best_repair;
+  struct TrackStat tmp_stat;
+  enum Pick { Merged, Current, Tmp } best;
+
+  // As a special case, use the track as-is if it read without error.
+  if (d->stat.errcount == 0) {
+    memcpy(d->dmk_merged_track, d->dmk_track, DMK_TKHDR_SIZE + tracklen);
+    d->dmk_merged_track_len = tracklen;
+    d->merged_stat.errcount = d->stat.errcount;
+    d->merged_stat.good_sectors = d->stat.good_sectors;
+    d->merged_stat.reused_sectors = 0;
+    memcpy(d->merged_stat.enc_count, d->stat.enc_count,
+	   sizeof d->stat.enc_count);
+    memcpy(d->merged_stat.enc_sec, d->stat.enc_sec, sizeof d->stat.enc_sec);
+    return;
+  }
+
+  memset(d->dmk_tmp_track, 0, DMK_TKHDR_SIZE);
+  tmp_stat.errcount = d->stat.errcount;
+  tmp_stat.good_sectors = d->stat.good_sectors;
+  tmp_stat.reused_sectors = 0;
+  memcpy(tmp_stat.enc_count, d->stat.enc_count, sizeof d->stat.enc_count);
+  memcpy(tmp_stat.enc_sec, d->stat.enc_sec, sizeof d->stat.enc_sec);
+
+  for (cur = 0; (dmk_sec = dmk_get_phys_sector(d, d->dmk_track, cur)); cur++) {
+    int replaced = 0;
+    // Bad sector?  See if we can find a replacement
+    if (idam_p[cur] & DMK_EXTRA_FLAG) {
+      int secnum = dmk_get_sector_num(dmk_sec), prev;
+      unsigned char *prev_sec;
+      for (prev = 0;
+	   (prev_sec = dmk_get_phys_sector(d, d->dmk_merged_track, prev));
+	   prev++) {
+	int seclen = dmk_get_phys_sector_len(d, d->dmk_merged_track, prev,
+					     d->dmk_merged_track_len);
+	if (dmk_get_sector_num(prev_sec) != secnum)
+	  continue;
+
+	// Ignore previous sector if it had an error
+	if (merged_idam_p[prev] & DMK_EXTRA_FLAG)
+	  continue;
+
+	// The very first sector needs the pre-amble copied over, too.
+	// We only understand this if the first sector is replacing the first
+	// sector.  If not, then we skip because best not create bogus data.
+	if (cur == 0) {
+	  if (prev != 0)
+	    continue;
+
+	  if (!copy_preamble(d, &tmp_data_p, d->dmk_merged_track))
+	    continue;
+	}
+
+	// Don't overflow the merged track.
+	if (seclen <= 0 || tmp_data_p + seclen > d->dmk_tmp_track + d->p.tracklen)
+	  continue;
+
+	devt(d, EV_REUSE, secnum);
+
+	*tmp_idam_p++ = (merged_idam_p[prev] & ~DMK_IDAMP_BITS) |
+	  ((tmp_data_p - d->dmk_tmp_track) & DMK_IDAMP_BITS);
+
+	memcpy(tmp_data_p, prev_sec, seclen);
+	tmp_data_p += seclen;
+	replaced = 1;
+	tmp_stat.reused_sectors++;
+	tmp_stat.enc_sec[cur] = d->merged_stat.enc_sec[cur];
+	tmp_stat.enc_count[d->merged_stat.enc_sec[cur]]++;
+	// There should be an error for every bad sector, but just
+	// to be careful.
+	if (tmp_stat.errcount > 0)
+	  tmp_stat.errcount--;
+	break;
+      }
+    }
+
+    if (!replaced) {
+      // Copy the sector we have whether it be a good or bad read.
+      int seclen = dmk_get_phys_sector_len(d, d->dmk_track, cur, tracklen);
+
+      // Need to copy preamble if we are the first sector
+      if (cur == 0 && !copy_preamble(d, &tmp_data_p, d->dmk_track))
+	overflow = 1;
+      else if (seclen < 0 ||
+	       tmp_data_p + seclen > d->dmk_tmp_track + d->p.tracklen)
+	overflow = 1;
+      else {
+	*tmp_idam_p++ = (idam_p[cur] & ~DMK_IDAMP_BITS) |
+      	  ((tmp_data_p - d->dmk_tmp_track) & DMK_IDAMP_BITS);
+	memcpy(tmp_data_p, dmk_sec, seclen);
+	tmp_data_p += seclen;
+      }
+    }
+  }
+
+  // dmk_tmp_track has tmp_stat.errcount errors
+  // (or is unusable if overflow is set).
+  // dmk_merged_track has merged_stat.errcount errors.
+  // dmk_track has errcount errors.
+
+  // We want to keep the best as determined by the lowest error count and
+  // that will become our merged track.
+
+  best = Current;
+  best_errcount = d->stat.errcount;
+  best_repair = 0;
+  // overflow means that the candidate merged track tmp is not viable.
+  if (!overflow && tmp_stat.errcount < best_errcount) {
+    best = Tmp;
+    best_errcount = tmp_stat.errcount;
+    best_repair = tmp_stat.reused_sectors;
+  }
+  // If we have a previous merged track, it may still be the best.
+  // Especially if it has fewer repairs.
+  if (d->dmk_merged_track_len > 0) {
+    if (d->merged_stat.errcount < best_errcount ||
+	(d->merged_stat.errcount == best_errcount &&
+	 d->merged_stat.reused_sectors < best_repair))
+    {
+      best = Merged;
+      best_errcount = d->merged_stat.errcount;
+      best_repair = d->merged_stat.reused_sectors;
+    }
+  }
+
+  //dmsg(d, OUT_ERRORS, "(%d,%d,%d) ", errcount, tmp_stat.errcount,
+  //    merged_stat.errcount);
+
+  switch (best) {
+  default:
+  case Current:
+    devt(d, EV_USING_CURRENT);
+    memcpy(d->dmk_merged_track, d->dmk_track, DMK_TKHDR_SIZE + tracklen);
+    d->dmk_merged_track_len = tracklen;
+    d->merged_stat.good_sectors = d->stat.good_sectors;
+    d->merged_stat.reused_sectors = 0;
+    memcpy(d->merged_stat.enc_count, d->stat.enc_count,
+	   sizeof d->stat.enc_count);
+    memcpy(d->merged_stat.enc_sec, d->stat.enc_sec, sizeof d->stat.enc_sec);
+    break;
+  case Tmp:
+    devt(d, EV_USING_MERGED);
+    d->dmk_merged_track_len = tmp_data_p - (d->dmk_tmp_track + DMK_TKHDR_SIZE);
+    memcpy(d->dmk_merged_track, d->dmk_tmp_track,
+	   DMK_TKHDR_SIZE + d->dmk_merged_track_len);
+    d->merged_stat = tmp_stat;
+    break;
+  case Merged:
+    devt(d, EV_USING_PREVIOUS);
+    break;
+  }
+
+  d->merged_stat.errcount = best_errcount;
+}
+
+
+void
+decode_merge_start(struct decoder *d)
+{
+  d->dmk_merged_track_len = 0;
+  memset(d->dmk_merged_track, 0, d->p.tracklen);
+  // Do not have to initialize merged_stat as dmk_merged_track_len == 0
+  // will stop us from using that information.
+}
+
+
+const struct TrackStat *
+decode_merged_stat(const struct decoder *d)
+{
+  return &d->merged_stat;
+}
+
+
+void
+decode_use_merged(struct decoder *d)
+{
+  short *idam_p = (short *)d->dmk_track;
+  int i;
+
+  memset(d->dmk_track, (d->curenc == MFM) ? 0x4e : 0xff, d->p.tracklen);
+  memcpy(d->dmk_track, d->dmk_merged_track,
+	 DMK_TKHDR_SIZE + d->dmk_merged_track_len);
+  for (i = 0; i < DMK_TKHDR_SIZE / 2; i++)
+    *idam_p++ &= ~DMK_EXTRA_FLAG;
+
+  d->stat.errcount = d->merged_stat.errcount;
+  d->stat.good_sectors = d->merged_stat.good_sectors +
+    d->merged_stat.reused_sectors;
+  d->stat.reused_sectors = d->merged_stat.reused_sectors;
+  memcpy(d->stat.enc_count, d->merged_stat.enc_count,
+	 sizeof d->stat.enc_count);
+  memcpy(d->stat.enc_sec, d->merged_stat.enc_sec, sizeof d->stat.enc_sec);
+}
+
+
+int
+decode_merge_save(const struct decoder *d, unsigned char *buf,
+		  struct TrackStat *stat)
+{
+  memcpy(buf, d->dmk_merged_track, DMK_TKHDR_SIZE + d->dmk_merged_track_len);
+  *stat = d->merged_stat;
+  return d->dmk_merged_track_len;
+}
+
+
+void
+decode_merge_restore(struct decoder *d, const unsigned char *buf, int len,
+		     const struct TrackStat *stat)
+{
+  memcpy(d->dmk_merged_track, buf, DMK_TKHDR_SIZE + len);
+  d->dmk_merged_track_len = len;
+  d->merged_stat = *stat;
+}
+
+static void
+init_decoder(struct decoder *d)
+{
+  d->accum = 0;
+  d->taccum = 0;
+  d->bits = 0;
+  d->ibyte = d->dbyte = d->ebyte = -1;
+  d->premark = 0;
+  d->mark_after = -1;
+  d->curenc = d->first_encoding;
+}
+
+
+static int
+mfm_valid_clock(unsigned long long accum)
+{
+  /* Check for valid clock bits */
+  unsigned int xclock = ~((accum >> 1) | (accum << 1)) & 0xaaaa;
+  unsigned int clock = accum & 0xaaaa;
+  if (xclock != clock) {
+    //dmsg(d, OUT_ERRORS, "[clock exp %04x got %04x]", xclock, clock);
+    return 0;
+  }
+  return 1;
+}
+
+
+/* Window used to undo RX02 MFM transform */
+#if 1
+#define WINDOW 4   /* change aligned 1000 -> 0101 */
+#else
+#define WINDOW 12  /* change aligned x01000100010 -> x00101010100 */
+#endif
+
+
+/*
+ * Taking the data bits of a byte out of its clock/data pairs.  With
+ * BMI2, one pext does it; otherwise a table gives the data bits of
+ * each 8 bits of the pairs.
+ */
+#define MFM_DATA(b) \
+  (((b) & 1) | (((b) >> 1) & 2) | (((b) >> 2) & 4) | (((b) >> 3) & 8))
+#define FM_DATA(b) ((((b) >> 1) & 1) | (((b) >> 4) & 2))
+#define TAB4(f, b) f(b), f((b) + 1), f((b) + 2), f((b) + 3)
+#define TAB16(f, b) \
+  TAB4(f, b), TAB4(f, (b) + 4), TAB4(f, (b) + 8), TAB4(f, (b) + 12)
+#define TAB64(f, b) \
+  TAB16(f, b), TAB16(f, (b) + 16), TAB16(f, (b) + 32), TAB16(f, (b) + 48)
+#define TAB256(f) TAB64(f, 0), TAB64(f, 64), TAB64(f, 128), TAB64(f, 192)
+
+/* Data bits of 4 MFM clock/data pairs */
+static const unsigned char mfm_data[256] = { TAB256(MFM_DATA) };
+
+/* Data bits of 2 FM clock/data pairs, at the MFM rate as 4 bits each */
+static const unsigned char fm_data[256] = { TAB256(FM_DATA) };
+
+static inline unsigned long long
+pext64(unsigned long long v, unsigned long long mask)
+{
+#if HAVE_CPU_DISPATCH
+  unsigned long long r;
+  __asm__("pextq %2, %1, %0" : "=r" (r) : "r" (v), "rm" (mask));
+  return r;
+#else
+  return 0;  /* not used */
+#endif
+}
+
+/* The MFM byte in bits 63-48 of w */
+static inline unsigned char
+mfm_byte(unsigned long long w, int pext)
+{
+  if (pext) return pext64(w, 0x5555000000000000ULL);
+  return mfm_data[(w >> 48) & 0xff] | (mfm_data[w >> 56] << 4);
+}
+
+/* The FM byte in bits 63-32 of w */
+static inline unsigned char
+fm_byte(unsigned long long w, int pext)
+{
+  if (pext) return pext64(w, 0x2222222200000000ULL);
+  return fm_data[(w >> 32) & 0xff] | (fm_data[(w >> 40) & 0xff] << 2) |
+    (fm_data[(w >> 48) & 0xff] << 4) | (fm_data[w >> 56] << 6);
+}
+
+
+static void
+change_enc(struct decoder *d, int newenc)
+{
+  if (d->curenc != newenc) {
+    devt(d, EV_ENC_CHANGE, d->curenc, newenc);
+    d->curenc = newenc;
+  }
+}
+
+
+static void output_byte(struct decoder *d, unsigned char val);
+
+/*
+ * Main routine of the FM/MFM/RX02 decoder.  The input is a stream of
+ * alternating clock/data bits, passed in one by one; decode_bits
+ * passes only the bits where there may be something to do and skips
+ * the rest (see skip_bits).  See decoder.txt for documentation on how
+ * the decoder works.
+ *
+ * This is built into a kernel for each of FM, MFM, and RX02 (kenc),
+ * and one for any encoding (kenc -1), each with and without pext (see
+ * decode_kernel).  A kernel for FM or MFM assumes curenc is always
+ * kenc, and one for RX02 that it is FM or RX02.
+ */
+#ifdef __GNUC__
+static inline void process_bit(struct decoder *d, int bit,
+			       const int kenc, const int pext)
+  __attribute__((always_inline));
+#endif
+
+static inline void
+process_bit(struct decoder *d, int bit, const int kenc, const int pext)
+{
+  int uenc = (kenc < 0) ? d->p.uencoding : kenc;
+  int enc;
+  unsigned char val;
+  int i;
+
+  if (d->dmk_full) return;
+  d->accum = (d->accum << 1) + bit;
+  if (kenc != FM && kenc != MFM) d->taccum = (d->taccum << 1) + bit;
+  d->bits++;
+  if (d->mark_after >= 0) d->mark_after--;
+  if (d->write_splice > 0) d->write_splice--;
+
+  /*
+   * Pre-detect address marks: we shift bits into the low-order end of
+   * our 64-bit shift register (accum), look for marks in the lower
+   * half, but decode data from the upper half.  When we recognize a
+   * mark (or certain other patterns), we repeat or drop some bits to
+   * achieve proper clock/data separatation and proper byte-alignment.
+   * Pre-detecting the marks lets us do this adjustment earlier and
+   * decode data more cleanly.
+   *
+   * We always sample bits at the MFM rate (twice the FM rate), but
+   * we look for both FM and MFM marks at the same time.  There is
+   * ambiguity here if we're dealing with normal (not DEC-modified)
+   * MFM, because FM marks can be legitimate MFM data.  So we don't
+   * look for FM marks while we think we're inside an MFM ID or data
+   * block, only in gaps.  With -e2, we don't look for FM marks at
+   * all.
+   */
+
+  /*
+   * For FM and RX02 marks, we look at 9 data bits (including a
+   * leading 0), which ends up being 36 bits of accum (2x for clocks,
+   * another 2x for the double sampling rate).  We must not look
+   * inside a region that can contain standard MFM data.
+   */
+  if (uenc != MFM && d->bits >= 36 && !d->write_splice &&
+      (d->curenc != MFM ||
+       (d->ibyte == -1 && d->dbyte == -1 && d->ebyte == -1 &&
+                         d->mark_after == -1))) {
+    switch (d->accum & 0xfffffffffULL) {
+    case 0x8aa222a88ULL:  /* 0xfc / 0xc7: Quirky index address mark */
+      if ((d->p.quirk & QUIRK_IAM) == 0) break;
+      /* fall through */
+    case 0x8aa2a2a88ULL:  /* 0xfc / 0xd7: Index address mark */
+    case 0x8aa222aa8ULL:  /* 0xfe / 0xc7: ID address mark */
+    case 0x8aa222888ULL:  /* 0xf8 / 0xc7: Standard deleted DAM */
+    case 0x8aa22288aULL:  /* 0xf9 / 0xc7: RX02 deleted DAM / WD1771 user DAM */
+    case 0x8aa2228a8ULL:  /* 0xfa / 0xc7: WD1771 user DAM */
+    case 0x8aa2228aaULL:  /* 0xfb / 0xc7: Standard DAM */
+    case 0x8aa222a8aULL:  /* 0xfd / 0xc7: RX02 DAM */
+      change_enc(d, FM);
+      if (d->bits < 64 && d->bits >= 48) {
+	devt(d, EV_BITS_ADDED, 64-d->bits);
+	d->bits = 64; /* byte-align by repeating some bits */
+      } else if (d->bits < 48 && d->bits > 32) {
+	devt(d, EV_BITS_DROPPED, d->bits-32);
+	d->bits = 32; /* byte-align by dropping some bits */
+      }
+      d->mark_after = 32;
+      d->premark = 0; // doesn't apply to FM marks
+      break;
+
+    case 0xa222a8888ULL:  /* Backward 0xf8-0xfd DAM */
+      if (d->mark_after > 0) break; // avoid firing on quirky IAM
+      // discourage firing on noise or splices
+      if (d->stat.good_sectors > 0) break;
+      change_enc(d, FM);
+      d->backward_am++;
+      devt(d, EV_BACKWARD_AM);
+      break;
+    }
+  }
+
+  /*
+   * For MFM premarks, we look at 16 data bits (two copies of the
+   * premark), which ends up being 32 bits of accum (2x for clocks).
+   */
+  if (uenc != FM && uenc != RX02 &&
+      d->bits >= 32 && !d->write_splice) {
+    switch (d->accum & 0xffffffff) {
+    case 0x52245224:
+      /* Pre-index mark, 0xc2c2 with missing clock between bits 3 & 4
+	 (using 0-origin big-endian counting!).  Would be 0x52a452a4
+	 without missing clock. */
+      change_enc(d, MFM);
+      d->premark = 0xc2;
+      if (d->bits < 64 && d->bits > 48) {
+	devt(d, EV_BITS_ADDED, 64-d->bits);
+	d->bits = 64; /* byte-align by repeating some bits */
+      }
+      d->mark_after = d->bits;
+      break;
+
+    case 0x448944a9:
+      /* Quirky pre-address mark, 0xa1a1 with missing clock in only the
+         first 0xa1. */
+      if ((d->p.quirk & QUIRK_PREMARK) == 0) break;
+      /* fall thru */
+
+    case 0x44894489:
+      /* Pre-address mark, 0xa1a1 with missing clock between bits 4 & 5
+	 (using 0-origin big-endian counting!).  Would be 0x44a944a9
+	 without missing clock.  Reading a pre-address mark backward
+	 also matches this pattern, but the following byte is then 0x80. */
+      change_enc(d, MFM);
+      d->premark = 0xa1;
+      if (d->bits < 64 && d->bits > 48) {
+	devt(d, EV_BITS_ADDED, 64-d->bits);
+	d->bits = 64; /* byte-align by repeating some bits */
+      }
+      d->mark_after = d->bits;
+      break;
+
+    case 0x55555555:
+      if ((d->p.quirk & QUIRK_EXTRA) == 0 && d->curenc == MFM &&
+	  d->mark_after < 0 &&
+	  d->ibyte == -1 && d->dbyte == -1 && d->ebyte == -1 && !(d->bits & 1)) {
+	/* ff ff in gap.  This should probably be 00 00, so drop 1/2
+           bit to bit-align.  This heuristic is harmful if the disk
+           format has meaningful extra bytes in a gap following the
+           data CRC and prior to the write splice, so suppress it if
+           QUIRK_EXTRA is set.  We'll still bit-align when the premark
+           shows up, and if dmk2cw is used to write the disk back
+           later, it will force the bytes preceding the premark to be
+           00 then.  The DMK file just won't look as nice. */
+        devt(d, EV_BITS_DROPPED, 1);
+	d->bits--;
+      }
+      break;
+
+    case 0x92549254:
+      if ((d->p.quirk & QUIRK_EXTRA) == 0 &&
+          d->mark_after < 0 &&
+          d->ibyte == -1 && d->dbyte == -1 && d->ebyte == -1) {
+	/* 4e 4e in gap.  This should probably be byte-aligned, so do
+           so by dropping bits.  This heuristic needs to be suppressed
+           by QUIRK_EXTRA too, as the extra bytes could theoretically
+           contain valid data that looks like 4e 4e when read with
+           wrong alignment. */
+	change_enc(d, MFM);
+	if (d->bits < 64 && d->bits > 48) {
+	  devt(d, EV_BITS_DROPPED, d->bits-48);
+	  d->bits = 48;
+	}
+      }
+      break;
+    }
+  }
+
+  /* Undo RX02 DEC-modified MFM transform (in taccum) */
+#if WINDOW == 4
+  if (kenc != FM && kenc != MFM &&
+      d->bits >= WINDOW && (d->bits & 1) == 0 &&
+      (d->accum & 0xfULL) == 0x8ULL) {
+    d->taccum = (d->taccum & ~0xfULL) | 0x5ULL;
+  }
+#else /* WINDOW == 12 */
+  if (kenc != FM && kenc != MFM &&
+      d->bits >= WINDOW && (d->bits & 1) == 0 &&
+      (d->accum & 0x7ffULL) == 0x222ULL) {
+    d->taccum = (d->taccum & ~0x7ffULL) | 0x154ULL;
+  }
+#endif
+
+  if (d->bits < 64) return;
+
+  enc = (kenc == FM || kenc == MFM) ? kenc : d->curenc;
+  if (enc == FM || enc == MIXED) {
+    /* Heuristic to detect being off by some number of bits */
+    if (d->mark_after != 0 &&
+	((d->accum >> 32) & 0xddddddddULL) != 0x88888888ULL) {
+      for (i = 1; i <= 3; i++) {
+	if (((d->accum >> (32 - i)) & 0xddddddddULL) == 0x88888888ULL) {
+	  /* Ignore oldest i bits */
+	  d->bits -= i;
+	  devt(d, EV_BITS_DROPPED, i);
+	  if (d->bits < 64) return;
+	  break;
+	}
+      }
+      if (i > 3) {
+#if 0 /* Bad idea: fires way too often in FM gaps. */
+	/* Check if it looks more like MFM */
+	if (d->p.uencoding != FM && d->p.uencoding != RX02 &&
+	    d->ibyte == -1 && d->dbyte == -1 && d->ebyte == -1 && !d->write_splice &&
+	    (d->accum & 0xaaaaaaaa00000000ULL) &&
+	    (d->accum & 0x5555555500000000ULL)) {
+	  for (i = 1; i <= 2; i++) {
+	    if (mfm_valid_clock(d->accum >> (48 - i))) {
+	      change_enc(d, MFM);
+	      d->bits -= i;
+	      devt(d, EV_BITS_DROPPED, i);
+	      return;
+	    }
+	  }
+	}
+#endif
+	/* Note bad clock pattern.  This doesn't mean the next data
+           byte to be output actually has a bad clock pattern.  It
+           just means that we see a bad clock pattern in the top half
+           of accum, and we don't have a complete predetected mark
+           there that we're just about to output (that is, mark_after
+           != 0).  The bad clock pattern may get fixed by a bit drop
+           or repeat heuristic before we output the next data byte. */
+	devt(d, EV_BAD_CLOCK);
+      }
+    }
+    val = fm_byte(d->accum, pext);
+    d->bits = 32;
+
+  } else if (enc == MFM && kenc != RX02) {
+    val = mfm_byte(d->accum, pext);
+    d->bits = 48;
+
+  } else /* curenc == RX02 */ {
+    val = mfm_byte(d->taccum, pext);
+    d->bits = 48;
+  }
+
+  output_byte(d, val);
+}
+
+
+/* The rest of process_bit, for each byte; the same for all kernels */
+static void
+output_byte(struct decoder *d, unsigned char val)
+{
+  if (d->mark_after == 0) {
+    d->mark_after = -1;
+    switch (val) {
+    case 0xfc:
+      /* Index address mark */
+      if (d->curenc == MFM && d->premark != 0xc2) break;
+      check_missing_dam(d);
+      devt(d, EV_IAM);
+      dmk_iam(d, 0xfc, d->curenc);
+      d->ibyte = -1;
+      d->dbyte = -1;
+      d->ebyte = -1;
+      return;
+
+    case 0xfe:
+      /* ID address mark */
+      if (d->curenc == MFM && d->premark != 0xa1) break;
+      if (d->dmk_awaiting_iam) break;
+      check_missing_dam(d);
+      devt(d, EV_IDAM);
+      dmk_idam(d, 0xfe, d->curenc);
+      /* For normal MFM, premark a1a1a1 is included in the ID CRC.
+       * With QUIRK_ID_CRC, it is omitted. */
+      d->crc = calc_crc1((d->curenc == MFM &&
+			  (d->p.quirk & QUIRK_ID_CRC) == 0) ?
+                      0xcdb4 : 0xffff, val);
+      d->dbyte = -1;
+      d->ebyte = -1;
+      return;
+
+    case 0xf8: /* Standard deleted data address mark */
+    case 0xf9: /* WD1771 user or RX02 deleted data address mark */
+    case 0xfa: /* WD1771 user data address mark */
+    case 0xfb: /* Standard data address mark */
+    case 0xfd: /* RX02 data address mark */
+      if (dmk_awaiting_track_start(d) || !dmk_in_range(d)) break;
+      if (d->curenc == MFM && d->premark != 0xa1) break;
+      if (!d->dmk_awaiting_dam) {
+	devt(d, EV_UNEXPECTED_DAM);
+	d->stat.errcount++;
+	break;
+      }
+      d->dmk_awaiting_dam = 0;
+      devt(d, EV_NEWLINE_HEX);
+      devt(d, EV_DAM, val);
+      dmk_data(d, val, d->curenc);
+      last_sector(d)->dam = val;
+      if ((d->p.uencoding == MIXED || d->p.uencoding == RX02) &&
+	  (val == 0xfd ||
+	   (val == 0xf9 && (d->rx02_seen || d->stat.enc_count[RX02] > 0 ||
+			    d->p.uencoding == RX02)))) {
+	change_enc(d, RX02);
+	last_sector(d)->encoding = RX02;
+        if (d->p.accum_sectors) {
+          d->stat.enc_sec[(d->dmk_idam_p -
+			   (unsigned short *)d->dmk_track) - 1] = RX02;
+        }
+      }
+      /* For MFM, premark a1a1a1 is included in the data CRC.
+       * With QUIRK_DATA_CRC, it is omitted. */
+      d->crc = calc_crc1((d->curenc == MFM &&
+			  (d->p.quirk & QUIRK_DATA_CRC) == 0) ?
+                      0xcdb4 : 0xffff, val);
+      d->ibyte = -1;
+      d->dbyte = secsize(d->sizecode, d->curenc, d->p.maxsize, d->p.quirk) + 2;
+      d->ebyte = -1;
+      return;
+
+    case 0x80: /* MFM DAM or IDAM premark read backward */
+      if (d->curenc != MFM || d->premark != 0xc2) break;
+      d->backward_am++;
+      devt(d, EV_BACKWARD_AM);
+      break;
+
+    default:
+      /* Premark with no mark */
+      devt(d, EV_DANGLING_PREMARK);
+      dmk_data(d, val, d->curenc);
+      // probably wraparound or write splice, so don't inc errcount
+      break;
+    }
+  }
+
+  switch (d->ibyte) {
+  default:
+    break;
+  case 0:
+    devt(d, EV_ID_CYL);
+    d->curcyl = val;
+    break;
+  case 1:
+    devt(d, EV_ID_SIDE);
+    break;
+  case 2:
+    devt(d, EV_ID_SEC);
+    break;
+  case 3:
+    devt(d, EV_ID_SIZE);
+    d->sizecode = val;
+    break;
+  case 4:
+    devt(d, EV_ID_CRC);
+    break;
+  case 6:
+    if (d->crc == 0) {
+      devt(d, EV_GOOD_ID_CRC);
+      d->dmk_valid_id = 1;
+      last_sector(d)->id_ok = 1;
+    } else {
+      devt(d, EV_BAD_ID_CRC);
+      d->stat.errcount++;
+      if (d->p.accum_sectors)
+	d->dmk_idam_p[-1] |= DMK_EXTRA_FLAG;
+      d->ibyte = -1;
+    }
+    devt(d, EV_NEWLINE_HEX);
+    d->dmk_awaiting_dam = 1;
+    dmk_check_wraparound(d);
+    break;
+  case 18:
+    /* Done with post-ID gap */
+    d->ibyte = -1;
+    break;
+  }
+
+  if (d->ibyte == 2) {
+    devt(d, EV_ID_SECTOR, val);
+  } else if (d->ibyte >= 0 && d->ibyte <= 3) {
+    devt(d, EV_ID_BYTE, val);
+  } else {
+    devt(d, EV_BYTE, val);
+  }
+
+  dmk_data(d, val, d->curenc);
+
+  if (d->ibyte >= 0) d->ibyte++;
+  if (d->dbyte > 0) d->dbyte--;
+  if (d->ebyte > 0) d->ebyte--;
+  d->crc = calc_crc1(d->crc, val);
+
+  if (d->dbyte == 0) {
+    if (d->crc == 0) {
+      devt(d, EV_GOOD_DATA_CRC);
+      if (d->dmk_valid_id) {
+	if (d->stat.good_sectors == 0) d->first_encoding = d->curenc;
+	d->stat.good_sectors++;
+	d->stat.enc_count[d->curenc]++;
+	d->cylseen = d->curcyl;
+	last_sector(d)->data_ok = 1;
+      }
+    } else {
+      devt(d, EV_BAD_DATA_CRC);
+      d->stat.errcount++;
+      if (d->p.accum_sectors) {
+	// Don't count both header and data CRC errors for a sector.
+	// Because otherwise dropping a single error for a replacement sector
+	// will not show it fully corrected.  Need to track errors/sector.
+	if (d->dmk_idam_p[-1] & DMK_EXTRA_FLAG)
+	  d->stat.errcount--;
+	d->dmk_idam_p[-1] |= DMK_EXTRA_FLAG;
+      }
+    }
+    devt(d, EV_NEWLINE_HEX);
+    d->dbyte = -1;
+    d->dmk_valid_id = 0;
+    d->write_splice = WRITE_SPLICE;
+    if (d->curenc == RX02) {
+      change_enc(d, FM);
+    }
+    if (d->p.quirk & QUIRK_EXTRA_CRC) {
+      d->ebyte = 6;
+      d->crc = 0xffff;
+    }
+  }
+
+  if (d->ebyte == 0) {
+    if (d->crc == 0) {
+      devt(d, EV_GOOD_EXTRA_CRC);
+    } else {
+      devt(d, EV_BAD_EXTRA_CRC);
+      d->stat.errcount++;
+      if (d->p.accum_sectors) {
+	if (d->dmk_idam_p[-1] & DMK_EXTRA_FLAG)
+	  d->stat.errcount--;
+	d->dmk_idam_p[-1] |= DMK_EXTRA_FLAG;
+      }
+    }
+    devt(d, EV_NEWLINE_HEX);
+    d->ebyte = -1;
+    d->write_splice = WRITE_SPLICE;
+  }
+
+  /* Predetect bad MFM clock pattern.  Can't detect at decode time
+     because we need to look at 17 bits. */
+  if (d->curenc == MFM && d->bits == 48 && !mfm_valid_clock(d->accum >> 32)) {
+    if (mfm_valid_clock(d->accum >> 31)) {
+      devt(d, EV_BITS_DROPPED, 1);
+      d->bits--;
+    } else {
+      devt(d, EV_BAD_CLOCK);
+    }
+  }
+}
+
+
+/*
+ * Decoding is done in two stages.  The first (classify_samples)
+ * turns Catweasel samples into a packed bitstream of alternating
+ * clock/data bits at the MFM rate; the second (decode_bits) finds the
+ * marks and bytes in it, through process_bit.  Since nothing the
+ * second stage does feeds back into the first, a whole run of samples
+ * can be classified at once, and the second stage can go over most of
+ * the bits a word at a time, calling process_bit only where there is
+ * something to do.
+ *
+ * The bitstream is kept most significant bit first in d->bitbuf,
+ * after two words of zeros standing for the empty accum that each read
+ * starts with.  As bits are added, markscan sets the bits of
+ * d->markbuf (laid out the same way) where an address mark might end,
+ * so that the second stage can go straight from one to the next.
+ */
+#define BITBUF_PAD 128
+
+/* Samples classified at a time when they are not being reported one
+   by one */
+#define CLASSIFY_CHUNK 4096
+
+/* Bits skipped at a time; at most 60 (see skip_bits) */
+#define MAX_SKIP 60
+
+/*
+ * The low 16 bits of each pattern process_bit looks for in accum,
+ * for markscan.  The first are the FM and RX02 marks, the others the
+ * MFM ones.  Must cover every case of process_bit's switch statements.
+ */
+#define FM_MARKS(X) \
+  X(0x2a88) X(0x2aa8) X(0x2888) X(0x288a) X(0x28a8) X(0x28aa) X(0x2a8a) \
+  X(0x8888)
+#define MFM_MARKS(X) \
+  X(0x5224) X(0x44a9) X(0x4489) X(0x5555) X(0x9254)
+
+#define MARKSCAN_NAME markscan_1
+#define MARKSCAN_VEC unsigned long long
+#define MARKSCAN_ATTR
+#include "markscan.c"
+#undef MARKSCAN_NAME
+#undef MARKSCAN_VEC
+#undef MARKSCAN_ATTR
+
+#if HAVE_CPU_DISPATCH
+/* SSE2 is always there; AVX2 is used if the CPU has it */
+typedef unsigned long long vec2 __attribute__((vector_size(16)));
+typedef unsigned long long vec4 __attribute__((vector_size(32)));
+#define MARKSCAN_TAIL markscan_1
+
+#define MARKSCAN_NAME markscan_sse2
+#define MARKSCAN_VEC vec2
+#define MARKSCAN_ATTR
+#include "markscan.c"
+#undef MARKSCAN_NAME
+#undef MARKSCAN_VEC
+#undef MARKSCAN_ATTR
+
+#define MARKSCAN_NAME markscan_avx2
+#define MARKSCAN_VEC vec4
+#define MARKSCAN_ATTR __attribute__((target("avx2")))
+#include "markscan.c"
+#undef MARKSCAN_NAME
+#undef MARKSCAN_VEC
+#undef MARKSCAN_ATTR
+#undef MARKSCAN_TAIL
+#endif
+
+
+/* Pick the widest markscan the CPU can run */
+static markscan_fn *
+markscan_select(void)
+{
+#if HAVE_CPU_DISPATCH
+  return __builtin_cpu_supports("avx2") ? markscan_avx2 : markscan_sse2;
+#else
+  return markscan_1;
+#endif
+}
+
+
+/*
+ * Classify a sample, returning the number of bits it stands for.
+ * Ad hoc method using two fixed thresholds modified by a postcomp
+ * factor.
+ *
+ * The input is the distance in Catweasel clocks between the previous
+ * magnetic transition (i.e., bit cell containing 1) and the current
+ * transition.  The output is a 1 for the previous transition,
+ * followed by a 0 for each empty bit cell prior to the current
+ * transition.
+ *
+ * When decoding FM (single density) we still use double density sized
+ * bit cells -- see decoder.txt -- so in the output a single density
+ * bit cell that contains 1 ends up represented as 10, and a single
+ * density bit cell that contains 0 ends up represented as 00.
+ *
+ * We assume (unless QUIRK_MFM_CLOCK is set) that there is never a
+ * transition in two consecutive bit cells.  We also assume there are
+ * never more than three empty bit cells between transitions.  These
+ * assumptions are valid for correctly encoded MFM, and for FM
+ * represented at the double data rate as explained in the previous
+ * paragraph.  (Future: If we want to support MMFM, we will need to
+ * extend this function to allow for as many as four empty bit cells
+ * between transitions.)
+ *
+ * sample_len does the classifying, given the sample with the postcomp
+ * adjustment already added; classify_sample then works out the
+ * adjustment for the next sample.
+ */
+static inline int
+sample_len(const struct decode_params *p, float s)
+{
+  int len;
+
+  if (p->uencoding == FM) {
+    if (s <= p->fmthresh) {
+      /* Short: output 10 */
+      len = 2;
+    } else {
+      /* Long: output 1000 */
+      len = 4;
+    }
+  } else {
+    if ((p->quirk & QUIRK_MFM_CLOCK) &&
+	s <= p->mfmthresh1 * 0.6) {
+      /* Tiny: output 1 */
+      len = 1;
+    } else if (s <= p->mfmthresh1) {
+      /* Short: output 10 */
+      len = 2;
+    } else if (s <= p->mfmthresh2) {
+      /* Medium: output 100 */
+      len = 3;
+    } else {
+      /* Long: output 1000 */
+      len = 4;
+    }
+
+  }
+  return len;
+}
+
+static inline int
+classify_sample(struct decoder *d, int sample)
+{
+  int len = sample_len(&d->p, sample + d->adj);
+
+  d->adj = (sample - (len/2.0 * d->p.mfmshort * d->p.cwclock)) * d->p.postcomp;
+  return len;
+}
+
+
+/* Append len bits, right-aligned in v, to the bitstream */
+static inline void
+put_bits(struct decoder *d, unsigned long long v, int len)
+{
+  int used = d->nbits & 63;
+  int room = 64 - used;
+  unsigned long long *w = &d->bitbuf[(d->nbits + BITBUF_PAD) >> 6];
+
+  if (len < room) {
+    d->cur = (d->cur << len) | v;
+  } else {
+    *w = (d->cur << room) | (v >> (len - room));
+    d->cur = v;  /* only the low len - room bits count */
+  }
+  d->nbits += len;
+}
+
+
+/* Store the bits of a partly filled last word and find the mark
+   candidates among the new bits, so decode_bits sees them */
+static inline void
+store_bits(struct decoder *d)
+{
+  int used = d->nbits & 63;
+  int enc = d->p.uencoding;
+
+  if (used) {
+    d->bitbuf[(d->nbits + BITBUF_PAD) >> 6] = d->cur << (64 - used);
+  }
+  if (d->nbits > d->scanned) {
+    d->markscan(d->bitbuf, d->markbuf, (d->scanned + BITBUF_PAD) >> 6,
+		((d->nbits + BITBUF_PAD - 1) >> 6) + 1,
+		(enc != MFM) ? ~0ULL : 0,
+		(enc != FM && enc != RX02) ? ~0ULL : 0);
+    d->scanned = d->nbits;
+  }
+}
+
+
+/* The 64 bits of the stream starting at pos; the bits past the
+   end of the stream are 0 */
+static inline unsigned long long
+get_bits64(const struct decoder *d, unsigned long pos)
+{
+  unsigned long i = pos + BITBUF_PAD;
+  int s = i & 63;
+  const unsigned long long *w = &d->bitbuf[i >> 6];
+
+  return s ? (w[0] << s) | (w[1] >> (64 - s)) : w[0];
+}
+
+
+/* Make room for the bits of nsamples samples plus flush_bits */
+static int
+alloc_bitbuf(struct decoder *d, int nsamples)
+{
+  long words = ((long) nsamples * 4 + 63 + BITBUF_PAD) / 64 + 2;
+
+  if (words > d->bitbuf_words) {
+    free(d->bitbuf);
+    free(d->markbuf);
+    d->bitbuf = (unsigned long long *)
+      malloc(words * sizeof(unsigned long long));
+    d->markbuf = (unsigned long long *)
+      malloc(words * sizeof(unsigned long long));
+    if (d->bitbuf == NULL || d->markbuf == NULL) {
+      d->bitbuf_words = 0;
+      return -1;
+    }
+    d->bitbuf_words = words;
+  }
+  memset(d->bitbuf, 0, words * sizeof(unsigned long long));
+  memset(d->markbuf, 0, words * sizeof(unsigned long long));
+  d->nbits = 0;
+  d->scanned = 0;
+  d->pos = 0;
+  d->cur = 0;
+  return 0;
+}
+
+
+/*
+ * Stage 1: classify samples starting at si and append their bits to
+ * the bitstream.  Stops after max samples, at the end, or before a
+ * sample where the index hole sensor goes on or off, other than the
+ * first, so that the bits before the edge can be decoded before the
+ * edge is counted.  Returns the index of the next sample.
+ */
+static int
+classify_samples(struct decoder *d, const unsigned char *samples,
+		 int si, int nsamples, int max)
+{
+  int first = si;
+  int end = (nsamples - si > max) ? si + max : nsamples;
+  int b, len;
+
+  for (; si < end; si++) {
+    b = samples[si];
+    /*
+     * Index hole edge check.
+     */
+    if ((d->oldb ^ b) & 0x80) {
+      if (si != first) break;
+      d->index_edge++;
+      if (b & 0x80) {
+	devt(d, EV_INDEX_ON);
+      } else {
+	devt(d, EV_INDEX_OFF);
+      }
+    }
+    d->oldb = b;
+    b &= 0x7f;
+
+    len = classify_sample(d, b);
+    devt(d, EV_SAMPLE, b, "-tsml"[len]);
+    put_bits(d, 1ULL << (len - 1), len);
+  }
+  store_bits(d);
+  return si;
+}
+
+
+/*
+ * Skip m bits (0 < m <= 60) at which process_bit would only shift
+ * them in and count: no mark candidate ends at any of them and they
+ * do not complete a byte.  The RX02 transform is applied to taccum as
+ * process_bit would have, at each even bit count where accum ends in
+ * 1000; the 4-bit windows it changes never overlap, so each can be
+ * applied with an exclusive or.
+ */
+static inline void
+skip_bits(struct decoder *d, int m, const int kenc)
+{
+  unsigned long long in = get_bits64(d, d->pos) >> (64 - m);
+  unsigned long long a, t;
+  int bits = d->bits + m;
+
+  d->accum = (d->accum << m) | in;
+  if (kenc != FM && kenc != MFM) {
+    d->taccum = (d->taccum << m) | in;
+
+    /* Bit j of t is set if the transform applies to the bit read j
+       bits ago */
+    a = d->accum;
+    t = (a >> 3) & ~(a >> 2) & ~(a >> 1) & ~a;
+    t &= (1ULL << m) - 1;
+    t &= (bits & 1) ? 0xaaaaaaaaaaaaaaaaULL : 0x5555555555555555ULL;
+    if (bits < WINDOW) {
+      t = 0;
+    } else if (bits - WINDOW < 63) {
+      t &= (2ULL << (bits - WINDOW)) - 1;
+    }
+    d->taccum ^= t ^ (t << 2) ^ (t << 3);
+  }
+
+  d->bits = bits;
+  if (d->mark_after >= 0) {
+    d->mark_after = (d->mark_after - m < -1) ? -1 : d->mark_after - m;
+  }
+  if (d->write_splice > 0) {
+    d->write_splice = (d->write_splice - m < 0) ? 0 : d->write_splice - m;
+  }
+  d->pos += m;
+}
+
+
+/* Bits from pos to the next mark candidate in d->markbuf, looking
+   no further than 64 bits on */
+static inline int
+next_candidate(const struct decoder *d, unsigned long pos)
+{
+  unsigned long i = pos + BITBUF_PAD;
+  int s = i & 63;
+  unsigned long long w = d->markbuf[i >> 6] << s;
+
+  if (w) return __builtin_clzll(w);
+  w = d->markbuf[(i >> 6) + 1];
+  return w ? 64 - s + __builtin_clzll(w) : 64;
+}
+
+
+/*
+ * Stage 2: decode the bitstream up to its end.  The bits before the
+ * next byte is complete and the next mark candidate are skipped, and
+ * the next one goes through process_bit.
+ */
+static inline void
+decode_bits(struct decoder *d, const int kenc, const int pext)
+{
+  int m, k;
+
+  while (d->pos < d->nbits && !d->dmk_full) {
+#if WINDOW == 4
+    m = 63 - d->bits;
+    if (m > MAX_SKIP) m = MAX_SKIP;
+    if (m > d->nbits - d->pos) m = d->nbits - d->pos;
+    if (m > 0) {
+      k = next_candidate(d, d->pos);
+      if (k > m) k = m;
+      if (k > 0) skip_bits(d, k, kenc);
+      if (d->pos >= d->nbits) break;
+    }
+#endif
+    process_bit(d, get_bits64(d, d->pos) >> 63, kenc, pext);
+    if (d->dmk_full) d->full_pos = d->pos;
+    d->pos++;
+  }
+}
+
+#define DECODE_KERNEL(name, kenc, pext) \
+  static void name(struct decoder *d) { decode_bits(d, kenc, pext); }
+DECODE_KERNEL(decode_any, -1, 0)
+DECODE_KERNEL(decode_fm, FM, 0)
+DECODE_KERNEL(decode_mfm, MFM, 0)
+DECODE_KERNEL(decode_rx02, RX02, 0)
+#if HAVE_CPU_DISPATCH
+DECODE_KERNEL(decode_any_pext, -1, 1)
+DECODE_KERNEL(decode_fm_pext, FM, 1)
+DECODE_KERNEL(decode_mfm_pext, MFM, 1)
+DECODE_KERNEL(decode_rx02_pext, RX02, 1)
+#endif
+#undef DECODE_KERNEL
+
+
+/* True if pext is there and fast.  AMD CPUs before Zen 3 do it in
+   microcode, far slower than the tables; they are not told apart
+   from the later ones here. */
+static int
+fast_pext(void)
+{
+#if HAVE_CPU_DISPATCH
+  return __builtin_cpu_supports("bmi2") && !__builtin_cpu_is("amd");
+#else
+  return 0;
+#endif
+}
+
+
+/*
+ * Pick the kernel for a read, once init_decoder has set curenc.  The
+ * FM and MFM ones only do for a read that starts in the one encoding
+ * uencoding allows, and the RX02 one for one that starts in FM or
+ * RX02 (see process_bit); otherwise the one for any encoding does.
+ */
+static decode_kernel_fn *
+decode_kernel(const struct decoder *d)
+{
+  int enc = d->p.uencoding;
+
+  if (enc == FM || enc == MFM) {
+    if (d->curenc != enc) enc = MIXED;
+  } else if (enc == RX02) {
+    if (d->curenc != FM && d->curenc != RX02) enc = MIXED;
+  }
+#if HAVE_CPU_DISPATCH
+  if (d->pext) {
+    switch (enc) {
+    case FM: return decode_fm_pext;
+    case MFM: return decode_mfm_pext;
+    case RX02: return decode_rx02_pext;
+    default: return decode_any_pext;
+    }
+  }
+#endif
+  switch (enc) {
+  case FM: return decode_fm;
+  case MFM: return decode_mfm;
+  case RX02: return decode_rx02;
+  default: return decode_any;
+  }
+}
+
+
+/* Push out any valid bits left in accum at end of track */
+static void
+flush_bits(struct decoder *d)
+{
+  int i;
+  for (i=0; i<63; i++) {
+    put_bits(d, !(i&1), 1);
+  }
+  store_bits(d);
+  d->kernel(d);
+}
+
+
+/*
+ * Set d->adj as it was after the sample holding the bit that filled
+ * the DMK track, starting from the sample at si, whose first bit is
+ * at pos, with d->adj as it was before it.
+ */
+static void
+rewind_adj(struct decoder *d, const unsigned char *samples,
+	   int si, unsigned long pos)
+{
+  while (pos <= d->full_pos) {
+    pos += classify_sample(d, samples[si++] & 0x7f);
+  }
+}
+
+
+/* Decode the nsamples samples in samples[] into d->dmk_track */
+static int
+decode_samples(struct decoder *d, const unsigned char *samples, int nsamples)
+{
+  /* Samples are classified one at a time if they are being reported,
+     so their events come out between those of their bits */
+  int each = d->trace || (d->msg && d->msg_level >= OUT_HEX);
+  int si = 0, start;
+  unsigned long start_pos;
+  float start_adj, full_adj = 0.0;
+  int past_full = 0, full_level = d->msg_level;
+#if DEBUG3
+  int histogram[128], i;
+  for (i=0; i<128; i++) histogram[i] = 0;
+#endif
+  if (alloc_bitbuf(d, nsamples) < 0) return -1;
+  d->start_encoding = d->first_encoding;
+  d->start_rx02 = d->rx02_seen;
+  d->start_adj = d->adj;
+  d->start_sample = (nsamples > 0) ? samples[0] & 0x7f : -1;
+  dmk_init_track(d);
+  init_decoder(d);
+  d->kernel = decode_kernel(d);
+
+  /* Loop over samples */
+  d->oldb = 0;
+  d->index_edge = 0;
+  while (!d->dmk_full || (d->msg && d->msg_level >= OUT_SAMPLES) ||
+	 d->trace) {
+    d->sample_index = si;
+    if (d->dmk_full && d->trace && !past_full) {
+      /* Only a level 7 log goes on from here; mark where */
+      trace_put(d->trace, si, EV_PAST_FULL, 0, 0);
+      past_full = 1;
+      full_adj = d->adj;
+      /* The log goes quiet here too, unless it is at level 7 */
+      if (!(d->msg && full_level >= OUT_SAMPLES)) d->msg_level = OUT_QUIET;
+    }
+    if (si >= nsamples) {
+      devt(d, EV_END_OF_DATA);
+      break;
+    }
+    start = si;
+    start_pos = d->nbits;
+    start_adj = d->adj;
+    si = classify_samples(d, samples, si, nsamples,
+			  each ? 1 : CLASSIFY_CHUNK);
+    d->kernel(d);
+    if (d->dmk_full && !each) {
+      /* The first stage went past the sample that filled the track;
+	 take back what it did to adj */
+      d->adj = start_adj;
+      rewind_adj(d, samples, start, start_pos);
+    }
+  }
+
+  /*
+   * All samples read; finish up this (re)try.
+   */
+#if DEBUG3
+  /* Print histogram for debugging */
+  for (i=0; i<si; i++) histogram[samples[i] & 0x7f]++;
+  for (i=0; i<128; i+=8) {
+    printf("%3d: %06d %06d %06d %06d %06d %06d %06d %06d\n", i,
+	   histogram[i+0], histogram[i+1], histogram[i+2],
+	   histogram[i+3], histogram[i+4], histogram[i+5],
+	   histogram[i+6], histogram[i+7]);
+  }
+#endif
+  if (past_full) {
+    trace_put(d->trace, d->sample_index, EV_PAST_FULL_END, 0, 0);
+    /* The trace must not change what later reads decode to, or log */
+    if (!(d->msg && full_level >= OUT_SAMPLES)) d->adj = full_adj;
+    d->msg_level = full_level;
+  }
+  flush_bits(d);
+  check_missing_dam(d);
+  if (d->ibyte != -1) {
+    /* Ignore incomplete sector IDs; assume they are wraparound */
+    devt(d, EV_WRAPAROUND_ID);
+    *--d->dmk_idam_p = 0;
+  }
+  if (d->dbyte != -1) {
+    d->stat.errcount++;
+    devt(d, EV_INCOMPLETE_DATA);
+  }
+  if (d->ebyte != -1) {
+    d->stat.errcount++;
+    devt(d, EV_INCOMPLETE_EXTRA);
+  }
+  devt(d, EV_NEWLINE_IDS);
+  d->nsectors = d->dmk_idam_p - (unsigned short *) d->dmk_track;
+  return 0;
+}
+
+
+/* Give the decoder track buffers to match its settings */
+static int
+alloc_tracks(struct decoder *d)
+{
+  int len = d->p.tracklen;
+
+  free(d->dmk_track);
+  d->dmk_track = (unsigned char*) malloc(len);
+  if (d->dmk_track == NULL) return -1;
+  if (d->p.accum_sectors) {
+    free(d->dmk_merged_track);
+    d->dmk_merged_track = (unsigned char*) malloc(len);
+    d->dmk_merged_track_len = 0;
+    free(d->dmk_tmp_track);
+    d->dmk_tmp_track = (unsigned char*) malloc(len);
+    if (d->dmk_merged_track == NULL || d->dmk_tmp_track == NULL) return -1;
+    memset(d->dmk_merged_track, 0, len);
+  }
+  return 0;
+}
+
+
+struct decoder *
+decoder_new(const struct decode_params *p)
+{
+  struct decoder *d = (struct decoder *) calloc(1, sizeof(*d));
+
+  if (d == NULL) return NULL;
+  d->p = *p;
+  d->cylseen = -1;
+  d->first_encoding = (p->uencoding == RX02) ? FM : p->uencoding;
+  d->markscan = markscan_select();
+  d->pext = fast_pext();
+  if (alloc_tracks(d) < 0) {
+    decoder_free(d);
+    return NULL;
+  }
+  return d;
+}
+
+
+int
+decoder_set_params(struct decoder *d, const struct decode_params *p)
+{
+  int grow = p->tracklen != d->p.tracklen ||
+    (p->accum_sectors && d->dmk_merged_track == NULL);
+
+  d->p = *p;
+  return grow ? alloc_tracks(d) : 0;
+}
+
+
+void
+decoder_free(struct decoder *d)
+{
+  if (d == NULL) return;
+  free(d->dmk_track);
+  free(d->dmk_merged_track);
+  free(d->dmk_tmp_track);
+  free(d->bitbuf);
+  free(d->markbuf);
+  free(d);
+}
+
+
+int
+decode_track(struct decoder *d, const unsigned char *samples, int n,
+	     const struct decode_params *params)
+{
+  if (params && decoder_set_params(d, params) < 0) return -1;
+  if (decode_samples(d, samples, n) < 0) return -1;
+  return d->stat.good_sectors;
+}
+
+
+void
+decoder_set_msg(struct decoder *d, decode_msg_fn *fn, void *arg, int level)
+{
+  d->msg = fn;
+  d->msg_arg = arg;
+  d->msg_level = level;
+}
+
+
+void
+decoder_set_trace(struct decoder *d, struct trace *t)
+{
+  d->trace = t;
+}
+
+
+void
+decoder_set_encoding(struct decoder *d, int enc)
+{
+  d->first_encoding = enc;
+}
+
+
+void
+decoder_set_rx02(struct decoder *d, int seen)
+{
+  d->rx02_seen = seen;
+}
+
+
+int
+decoder_copy_state(struct decoder *ahead, const struct decoder *d)
+{
+  if (decoder_set_params(ahead, &d->p) < 0) return -1;
+  ahead->first_encoding = d->first_encoding;
+  ahead->rx02_seen = d->rx02_seen;
+  ahead->adj = d->adj;
+  return 0;
+}
+
+
+int
+decode_same_start(const struct decoder *ahead, const struct decoder *d)
+{
+  /* adj matters only to how the first sample is classified */
+  return memcmp(&ahead->p, &d->p, sizeof(ahead->p)) == 0 &&
+    ahead->start_encoding == d->first_encoding &&
+    ahead->start_rx02 == d->rx02_seen &&
+    (ahead->start_sample < 0 ||
+     sample_len(&ahead->p, ahead->start_sample + ahead->start_adj) ==
+     sample_len(&ahead->p, ahead->start_sample + d->adj));
+}
+
+
+void
+decoder_take(struct decoder *d, const struct decoder *ahead)
+{
+  int i;
+
+  memcpy(d->dmk_track, ahead->dmk_track, d->p.tracklen);
+  d->dmk_idam_p = (unsigned short *)
+    (d->dmk_track + ((unsigned char *) ahead->dmk_idam_p - ahead->dmk_track));
+  d->dmk_data_p = d->dmk_track + (ahead->dmk_data_p - ahead->dmk_track);
+  /* Leave the enc_sec entries the read did not set, as decoding it
+     here would have; decode_merge may look at them */
+  for (i = 0; i < N_ENCS; i++) {
+    d->stat.enc_count[i] = ahead->stat.enc_count[i];
+  }
+  memcpy(d->stat.enc_sec, ahead->stat.enc_sec,
+	 ahead->enc_sec_used * sizeof(*d->stat.enc_sec));
+  d->enc_sec_used = ahead->enc_sec_used;
+  d->stat.errcount = ahead->stat.errcount;
+  d->stat.good_sectors = ahead->stat.good_sectors;
+  d->stat.reused_sectors = ahead->stat.reused_sectors;
+  memcpy(d->sector, ahead->sector, sizeof(d->sector));
+  d->nsectors = ahead->nsectors;
+  d->curenc = ahead->curenc;
+  d->first_encoding = ahead->first_encoding;
+  d->sizecode = ahead->sizecode;
+  d->curcyl = ahead->curcyl;
+  d->cylseen = ahead->cylseen;
+  d->backward_am = ahead->backward_am;
+  d->adj = ahead->adj;
+}
+
+
+const unsigned char *
+decode_dmk_track(const struct decoder *d)
+{
+  return d->dmk_track;
+}
+
+
+int
+decode_dmk_used(const struct decoder *d)
+{
+  return d->dmk_data_p - d->dmk_track;
+}
+
+
+const struct TrackStat *
+decode_stat(const struct decoder *d)
+{
+  return &d->stat;
+}
+
+
+const struct decode_sector *
+decode_sectors(const struct decoder *d, int *n)
+{
+  *n = d->nsectors;
+  return d->sector;
+}
+
+
+int
+decode_encoding(const struct decoder *d)
+{
+  return d->curenc;
+}
+
+
+int
+decode_sizecode(const struct decoder *d)
+{
+  return d->sizecode;
+}
+
+
+int
+decode_cylseen(const struct decoder *d)
+{
+  return d->cylseen;
+}
+
+
+int
+decode_backward_am(const struct decoder *d)
+{
+  return d->backward_am;
+}
+
+
+void
+decode_histogram(const unsigned char *samples, int n,
+		 int histogram[128], int *total_cycles,
+		 int *total_samples, float *first_peak)
+{
+  int b;
+  int i, tc, ts;
+  float peak;
+  int pwidth, psamps, psampsw;
+
+  tc = 0;
+  ts = 0;
+  for (i=0; i<128; i++) {
+    histogram[i] = 0;
+  }
+  for (i = 0; i < n && (b = samples[i]) < 0x80; i++) {
+    histogram[b & 0x7f]++;
+    tc += b + 1;  /* not sure if the +1 is right */
+    ts++;
+  }
+
+  /* Find first peak */
+  i = 0;
+  pwidth = 0;
+  psamps = 0;
+  psampsw = 0;
+  while (histogram[i] < 64 && i < 128) i++;
+  while (histogram[i] >= 64 && i < 128) {
+    pwidth++;
+    psamps += histogram[i];
+    psampsw += histogram[i] * i;
+    i++;
+  }
+  if (pwidth > 24) {
+    /* Track is blank */
+    peak = -1.0;
+  } else {
+    /* again not sure of +1.0 */
+    peak = ((float) psampsw) / psamps + 1.0;
+  }
+
+  *total_cycles = tc;
+  *total_samples = ts;
+  *first_peak = peak;
+}
+
+
+const char *
+decode_enc_name(int enc)
+{
+  return enc_name[enc & (N_ENCS - 1)];
+}
+
+
+int
+decode_secsize(int sizecode, int encoding, int maxsize, unsigned int quirk)
+{
+  return secsize(sizecode, encoding, maxsize, quirk);
+}
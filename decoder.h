@@ -0,0 +1,227 @@
+/*
+ * decoder.h: FM/MFM/RX02 decoder from Catweasel samples to DMK tracks.
+ * Copyright (C) 2000 Timothy Mann
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+
+/*
+ * This is the decoder cw2dmk uses, built as libcw2dmk so that other
+ * programs can decode samples in-process.  A program makes a decoder
+ * with decoder_new, then for each read calls decode_track with the
+ * samples, just as cw2dmk would have drained them from the Catweasel
+ * (bit 7 the index hole, the low 7 bits the sample).  The result is
+ * left in the decoder, to be had with decode_dmk_track, decode_stat,
+ * and decode_sectors.  Decoders share nothing, so any number can be
+ * used at once, one per thread.  Everything the library exports is
+ * named decode_*, decoder_*, or cw2dmk_*.
+ */
+
+#ifndef _DECODER_H
+#define _DECODER_H
+
+#include <stdarg.h>
+#include "dmk.h"
+#include "trace.h"
+
+/* Encodings */
+#define MIXED 0
+#define FM 1
+#define MFM 2
+#define RX02 3
+#define N_ENCS 4
+
+/* Message levels.  Note: values are used in the cw2dmk usage message
+   and on its command line */
+#define OUT_QUIET 0
+#define OUT_SUMMARY 1
+#define OUT_TSUMMARY 2
+#define OUT_ERRORS 3
+#define OUT_IDS 4
+#define OUT_HEX 5
+#define OUT_RAW 6
+#define OUT_SAMPLES 7
+
+/* Decoder settings; the cw2dmk option for each is in brackets */
+struct decode_params {
+  int uencoding;         /* MIXED to autodetect, FM, MFM, or RX02 [-e] */
+  unsigned int quirk;    /* QUIRK_* bits [-q] */
+  int maxsize;           /* largest sector size code [-z] */
+  int cwclock;           /* Catweasel clock multiplier [-c] */
+  int fmthresh;          /* FM short vs. long [-f] */
+  int mfmthresh1;        /* MFM short vs. medium [-1] */
+  int mfmthresh2;        /* MFM medium vs. long [-2] */
+  float mfmshort;        /* MFM short sample in 7.08 MHz clocks */
+  float postcomp;        /* read postcompensation [-o] */
+  int hole;              /* track starts at the index hole [-h] */
+  int fmtimes;           /* times to record each FM byte [-w] */
+  int dmk_iam_pos;       /* IAM position, or -1 [-i] */
+  int dmk_ignore;        /* bytes to ignore at track start [-g] */
+  int accum_sectors;     /* keep tracks for decode_merge [-j] */
+  int tracklen;          /* DMK track length, IDAM table included [-l] */
+};
+
+/* Per-read counters */
+struct TrackStat {
+	int errcount;
+	int good_sectors;
+	int reused_sectors;
+	int enc_count[N_ENCS];
+	int enc_sec[DMK_TKHDR_SIZE / 2];
+};
+
+/* Status of a sector, in the order of the DMK IDAM table */
+struct decode_sector {
+  unsigned char encoding;  /* FM, MFM, or RX02 */
+  unsigned char dam;       /* data address mark, or 0 if none seen */
+  unsigned char id_ok;     /* ID CRC was good */
+  unsigned char data_ok;   /* data CRC was good */
+};
+
+/* Message hook; level is one of OUT_* */
+typedef void decode_msg_fn(void *arg, int level, const char *fmt, va_list ap);
+
+/* Decoder state, private to decoder.c */
+struct decoder;
+
+/* Make a decoder with the given settings; NULL if out of memory */
+struct decoder *decoder_new(const struct decode_params *p);
+
+/* Change a decoder's settings; -1 if out of memory */
+int decoder_set_params(struct decoder *d, const struct decode_params *p);
+
+void decoder_free(struct decoder *d);
+
+/* Send messages up to the given level to fn; fn NULL for none */
+void decoder_set_msg(struct decoder *d, decode_msg_fn *fn, void *arg,
+		     int level);
+
+/*
+ * Also send every event to the trace t, whatever the message level,
+ * or to none if t is NULL.  Only this decoder may use t while it is
+ * set.
+ */
+void decoder_set_trace(struct decoder *d, struct trace *t);
+
+/*
+ * Set the encoding to try first on the next read.  Each read that
+ * finds a good sector leaves the encoding of the first one here.
+ */
+void decoder_set_encoding(struct decoder *d, int enc);
+
+/*
+ * Say whether the tracks before this one had RX02 sectors; if so, a
+ * 0xf9 data address mark is taken as RX02 when autodetecting.
+ */
+void decoder_set_rx02(struct decoder *d, int seen);
+
+/*
+ * Decode n samples into the decoder's DMK track, first changing to
+ * the settings in params if it is not NULL.  Returns the number of
+ * good sectors, or -1 if out of memory.
+ */
+int decode_track(struct decoder *d, const unsigned char *samples, int n,
+		 const struct decode_params *params);
+
+/*
+ * The results of the last read, valid until the next call that
+ * changes the decoder: the DMK track, tracklen bytes with the IDAM
+ * table first; how many of those bytes hold what was read; the
+ * counters; and the status of each sector, setting *n to the number
+ * of sectors.
+ */
+const unsigned char *decode_dmk_track(const struct decoder *d);
+int decode_dmk_used(const struct decoder *d);
+const struct TrackStat *decode_stat(const struct decoder *d);
+const struct decode_sector *decode_sectors(const struct decoder *d, int *n);
+
+/* The encoding at the end of the last read */
+int decode_encoding(const struct decoder *d);
+
+/* The size code in the last sector ID of the last read */
+int decode_sizecode(const struct decoder *d);
+
+/* The cylinder in the last good sector of the last read, or -1 */
+int decode_cylseen(const struct decoder *d);
+
+/* How many MFM address marks of the last read looked bit-reversed */
+int decode_backward_am(const struct decoder *d);
+
+/*
+ * Decoding reads ahead in other decoders, perhaps on other threads.
+ * decoder_copy_state sets ahead up to decode a read as d would now:
+ * the same settings, and the same state carried over from the reads
+ * before (-1 if out of memory).  Once ahead has decoded the read,
+ * decode_same_start says whether d, as it is by then, would still
+ * decode it exactly the same way; if so, decoder_take leaves d as if
+ * it had decoded the read itself.  The merged track for -j is not
+ * carried either way.
+ */
+int decoder_copy_state(struct decoder *ahead, const struct decoder *d);
+int decode_same_start(const struct decoder *ahead, const struct decoder *d);
+void decoder_take(struct decoder *d, const struct decoder *ahead);
+
+/*
+ * With accum_sectors, replace bad sectors in the track just decoded
+ * with good ones from earlier reads of the same track, keeping the
+ * best result so far as the merged track.  Call decode_merge_start
+ * before the first read of a track.
+ */
+void decode_merge(struct decoder *d);
+void decode_merge_start(struct decoder *d);
+
+/* The counters for the merged track */
+const struct TrackStat *decode_merged_stat(const struct decoder *d);
+
+/*
+ * Make the merged track the result of the last read, as to be
+ * written out.  Its good sectors then include the reused ones.
+ */
+void decode_use_merged(struct decoder *d);
+
+/*
+ * Copy the merged track into buf, tracklen bytes, and its counters
+ * into *stat, to carry on merging later with decode_merge_restore.
+ * Returns the length to pass back.
+ */
+int decode_merge_save(const struct decoder *d, unsigned char *buf,
+		      struct TrackStat *stat);
+void decode_merge_restore(struct decoder *d, const unsigned char *buf,
+			  int len, const struct TrackStat *stat);
+
+/*
+ * Do a histogram of the samples up to the first index hole, also
+ * counting the total number of catweasel clocks they span, and find
+ * the first peak (-1.0 if the track looks blank).
+ */
+void decode_histogram(const unsigned char *samples, int n,
+		      int histogram[128], int *total_cycles,
+		      int *total_samples, float *first_peak);
+
+/*
+ * Give the text for an event (enum trace_type) with arguments a and
+ * b, exactly as the decoder logs it, by calling fn one or more times,
+ * each time with the message level of that piece of text.
+ */
+void decode_event_print(int type, int a, int b, decode_msg_fn *fn, void *arg);
+
+/* Name of an encoding */
+const char *decode_enc_name(int enc);
+
+/* Sector size in bytes for a size code */
+int decode_secsize(int sizecode, int encoding, int maxsize,
+		   unsigned int quirk);
+
+#endif /* _DECODER_H */
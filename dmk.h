@@ -1,3 +1,6 @@
+#ifndef _DMK_H
+#define _DMK_H
+
 #include <stdint.h>
 
 /* Some constants for DMK format */
@@ -68,3 +71,5 @@ typedef struct {
   uint8_t	padding[6];
   uint32_t	mbz;
 } dmk_header_t;
+
+#endif /* _DMK_H */
@@ -42,6 +42,7 @@
 #include "dmk.h"
 #include "kind.h"
 #include "cwpci.h"
+#include "cwsim.h"
 #include "version.h"
 
 struct catweasel_contr c;
@@ -162,17 +163,39 @@ dmk_read_header(FILE* dmk_file, dmk_header_t* dmk_header)
 double
 cw_measure_rpm(catweasel_drive *d)
 {
-  struct timeval t1, t2;
-  long long usec;
+  long long t1, usec;
 
   catweasel_await_index(d);
-  gettimeofday(&t1, NULL);
+  t1 = catweasel_clock_us();
   catweasel_await_index(d);
-  gettimeofday(&t2, NULL);
-  usec = (t2.tv_sec - t1.tv_sec)*1000000 + t2.tv_usec - t1.tv_usec;
+  usec = catweasel_clock_us() - t1;
   return 60000000.0/(double)usec;
 }
 
+/* Host-side copy of the track, uploaded in one pass by
+   catweasel_write_block */
+unsigned char cwbuf[CW_MEMSIZE];
+int cwlen, cwsectend;
+
+/* Append one interval to cwbuf.  Return 0 if OK, -1 if full. */
+int
+cw_put(unsigned char val)
+{
+  if (cwlen >= CW_MEMSIZE) {
+    return -1;
+  }
+  cwbuf[cwlen++] = val;
+  return 0;
+}
+
+/* Note the end of sector data.  Return -1 if cwbuf is already full. */
+int
+cw_sector_end(void)
+{
+  cwsectend = cwlen;
+  return (cwlen >= CW_MEMSIZE) ? -1 : 0;
+}
+
 #define CW_BIT_INIT -1
 #define CW_BIT_FLUSH -2
 
@@ -230,7 +253,7 @@ cw_bit(int bit, double mult)
       if (out_fmt >= OUT_SAMPLES) {
 	printf("/%d:%d", len, iticks);
       }
-      res = catweasel_put_byte(&c, 129 - iticks);
+      res = cw_put(129 - iticks);
       if (res < 0) return res;
     }
     len = nextlen;
@@ -417,6 +440,7 @@ main(int argc, char** argv)
   int rx02_data;
   int sector_data;
   int cw_mk = 1;
+  char *simfile;
   int tracklen;
   int extra_bytes;
   char optname[3] = "-?";
@@ -547,13 +571,14 @@ main(int argc, char** argv)
   }
 
   /* Start Catweasel */
+  simfile = getenv("CWSIM");
 #if linux
-  if (geteuid() != 0) {
+  if (geteuid() != 0 && !simfile) {
     fprintf(stderr, "cw2dmk: Must be setuid to root or be run as root\n");
     exit(1);
   }
 #endif
-  if (port < 10) {
+  if (port < 10 && !simfile) {
     port = pci_find_catweasel(port, &cw_mk);
     if (port == -1) {
       port = MK1_DEFAULT_PORT;
@@ -563,8 +588,8 @@ main(int argc, char** argv)
     }
   }
 #if linux
-  if ((cw_mk == 1 && ioperm(port, 8, 1) == -1) ||
-      (cw_mk >= 3 && iopl(3) == -1)) {
+  if (!simfile && ((cw_mk == 1 && ioperm(port, 8, 1) == -1) ||
+                   (cw_mk >= 3 && iopl(3) == -1))) {
     fprintf(stderr, "dmk2cw: No access to I/O ports\n");
     exit(1);
   }
@@ -573,6 +598,10 @@ main(int argc, char** argv)
     exit(1);
   }
 #endif
+  if (simfile) {
+    port = cwsim_init(simfile, &cw_mk);
+    if (port == -1) exit(1);
+  }
   ret = catweasel_init_controller(&c, port, cw_mk, getenv("CW4FIRMWARE"),
                                   step_ms, settle_ms)
     && catweasel_memtest(&c);
@@ -696,6 +725,7 @@ main(int argc, char** argv)
     kd = &kinds[kind-1];
   }
   mult = (kd->mfmshort / 2.0) * cwclock / rate_adj;
+  c.rev_us = kd->readtime * 1000;
   if (hd == 4) {
     hd = kd->hd;
   }
@@ -938,18 +968,19 @@ main(int argc, char** argv)
       }
 
       /* Encode into clock/data stream */
-      catweasel_reset_pointer(&c);
+      cwlen = 0;
+      cwsectend = 0;
 
       if (testmode >= 0x100 && testmode <= 0x1ff) {
 	/* Fill with constant value instead of actual data; for testing */
 	for (i=0; i<128*1024; i++) {
-	  catweasel_put_byte(&c, testmode);
+	  cw_put(testmode);
 	}
 
       } else {
 	for (i=0; i<7; i++) {
 	  /* XXX Is this needed/correct? */
-	  catweasel_put_byte(&c, 0);
+	  cw_put(0);
 	}
 
 	cw_bit(CW_BIT_INIT, mult);
@@ -1027,7 +1058,7 @@ main(int argc, char** argv)
 	  }
 
           if (isend(encoding)) {
-            if (catweasel_sector_end(&c) < 0) {
+            if (cw_sector_end() < 0) {
               fprintf(stderr, "dmk2cw: Catweasel memory full\n");
               exit(1);
             }
@@ -1062,7 +1093,7 @@ main(int argc, char** argv)
 	     noise? */
 	  cw_bit(CW_BIT_FLUSH, mult);
 	  for (;;) {
-	    if (catweasel_put_byte(&c, 0x81) < 0) break;
+	    if (cw_put(0x81) < 0) break;
 	  }
 	  break;
 
@@ -1070,14 +1101,14 @@ main(int argc, char** argv)
 	  /* Fill with a pattern of very long transitions. */
 	  cw_bit(CW_BIT_FLUSH, mult);
 	  for (;;) {
-	    if (catweasel_put_byte(&c, 0) < 0) break;
+	    if (cw_put(0) < 0) break;
 	  }
 	  break;
 
 	case 3:
 	  /* Stop writing, leaving whatever was there before. */
 	  cw_bit(CW_BIT_FLUSH, mult);
-	  catweasel_put_byte(&c, 0xff);
+	  cw_put(0xff);
 	  break;
 
 	default:
@@ -1104,6 +1135,10 @@ main(int argc, char** argv)
 	fflush(stdout);
       }
 
+      if (catweasel_write_block(&c, cwbuf, cwlen, cwsectend) < 0) {
+        fprintf(stderr, "dmk2cw: Catweasel memory full\n");
+        exit(1);
+      }
       catweasel_set_hd(&c, (hd & 1) ^ ((hd > 1) && (track > 43)));
 
       ret = catweasel_write(&c.drives[drive], side ^ reverse, cwclock, -1);
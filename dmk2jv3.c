@@ -26,7 +26,7 @@
 
 #include "dmk.h"
 #include "jv3.h"
-#include "crc.c"
+#include "crc.h"
 
 /* Command-line parameters */
 #define OUT_MIN 0
@@ -0,0 +1,744 @@
+/*
+ * flux.c: Reading flux images from other hardware as Catweasel
+ * samples, and writing Catweasel samples as SCP images.  See flux.h.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <errno.h>
+#include "cwfloppy.h"
+#include "flux.h"
+#include "mapfile.h"
+
+#define MAX_TRACK 168     /* as many as an SCP image can hold */
+#define INDEX_US 2000     /* width of index pulse */
+
+#define FLUX_SCP 0
+#define FLUX_KF 1
+#define FLUX_HFE 2
+
+#define SCP_HZ 40000000.0
+#define SCP_HDR_SIZE (0x10 + 4 * MAX_TRACK)
+#define KF_HZ (18432000.0 * 73.0 / 14.0 / 4.0)
+
+struct flux_file {
+  int format;
+  int tracks;
+  double hz;                  /* flux interval clock */
+
+  /* The image file (not used for KryoFlux) */
+  const unsigned char *data;
+  size_t size;
+  int mapped;
+
+  /* SCP */
+  unsigned long scp_offset[MAX_TRACK][2];  /* track header, or 0 */
+  int scp_revs;
+  int scp_width;              /* bytes per flux interval */
+
+  /* KryoFlux */
+  char *kf_prefix;
+
+  /* HFE */
+  unsigned long hfe_tracklist;
+
+  /*
+   * The track last loaded: flux intervals, and the time of each index
+   * hole, counted from the start of the first interval.  ipos[k] is
+   * the first interval that ends after index hole k, and itime[k] the
+   * time it starts.
+   */
+  int track, side;
+  unsigned long *flux;
+  int nflux, maxflux;
+  unsigned long long *index, *itime;
+  int *ipos;
+  int nindex, maxindex;
+};
+
+static int
+add_flux(flux_file *ff, unsigned long v)
+{
+  if (ff->nflux == ff->maxflux) {
+    int max = ff->maxflux ? ff->maxflux * 2 : 65536;
+    unsigned long *f =
+      (unsigned long *) realloc(ff->flux, max * sizeof(unsigned long));
+    if (f == NULL) return -1;
+    ff->flux = f;
+    ff->maxflux = max;
+  }
+  ff->flux[ff->nflux++] = v;
+  return 0;
+}
+
+static int
+add_index(flux_file *ff, unsigned long long t)
+{
+  if (ff->nindex == ff->maxindex) {
+    int max = ff->maxindex ? ff->maxindex * 2 : 16;
+    unsigned long long *i, *it;
+    int *ip;
+    i = (unsigned long long *) realloc(ff->index, max * sizeof(*i));
+    if (i == NULL) return -1;
+    ff->index = i;
+    it = (unsigned long long *) realloc(ff->itime, max * sizeof(*it));
+    if (it == NULL) return -1;
+    ff->itime = it;
+    ip = (int *) realloc(ff->ipos, max * sizeof(*ip));
+    if (ip == NULL) return -1;
+    ff->ipos = ip;
+    ff->maxindex = max;
+  }
+  ff->index[ff->nindex++] = t;
+  return 0;
+}
+
+static int
+load_scp(flux_file *ff, int track, int side)
+{
+  unsigned long off = ff->scp_offset[track][side], len, doff, dur, k;
+  unsigned long v, carry = 0;
+  unsigned long long t = 0;
+  const unsigned char *p, *q;
+  int r, revs = ff->scp_revs;
+
+  if (off == 0 ||
+      off + 4 + 12 * revs > ff->size ||
+      memcmp(ff->data + off, "TRK", 3) != 0) {
+    return -1;
+  }
+  p = ff->data + off;
+  /* The header gives the fewest revolutions any track has; this one
+     may have more, and its table then runs on to its first data */
+  doff = get32(p + 12);
+  if (revs > 0 && doff > 4 + 12 * revs && (doff - 4) % 12 == 0 &&
+      off + doff <= ff->size) {
+    revs = (doff - 4) / 12;
+  }
+  if (add_index(ff, 0) < 0) return -1;
+  for (r = 0; r < revs; r++) {
+    dur = get32(p + 4 + r * 12);
+    len = get32(p + 8 + r * 12);
+    doff = get32(p + 12 + r * 12);
+    if (off + doff + len * ff->scp_width > ff->size) break;
+    q = p + doff;
+    /* Intervals are big-endian; 0 carries into the next one */
+    for (k = 0; k < len; k++, q += ff->scp_width) {
+      if (ff->scp_width == 2) {
+	v = (q[0] << 8) | q[1];
+	if (v == 0) {
+	  carry += 0x10000;
+	  continue;
+	}
+      } else {
+	v = q[0];
+	if (v == 0) {
+	  carry += 0x100;
+	  continue;
+	}
+      }
+      if (add_flux(ff, v + carry) < 0) return -1;
+      carry = 0;
+    }
+    t += dur;
+    if (add_index(ff, t) < 0) return -1;
+  }
+  return 0;
+}
+
+static int
+load_kf(flux_file *ff, int track, int side)
+{
+  char *name;
+  const unsigned char *d;
+  size_t n, i, len;
+  int mapped, ret = -1;
+  unsigned long pos = 0, v, carry = 0;
+  unsigned long *fpos = NULL, (*idx)[2] = NULL;
+  int nfpos = 0, maxfpos = 0, nidx = 0, maxidx = 0, k, f;
+  unsigned long long t;
+
+  name = (char *) malloc(strlen(ff->kf_prefix) + 16);
+  if (name == NULL) return -1;
+  sprintf(name, "%s%02d.%d.raw", ff->kf_prefix, track, side);
+  if (map_file(name, &d, &n, &mapped) < 0) {
+    free(name);
+    return -1;
+  }
+  free(name);
+
+  for (i = 0; i < n; i += len) {
+    unsigned char b = d[i];
+    if (b == 0x0d) {
+      /* Out-of-band block; not counted in the stream position */
+      if (i + 4 > n || d[i+1] == 0x0d) break;
+      len = 4 + get16(d + i + 2);
+      if (d[i+1] == 0x02 && len >= 12 && i + 12 <= n) {
+	/* Index: stream position of the interval it falls in, and
+	   sample clocks from the start of that interval */
+	if (nidx == maxidx) {
+	  void *nidx_p;
+	  maxidx = maxidx ? maxidx * 2 : 16;
+	  nidx_p = realloc(idx, maxidx * sizeof(*idx));
+	  if (nidx_p == NULL) goto out;
+	  idx = nidx_p;
+	}
+	idx[nidx][0] = get32(d + i + 4);
+	idx[nidx++][1] = get32(d + i + 8);
+      }
+      continue;
+    }
+    if (b <= 0x07) {
+      len = 2;
+      v = (b << 8) | (i + 1 < n ? d[i+1] : 0);
+    } else if (b == 0x08 || b == 0x09 || b == 0x0a) {
+      len = b - 0x07;  /* Nop1, Nop2, Nop3 */
+      pos += len;
+      continue;
+    } else if (b == 0x0b) {
+      len = 1;  /* Ovl16 */
+      carry += 0x10000;
+      pos += len;
+      continue;
+    } else if (b == 0x0c) {
+      len = 3;
+      v = i + 2 < n ? (d[i+1] << 8) | d[i+2] : 0;
+    } else {
+      len = 1;
+      v = b;
+    }
+    if (nfpos == maxfpos) {
+      unsigned long *nfpos_p;
+      maxfpos = maxfpos ? maxfpos * 2 : 65536;
+      nfpos_p = (unsigned long *) realloc(fpos, maxfpos * sizeof(long));
+      if (nfpos_p == NULL) goto out;
+      fpos = nfpos_p;
+    }
+    fpos[nfpos++] = pos;
+    if (add_flux(ff, v + carry) < 0) goto out;
+    carry = 0;
+    pos += len;
+  }
+
+  /* Place each index hole in time */
+  t = 0;
+  for (k = f = 0; k < nidx; k++) {
+    while (f < nfpos && fpos[f] < idx[k][0]) {
+      t += ff->flux[f++];
+    }
+    if (f == nfpos) break;
+    if (add_index(ff, t + (idx[k][1] < ff->flux[f] ?
+			   idx[k][1] : ff->flux[f])) < 0) {
+      goto out;
+    }
+  }
+  ret = 0;
+
+ out:
+  free(fpos);
+  free(idx);
+  unmap_file(d, n, mapped);
+  return ret;
+}
+
+static int
+load_hfe(flux_file *ff, int track, int side)
+{
+  const unsigned char *p = ff->data + ff->hfe_tracklist + track * 4, *q;
+  unsigned long off, len, i, count = 0;
+  int bit;
+
+  if (ff->hfe_tracklist + track * 4 + 4 > ff->size) return -1;
+  off = get16(p) * 512UL;
+  len = get16(p + 2) / 2;  /* per side */
+  if (off == 0 || len == 0 || off + 512 * ((len + 255) / 256) > ff->size) {
+    return -1;
+  }
+  /* Sides alternate in 256 byte halves of each 512 byte block, and
+     each byte holds 8 cells, first cell in the low bit */
+  for (i = 0; i < len; i++) {
+    q = ff->data + off + (i / 256) * 512 + side * 256 + i % 256;
+    for (bit = 0; bit < 8; bit++) {
+      count++;
+      if (*q & (1 << bit)) {
+	if (add_flux(ff, count) < 0) return -1;
+	count = 0;
+      }
+    }
+  }
+  if (add_index(ff, 0) < 0 || add_index(ff, len * 8ULL) < 0) return -1;
+  return 0;
+}
+
+/* Load a track and side unless it is already loaded */
+static int
+load(flux_file *ff, int track, int side)
+{
+  unsigned long long t;
+  int k, i, ret;
+
+  if (track == ff->track && side == ff->side) return 0;
+  ff->track = ff->side = -1;
+  ff->nflux = 0;
+  ff->nindex = 0;
+  if (track < 0 || track >= ff->tracks || side < 0 || side > 1) return -1;
+
+  switch (ff->format) {
+  case FLUX_SCP:
+    ret = load_scp(ff, track, side);
+    break;
+  case FLUX_KF:
+    ret = load_kf(ff, track, side);
+    break;
+  default:
+    ret = load_hfe(ff, track, side);
+    break;
+  }
+  if (ret < 0) return -1;
+
+  /* Find where each revolution starts */
+  t = 0;
+  for (k = i = 0; k < ff->nindex; k++) {
+    while (i < ff->nflux && t + ff->flux[i] <= ff->index[k]) {
+      t += ff->flux[i++];
+    }
+    ff->ipos[k] = i;
+    ff->itime[k] = t;
+  }
+  ff->track = track;
+  ff->side = side;
+  return 0;
+}
+
+/* Load the first track and side present */
+static int
+load_first(flux_file *ff)
+{
+  int track, side;
+
+  for (track = 0; track < ff->tracks; track++) {
+    for (side = 0; side < 2; side++) {
+      if (load(ff, track, side) == 0 && ff->nindex >= 2) return 0;
+    }
+  }
+  return -1;
+}
+
+flux_file *
+flux_open(const char *name, flux_info *info)
+{
+  flux_file *ff;
+  size_t len = strlen(name);
+  int i, cyl, side, heads, odd = 0;
+
+  ff = (flux_file *) calloc(1, sizeof(flux_file));
+  if (ff == NULL) return NULL;
+  ff->track = ff->side = -1;
+  if (map_file(name, &ff->data, &ff->size, &ff->mapped) < 0) {
+    free(ff);
+    return NULL;
+  }
+
+  if (ff->size >= 0x10 + 4 * MAX_TRACK && memcmp(ff->data, "SCP", 3) == 0) {
+    const unsigned char *table;
+    ff->format = FLUX_SCP;
+    info->format = "SCP";
+    ff->scp_revs = ff->data[5];
+    ff->scp_width = ff->data[9] == 0 ? 2 : ff->data[9] / 8;
+    ff->hz = SCP_HZ / (ff->data[11] + 1);
+    heads = ff->data[10];
+    table = ff->data + ((ff->data[8] & 0x40) ? 0x80 : 0x10);
+    if (ff->scp_width < 1 || ff->scp_width > 2 ||
+	table + 4 * MAX_TRACK > ff->data + ff->size) {
+      goto bad;
+    }
+    /*
+     * Tracks are numbered cylinder * 2 + side, but a single-sided
+     * image may instead number them by cylinder alone; it then has
+     * odd entries.
+     */
+    for (i = 1; i < MAX_TRACK; i += 2) {
+      if (get32(table + 4 * i)) odd = 1;
+    }
+    for (i = 0; i < MAX_TRACK; i++) {
+      if (heads != 0 && odd) {
+	cyl = i;
+	side = heads - 1;
+      } else {
+	cyl = i / 2;
+	side = i % 2;
+      }
+      ff->scp_offset[cyl][side] = get32(table + 4 * i);
+      if (ff->scp_offset[cyl][side] && cyl >= ff->tracks) {
+	ff->tracks = cyl + 1;
+      }
+    }
+
+  } else if (ff->size >= 512 && memcmp(ff->data, "HXCPICFE", 8) == 0) {
+    ff->format = FLUX_HFE;
+    info->format = "HFE";
+    ff->tracks = ff->data[9];
+    ff->hz = get16(ff->data + 12) * 2000.0;  /* cells at twice the rate */
+    ff->hfe_tracklist = get16(ff->data + 18) * 512UL;
+    if (ff->hz == 0) goto bad;
+
+  } else if (len >= 8 && strcmp(name + len - 4, ".raw") == 0 &&
+	     isdigit(name[len-8]) && isdigit(name[len-7]) &&
+	     name[len-6] == '.' && isdigit(name[len-5])) {
+    /* One of a set of KryoFlux stream files; find the rest */
+    ff->format = FLUX_KF;
+    info->format = "KryoFlux";
+    ff->hz = KF_HZ;
+    if (ff->size < 1 || ff->data[0] != 0x0d) goto bad;
+    unmap_file(ff->data, ff->size, ff->mapped);
+    ff->data = NULL;
+    ff->kf_prefix = (char *) malloc(len + 1);
+    if (ff->kf_prefix == NULL) {
+      flux_close(ff);
+      errno = ENOMEM;
+      return NULL;
+    }
+    sprintf(ff->kf_prefix, "%.*s", (int) len - 8, name);
+    for (cyl = 0; cyl < MAX_TRACK; cyl++) {
+      for (side = 0; side < 2; side++) {
+	char *tname = (char *) malloc(len + 8);
+	FILE *f;
+	if (tname == NULL) continue;
+	sprintf(tname, "%s%02d.%d.raw", ff->kf_prefix, cyl, side);
+	f = fopen(tname, "rb");
+	if (f) {
+	  fclose(f);
+	  ff->tracks = cyl + 1;
+	}
+	free(tname);
+      }
+    }
+
+  } else {
+    goto bad;
+  }
+
+  info->tracks = ff->tracks;
+  info->revs = load_first(ff) == 0 ? ff->nindex - 1 : 0;
+  return ff;
+
+ bad:
+  flux_close(ff);
+  errno = EINVAL;
+  return NULL;
+}
+
+int
+flux_samples(flux_file *ff, int track, int side, int rev, int cwclock,
+	     unsigned char *buf, int size)
+{
+  unsigned long long start, rev_len, stop, width, t, rel = 0, shift = 0;
+  unsigned long long mult, cw, prev = 0;
+  int i, n = 0, v, wrapped = 0;
+
+  if (load(ff, track, side) < 0 || rev < 0 || rev + 1 >= ff->nindex) {
+    return -1;
+  }
+  start = ff->index[rev];
+  rev_len = ff->index[rev + 1] - start;
+  if (rev_len == 0) return -1;
+  stop = rev_len + rev_len / 5;
+  width = ff->hz * INDEX_US / 1000000.0;
+  /* Catweasel clocks per flux clock, in 32.32 fixed point */
+  mult = CWHZ * cwclock / ff->hz * 4294967296.0 + 0.5;
+
+  i = ff->ipos[rev];
+  t = ff->itime[rev];
+  while (n < size) {
+    if (i >= ff->nflux) {
+      /* Out of data; go around the track again from the same place */
+      if (wrapped) break;
+      wrapped = 1;
+      i = ff->ipos[rev];
+      t = ff->itime[rev];
+      while (i < ff->nflux && t + ff->flux[i] + rev_len <= start + rel) {
+	t += ff->flux[i++];
+      }
+      shift = rev_len;
+      continue;
+    }
+    t += ff->flux[i++];
+    rel = t + shift - start;
+    cw = (rel * mult + 0x80000000ULL) >> 32;
+    v = cw - prev - 1;
+    prev = cw;
+    if (v < 0) v = 0;
+    if (v > 0x7f) v = 0x7f;
+    if (rel < width || (rel >= rev_len && rel < rev_len + width)) v |= 0x80;
+    buf[n++] = v;
+    if (rel >= stop) break;
+  }
+  return n;
+}
+
+int
+flux_kind(flux_file *ff)
+{
+  int hist[200], i, mode = 0;
+  double rpm, us;
+
+  if (load_first(ff) < 0) return -1;
+  rpm = 60.0 * ff->hz / (ff->index[1] - ff->index[0]);
+  memset(hist, 0, sizeof(hist));
+  for (i = ff->ipos[0]; i < ff->ipos[1]; i++) {
+    us = ff->flux[i] * 1000000.0 / ff->hz;
+    if (us < 20.0) hist[(int) (us * 10.0)]++;
+  }
+  for (i = 0; i < 200; i++) {
+    if (hist[i] > hist[mode]) mode = i;
+  }
+  /* HD and 8" data has 2us intervals; SD/DD has 3.3us and up */
+  if (rpm > 330.0) {
+    return mode < 28 ? 3 : 1;
+  } else {
+    return mode < 28 ? 4 : 2;
+  }
+}
+
+void
+flux_close(flux_file *ff)
+{
+  if (ff->data) unmap_file(ff->data, ff->size, ff->mapped);
+  free(ff->kf_prefix);
+  free(ff->flux);
+  free(ff->index);
+  free(ff->itime);
+  free(ff->ipos);
+  free(ff);
+}
+
+
+struct scp_file {
+  FILE *f;
+  int err;                    /* errno of first write error, or 0 */
+  unsigned long pos;          /* where the next track goes */
+  unsigned long sum;          /* of all bytes after the first 16 */
+  unsigned long long mult;    /* SCP ticks per Catweasel clock, 32.32 */
+  int rpm;
+  unsigned long offset[MAX_TRACK];
+  int revs[MAX_TRACK];
+
+  /* The track being collected: for each revolution its length in SCP
+     ticks and number of intervals, then the intervals, big-endian */
+  int cur;
+  unsigned long rev_ticks[256], rev_len[256];
+  int nrevs;
+  unsigned char *data;
+  unsigned long ndata, maxdata;
+};
+
+static void
+scp_put(scp_file *sf, const unsigned char *p, unsigned long n)
+{
+  unsigned long i;
+
+  for (i = 0; i < n; i++) sf->sum += p[i];
+  if (!sf->err && fwrite(p, 1, n, sf->f) != n) sf->err = errno;
+  sf->pos += n;
+}
+
+/* Write out the track being collected */
+static void
+scp_flush(scp_file *sf)
+{
+  unsigned char th[4 + 12 * 256];
+  unsigned long off;
+  int r;
+
+  if (sf->cur == -1) return;
+  if (sf->nrevs > 0) {
+    memcpy(th, "TRK", 3);
+    th[3] = sf->cur;
+    off = 4 + 12 * sf->nrevs;
+    for (r = 0; r < sf->nrevs; r++) {
+      put32(th + 4 + 12 * r, sf->rev_ticks[r]);
+      put32(th + 8 + 12 * r, sf->rev_len[r]);
+      put32(th + 12 + 12 * r, off);
+      off += 2 * sf->rev_len[r];
+    }
+    sf->offset[sf->cur] = sf->pos;
+    sf->revs[sf->cur] = sf->nrevs;
+    scp_put(sf, th, 4 + 12 * sf->nrevs);
+    scp_put(sf, sf->data, sf->ndata);
+  }
+  sf->cur = -1;
+  sf->nrevs = 0;
+  sf->ndata = 0;
+}
+
+scp_file *
+scp_create(const char *name, int cwclock, int rpm)
+{
+  scp_file *sf;
+  unsigned char hdr[SCP_HDR_SIZE];
+
+  sf = (scp_file *) calloc(1, sizeof(scp_file));
+  if (sf == NULL) return NULL;
+  sf->f = fopen(name, "wb");
+  if (sf->f == NULL) {
+    free(sf);
+    return NULL;
+  }
+  sf->mult = SCP_HZ / (CWHZ * cwclock) * 4294967296.0 + 0.5;
+  sf->rpm = rpm;
+  sf->cur = -1;
+  /* Room for the header; filled in by scp_close */
+  memset(hdr, 0, sizeof(hdr));
+  if (fwrite(hdr, 1, sizeof(hdr), sf->f) != sizeof(hdr)) sf->err = errno;
+  sf->pos = sizeof(hdr);
+  return sf;
+}
+
+/* Add the samples from..to-1 as one revolution.  Returns its length in
+   SCP ticks, 0 if the track already has all the revolutions SCP
+   allows, or -1 if out of memory. */
+static long
+scp_add_rev(scp_file *sf, const unsigned char *samples, int from, int to)
+{
+  unsigned long long cw = 0;
+  unsigned long t, prev = 0, n = 0, ndata = sf->ndata;
+  int i;
+
+  if (sf->nrevs == 256) return 0;
+  for (i = from; i < to; i++) {
+    /* Convert to SCP ticks without accumulating rounding error */
+    cw += (samples[i] & 0x7f) + 1;
+    t = (cw * sf->mult + 0x80000000ULL) >> 32;
+    if (ndata + 2 * ((t - prev) / 0x10000 + 1) > sf->maxdata) {
+      unsigned long max = sf->maxdata ? sf->maxdata * 2 : 1 << 20;
+      unsigned char *d = (unsigned char *) realloc(sf->data, max);
+      if (d == NULL) return -1;
+      sf->data = d;
+      sf->maxdata = max;
+    }
+    while (t - prev >= 0x10000) {
+      /* 0 carries 65536 into the next interval */
+      sf->data[ndata++] = 0;
+      sf->data[ndata++] = 0;
+      prev += 0x10000;
+      n++;
+    }
+    sf->data[ndata++] = (t - prev) >> 8;
+    sf->data[ndata++] = t - prev;
+    prev = t;
+    n++;
+  }
+  sf->ndata = ndata;
+  sf->rev_ticks[sf->nrevs] = prev;
+  sf->rev_len[sf->nrevs++] = n;
+  return prev;
+}
+
+int
+scp_write_pass(scp_file *sf, int headpos, int side,
+	       const unsigned char *samples, int nsamples)
+{
+  int e = headpos * 2 + side, i, last = -1, found = 0;
+  unsigned char oldb = 0;
+  long len, nominal = 60.0 * SCP_HZ / sf->rpm;
+
+  if (e < 0 || e >= MAX_TRACK || sf->err) return sf->err ? -1 : 0;
+  if (e != sf->cur) {
+    scp_flush(sf);
+    sf->cur = e;
+  }
+
+  /* Each revolution runs from one index edge to just before the next */
+  for (i = 0; i < nsamples; i++) {
+    if ((samples[i] & 0x80) && !(oldb & 0x80)) {
+      if (last >= 0) {
+	len = scp_add_rev(sf, samples, last, i);
+	if (len < 0) goto nomem;
+	if (len > 0) found++;
+      }
+      last = i;
+    }
+    oldb = samples[i];
+  }
+
+  /*
+   * Without two index edges, take the read up to its index edge (or
+   * its end) as one revolution, as when reading from hole to hole
+   * with index storage off, but only if it is about as long as one
+   */
+  if (found == 0 && nsamples > 0) {
+    int to = (last > 0) ? last : nsamples;
+    len = scp_add_rev(sf, samples, 0, to);
+    if (len < 0) goto nomem;
+    if (len > nominal - nominal / 10 && len < nominal + nominal / 10) {
+      found++;
+    } else if (len > 0) {
+      sf->nrevs--;
+      sf->ndata -= 2 * sf->rev_len[sf->nrevs];
+    }
+  }
+  return found;
+
+ nomem:
+  sf->err = ENOMEM;
+  return -1;
+}
+
+int
+scp_close(scp_file *sf)
+{
+  unsigned char hdr[SCP_HDR_SIZE];
+  int e, first = -1, last = -1, sides = 0, revs = 255, i, ret;
+  unsigned long sum;
+
+  scp_flush(sf);
+  memset(hdr, 0, sizeof(hdr));
+  for (e = 0; e < MAX_TRACK; e++) {
+    if (sf->offset[e] == 0) continue;
+    if (first == -1) first = e;
+    last = e;
+    sides |= 1 << (e % 2);
+    if (sf->revs[e] < revs) revs = sf->revs[e];
+    put32(hdr + 0x10 + 4 * e, sf->offset[e]);
+  }
+  memcpy(hdr, "SCP", 3);
+  hdr[3] = 0x22;                    /* format version 2.2 */
+  hdr[4] = 0x80;                    /* disk type: other */
+  hdr[5] = (first == -1) ? 0 : revs;
+  hdr[6] = (first == -1) ? 0 : first;
+  hdr[7] = (first == -1) ? 0 : last;
+  hdr[8] = 0x01 | ((sf->rpm > 330) ? 0x04 : 0);  /* index cued */
+  hdr[9] = 0;                       /* 16 bit intervals */
+  hdr[10] = (sides == 1) ? 1 : (sides == 2) ? 2 : 0;
+  hdr[11] = 0;                      /* 25ns resolution */
+  sum = sf->sum;
+  for (i = 0x10; i < SCP_HDR_SIZE; i++) sum += hdr[i];
+  put32(hdr + 0x0c, sum);
+  if (!sf->err &&
+      (fseek(sf->f, 0, SEEK_SET) != 0 ||
+       fwrite(hdr, 1, sizeof(hdr), sf->f) != sizeof(hdr))) {
+    sf->err = errno;
+  }
+  if (fclose(sf->f) != 0 && !sf->err) sf->err = errno;
+  ret = sf->err ? -1 : 0;
+  if (sf->err) errno = sf->err;
+  free(sf->data);
+  free(sf);
+  return ret;
+}
@@ -0,0 +1,103 @@
+/*
+ * flux.h: Reading flux images from other hardware as Catweasel samples,
+ * and writing Catweasel samples as SCP flux images.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+
+#ifndef _FLUX_H
+#define _FLUX_H
+
+/*
+ * Three kinds of image are read:
+ *
+ *   SuperCard Pro (.scp): one file, any number of revolutions per
+ *   track, flux intervals in units of 25ns times (resolution + 1).
+ *
+ *   KryoFlux stream files: one file per track and side, named
+ *   <prefix>NN.S.raw; any one of them names the set.  Flux intervals
+ *   are in sample clocks (about 24.03 MHz), with the index pulses
+ *   given in out-of-band blocks.
+ *
+ *   HxC (.hfe, version 1 only): one revolution per track, stored as
+ *   a bitstream of cells at twice the data rate; each 1 bit is a flux
+ *   transition.
+ *
+ * Each revolution is resampled to the Catweasel clock (CWHZ times
+ * the clock multiplier) as if the Catweasel had read it starting at
+ * the index hole, and continued for a fifth of a revolution past the
+ * next one, as cw2dmk does: a sample of value v stands for v + 1
+ * clocks, saturating at 0x7f, and bit 7 is set while the index hole
+ * is passing.  Rounding error is not allowed to accumulate; each
+ * transition lands on the clock nearest its true time.
+ *
+ * Track numbers are physical, as the image records them.
+ */
+
+typedef struct flux_info {
+  const char *format;  /* "SCP", "KryoFlux", or "HFE" */
+  int tracks;          /* one more than the highest track */
+  int revs;            /* revolutions on the first track found */
+} flux_info;
+
+typedef struct flux_file flux_file;
+
+/* Open a flux image and fill in *info.  Returns NULL on error, with
+   errno set (EINVAL if it is not a flux image this code reads). */
+flux_file *flux_open(const char *name, flux_info *info);
+
+/* Resample revolution rev (0 for the first) of a track and side into
+   at most size samples for clock multiplier cwclock.  Returns the
+   number of samples, or -1 if there is no such revolution. */
+int flux_samples(flux_file *ff, int track, int side, int rev, int cwclock,
+		 unsigned char *buf, int size);
+
+/* Guess the drive/media kind (cw2dmk -k) from the rotation speed and
+   the most common flux interval of the first track found, or return
+   -1 if there is no track to look at. */
+int flux_kind(flux_file *ff);
+
+void flux_close(flux_file *ff);
+
+/*
+ * Writing an SCP image.  Each read is split into revolutions at the
+ * leading edges of the index pulses marked in its samples.  A read
+ * with fewer than two (from index to index with index storage off, for
+ * instance) is taken as one revolution up to its index edge if it is
+ * within 10% of the nominal length of one.  The revolutions of all the
+ * reads of a track and side are kept together, under the physical
+ * track number (head position), up to the 256 SCP allows.  A track
+ * read again after other tracks replaces the earlier reads.  The
+ * header gives the smallest number of revolutions any track has, as
+ * SCP readers expect every track to have at least that many;
+ * flux_samples takes each track's own number from its revolution table.
+ */
+typedef struct scp_file scp_file;
+
+/* Create an SCP image for samples taken with clock multiplier cwclock
+   from a drive turning at rpm.  Returns NULL on error, with errno
+   set. */
+scp_file *scp_create(const char *name, int cwclock, int rpm);
+
+/* Add one read.  Returns the number of complete revolutions found, or
+   -1 on a write error (possibly from an earlier read). */
+int scp_write_pass(scp_file *sf, int headpos, int side,
+		   const unsigned char *samples, int nsamples);
+
+/* Write the last track and the header, and close.  Returns 0 if OK,
+   -1 on error. */
+int scp_close(scp_file *sf);
+
+#endif /* _FLUX_H */
@@ -0,0 +1,206 @@
+/*
+ * flux2cwr: Convert a flux image from other hardware to a raw capture file
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+
+/*
+ * Usage:
+ *
+ *     flux2cwr [-k kind] [-c clock] [-m steps] [-Z level] [-v verbosity]
+ *              image [file.cwr]
+ *
+ * The image is a SuperCard Pro .scp file, any one of a set of
+ * KryoFlux stream files (<prefix>NN.S.raw), or an HxC .hfe file.
+ * Each revolution of each track is resampled to the Catweasel clock
+ * and written to the capture file as one read, the first revolution
+ * as pass 1, the next as pass 2 (a retry), and so on, so the disk can
+ * be decoded with cw2dmk -R.  If file.cwr is not given, it is formed
+ * from the image name by replacing the extension (and for KryoFlux,
+ * the track and side) with ".cwr".
+ *
+ * The kind is guessed from the rotation speed and the flux intervals
+ * of the first track unless -k is given.  As with cw2dmk, the default
+ * clock depends on the kind.  With -m 2, only every other physical
+ * track is used, as when a 48 tpi disk is read in a 96 tpi drive.  -Z
+ * compresses the capture, as with cw2dmk -Z.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+
+#include "cwfloppy.h"
+#include "dmk.h"
+#include "kind.h"
+#include "flux.h"
+#include "cwraw.h"
+
+int kind = -1;
+int cwclock = -1;
+int steps = 1;
+int verbose = 1;
+int compress = 0;
+
+void
+usage(void)
+{
+  printf("\nUsage: flux2cwr [options] image [file.cwr]\n");
+  printf(" Options [defaults in brackets]:\n");
+  printf(" -k kind       Drive/media kind [guessed from the image]\n");
+  printf(" -c clock      Catweasel clock multiplier [depends on kind]\n");
+  printf(" -m steps      Step multiplier, 1 or 2 [%d]\n", steps);
+  printf(" -Z level      Compress, zlib level 1-9 or 0 for none [%d]\n",
+	 compress);
+  printf(" -v verbosity  0 = errors only, 1 = summary, 2 = each read [%d]\n",
+	 verbose);
+  exit(1);
+}
+
+int
+main(int argc, char **argv)
+{
+  char *flux_name, *cwr_name;
+  flux_file *ff;
+  flux_info finfo;
+  cwraw_file *rf;
+  cwraw_info info;
+  unsigned char *samples;
+  int ch, track, side, rev, n;
+  int reads = 0;
+  long long total = 0;
+
+  opterr = 0;
+  for (;;) {
+    ch = getopt(argc, argv, "k:c:m:v:Z:");
+    if (ch == -1) break;
+    switch (ch) {
+    case 'k':
+      kind = strtol(optarg, NULL, 0);
+      if (kind < 1 || kind > NKINDS) usage();
+      break;
+    case 'c':
+      cwclock = strtol(optarg, NULL, 0);
+      if (cwclock != 1 && cwclock != 2 && cwclock != 4) usage();
+      break;
+    case 'm':
+      steps = strtol(optarg, NULL, 0);
+      if (steps < 1 || steps > 2) usage();
+      break;
+    case 'v':
+      verbose = strtol(optarg, NULL, 0);
+      break;
+    case 'Z':
+      compress = strtol(optarg, NULL, 0);
+      if (compress < 0 || compress > 9) usage();
+      break;
+    default:
+      usage();
+      break;
+    }
+  }
+
+  if (argc - optind < 1 || argc - optind > 2) usage();
+  flux_name = argv[optind];
+
+  ff = flux_open(flux_name, &finfo);
+  if (ff == NULL) {
+    if (errno == EINVAL) {
+      fprintf(stderr, "flux2cwr: %s is not a flux image I can read\n",
+	      flux_name);
+    } else {
+      perror(flux_name);
+    }
+    exit(1);
+  }
+
+  if (argc - optind == 2) {
+    cwr_name = argv[optind+1];
+  } else {
+    char *p;
+    int len;
+
+    p = strrchr(flux_name, '.');
+    if (p == NULL || strchr(p, '/')) {
+      len = strlen(flux_name);
+    } else {
+      len = p - flux_name;
+    }
+    if (strcmp(finfo.format, "KryoFlux") == 0) {
+      len -= 4;  /* "NN.S" */
+    }
+    cwr_name = (char *) malloc(len + 5);
+    sprintf(cwr_name, "%.*s.cwr", len, flux_name);
+  }
+
+  if (kind == -1) {
+    kind = flux_kind(ff);
+    if (kind == -1) {
+      fprintf(stderr, "flux2cwr: no tracks in %s\n", flux_name);
+      exit(1);
+    }
+  }
+  if (cwclock == -1) cwclock = kinds[kind-1].cwclock;
+
+  samples = (unsigned char *) malloc(CW_MEMSIZE);
+  if (samples == NULL) {
+    fprintf(stderr, "flux2cwr: out of memory\n");
+    exit(1);
+  }
+
+  info.mk = 0;
+  info.cwclock = cwclock;
+  info.kind = kind;
+  info.steps = steps;
+  info.compress = compress;
+  rf = cwraw_create(cwr_name, &info);
+  if (rf == NULL) {
+    perror(cwr_name);
+    exit(1);
+  }
+
+  for (track = 0; track * steps < finfo.tracks; track++) {
+    for (side = 0; side < 2; side++) {
+      for (rev = 0; ; rev++) {
+	n = flux_samples(ff, track * steps, side, rev, cwclock,
+			 samples, CW_MEMSIZE);
+	if (n < 0) break;
+	if (verbose >= 2) {
+	  printf("Track %d, side %d, pass %d: %d samples\n",
+		 track, side, rev + 1, n);
+	}
+	if (cwraw_write_pass(rf, track, side, rev + 1, track * steps,
+			     samples, n) < 0) {
+	  perror(cwr_name);
+	  exit(1);
+	}
+	reads++;
+	total += n;
+      }
+    }
+  }
+  flux_close(ff);
+  if (cwraw_close(rf) < 0) {
+    perror(cwr_name);
+    exit(1);
+  }
+  if (verbose >= 1) {
+    printf("%s image, %d reads, %lld samples, kind %d, clock %d\n",
+	   finfo.format, reads, total, kind, cwclock);
+  }
+  return 0;
+}
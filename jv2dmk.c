@@ -25,7 +25,7 @@
 
 #include "dmk.h"
 #include "jv3.h"
-#include "crc.c"
+#include "crc.h"
 
 /* Command line options */
 #define OUT_QUIET 0
@@ -0,0 +1,235 @@
+/*
+ * log2cwr: Convert a cw2dmk level 7 log to a raw capture file
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+
+/*
+ * Usage:
+ *
+ *     log2cwr [-k kind] [-c clock] [-Z level] [-v verbosity] file.log [file.cwr]
+ *
+ * Every track read recorded in the log (including retries) is
+ * written to the capture file, in the same form as cw2dmk -F would
+ * have written it, so the disk can be decoded again with cw2dmk -R
+ * without the cost of parsing the log.  If file.cwr is not given, it
+ * is formed from file.log by replacing the extension with ".cwr".
+ *
+ * The kind and clock are taken from the log's command line or
+ * "Detected" message if present; otherwise -k must be given.  As with
+ * cw2dmk, the default clock depends on the kind.  -Z compresses the
+ * capture, as with cw2dmk -Z.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+
+#include "cwfloppy.h"
+#include "dmk.h"
+#include "kind.h"
+#include "parselog.h"
+#include "cwraw.h"
+
+int kind = -1;
+int cwclock = -1;
+int steps = 0;
+int verbose = 1;
+int compress = 0;
+
+void
+usage(void)
+{
+  printf("\nUsage: log2cwr [options] file.log [file.cwr]\n");
+  printf(" Options [defaults in brackets]:\n");
+  printf(" -k kind       Drive/media kind, if not found in the log\n");
+  printf(" -c clock      Catweasel clock multiplier [depends on kind]\n");
+  printf(" -Z level      Compress, zlib level 1-9 or 0 for none [%d]\n",
+	 compress);
+  printf(" -v verbosity  0 = errors only, 1 = summary, 2 = each read [%d]\n",
+	 verbose);
+  exit(1);
+}
+
+/*
+ * Look through the messages before the first track for the command
+ * line, the detected kind, and the stepping.  Leaves the file
+ * rewound.
+ */
+void
+scan_header(FILE *f)
+{
+  char line[1024], *p;
+  int i;
+
+  while (fgets(line, sizeof(line), f) != NULL &&
+	 strncmp(line, "Track ", 6) != 0) {
+    if (strncmp(line, "Command line:", 13) == 0) {
+      for (p = strtok(line + 13, " \n"); p; p = strtok(NULL, " \n")) {
+	if (p[0] != '-' || (p[1] != 'k' && p[1] != 'c')) continue;
+	char opt = p[1];
+	char *arg = p[2] ? p + 2 : strtok(NULL, " \n");
+	if (arg == NULL) break;
+	if (opt == 'k' && kind == -1) kind = strtol(arg, NULL, 0);
+	if (opt == 'c' && cwclock == -1) cwclock = strtol(arg, NULL, 0);
+      }
+    } else if (strncmp(line, "Detected ", 9) == 0 && kind == -1) {
+      for (i = 0; i < NKINDS; i++) {
+	if (strncmp(line + 9, kinds[i].description,
+		    strlen(kinds[i].description)) == 0) {
+	  kind = i + 1;
+	}
+      }
+    } else if (strncmp(line, "Trying ", 7) == 0 && steps == 0) {
+      steps = strstr(line, "double stepping") ? 2 : 1;
+    }
+  }
+  rewind(f);
+}
+
+int
+main(int argc, char **argv)
+{
+  char *log_name, *cwr_name;
+  FILE *log_file;
+  log_reader *lr;
+  cwraw_file *rf;
+  cwraw_info info;
+  unsigned char *samples;
+  int ch, track, side, pass, n, r, oldr;
+  int reads = 0;
+  long long total = 0;
+
+  opterr = 0;
+  for (;;) {
+    ch = getopt(argc, argv, "k:c:v:Z:");
+    if (ch == -1) break;
+    switch (ch) {
+    case 'k':
+      kind = strtol(optarg, NULL, 0);
+      if (kind < 1 || kind > NKINDS) usage();
+      break;
+    case 'c':
+      cwclock = strtol(optarg, NULL, 0);
+      if (cwclock != 1 && cwclock != 2 && cwclock != 4) usage();
+      break;
+    case 'v':
+      verbose = strtol(optarg, NULL, 0);
+      break;
+    case 'Z':
+      compress = strtol(optarg, NULL, 0);
+      if (compress < 0 || compress > 9) usage();
+      break;
+    default:
+      usage();
+      break;
+    }
+  }
+
+  switch (argc - optind) {
+  case 2:
+    log_name = argv[optind];
+    cwr_name = argv[optind+1];
+    break;
+
+  case 1: {
+    char *p;
+    int len;
+
+    log_name = argv[optind];
+    p = strrchr(log_name, '.');
+    if (p == NULL) {
+      len = strlen(log_name);
+    } else {
+      len = p - log_name;
+    }
+    cwr_name = (char *) malloc(len + 5);
+    sprintf(cwr_name, "%.*s.cwr", len, log_name);
+    break; }
+
+  default:
+    usage();
+  }
+
+  log_file = fopen(log_name, "r");
+  if (log_file == NULL) {
+    perror(log_name);
+    exit(1);
+  }
+  scan_header(log_file);
+  if (kind < 1 || kind > NKINDS) {
+    fprintf(stderr, "log2cwr: kind not found in %s; use -k\n", log_name);
+    exit(1);
+  }
+  if (cwclock == -1) cwclock = kinds[kind-1].cwclock;
+
+  lr = log_reader_new(log_file);
+  samples = (unsigned char *) malloc(CW_MEMSIZE);
+  if (lr == NULL || samples == NULL) {
+    fprintf(stderr, "log2cwr: out of memory\n");
+    exit(1);
+  }
+
+  info.mk = 0;
+  info.cwclock = cwclock;
+  info.kind = kind;
+  info.steps = steps;
+  info.compress = compress;
+  rf = cwraw_create(cwr_name, &info);
+  if (rf == NULL) {
+    perror(cwr_name);
+    exit(1);
+  }
+
+  while ((track = parse_track(lr, &side, &pass)) != EOF) {
+    /* Collect the samples as cw2dmk -R would, then skip the rest */
+    n = 0;
+    oldr = 0;
+    while ((r = parse_sample(lr)) != EOF) {
+      if (n == CW_MEMSIZE || (r == 0x00 && oldr == 0x80)) {
+	while (parse_sample(lr) != EOF) /* skip */;
+	break;
+      }
+      samples[n++] = r;
+      oldr = r;
+    }
+    if (verbose >= 2) {
+      printf("Track %d, side %d, pass %d: %d samples\n",
+	     track, side, pass, n);
+    }
+    if (cwraw_write_pass(rf, track, side, pass,
+			 track * (steps ? steps : 1), samples, n) < 0) {
+      perror(cwr_name);
+      exit(1);
+    }
+    reads++;
+    total += n;
+  }
+  if (ferror(log_file)) {
+    perror(log_name);
+    exit(1);
+  }
+  if (cwraw_close(rf) < 0) {
+    perror(cwr_name);
+    exit(1);
+  }
+  if (verbose >= 1) {
+    printf("%d reads, %lld samples, kind %d, clock %d\n",
+	   reads, total, kind, cwclock);
+  }
+  return 0;
+}
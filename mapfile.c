@@ -0,0 +1,100 @@
+/*
+ * mapfile.c: Loading whole files into memory.  See mapfile.h.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#if linux
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+#include "mapfile.h"
+
+int
+map_file(const char *name, const unsigned char **data, size_t *size,
+	 int *mapped)
+{
+  FILE *f;
+  unsigned char *buf = NULL, *nbuf;
+  size_t n = 0, max = 0, got;
+
+  *data = NULL;
+  *size = 0;
+  *mapped = 0;
+#if linux
+  {
+    struct stat st;
+    int fd = open(name, O_RDONLY);
+    if (fd == -1) return -1;
+    if (fstat(fd, &st) == 0 && st.st_size > 0) {
+      void *m = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+      if (m != MAP_FAILED) {
+	*data = (const unsigned char *) m;
+	*size = st.st_size;
+	*mapped = 1;
+      }
+    }
+    close(fd);
+    if (*data) return 0;
+  }
+#endif
+
+  /* No mmap; read the whole file instead */
+  f = fopen(name, "rb");
+  if (f == NULL) return -1;
+  for (;;) {
+    if (n == max) {
+      max = max ? max * 2 : 1 << 20;
+      nbuf = (unsigned char *) realloc(buf, max);
+      if (nbuf == NULL) {
+	free(buf);
+	fclose(f);
+	errno = ENOMEM;
+	return -1;
+      }
+      buf = nbuf;
+    }
+    got = fread(buf + n, 1, max - n, f);
+    if (got == 0) break;
+    n += got;
+  }
+  if (ferror(f)) {
+    free(buf);
+    fclose(f);
+    if (errno == 0) errno = EIO;
+    return -1;
+  }
+  fclose(f);
+  *data = buf;
+  *size = n;
+  return 0;
+}
+
+void
+unmap_file(const unsigned char *data, size_t size, int mapped)
+{
+#if linux
+  if (mapped) {
+    munmap((void *) data, size);
+    return;
+  }
+#endif
+  free((void *) data);
+}
@@ -0,0 +1,74 @@
+/*
+ * mapfile.h: Loading whole files into memory, and little-endian
+ * fields within them.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+
+#ifndef _MAPFILE_H
+#define _MAPFILE_H
+
+#include <stddef.h>
+
+/* Map a whole file into memory, or read it in where it can't be
+   mapped.  Sets *mapped to say which, for unmap_file.  Returns 0 if
+   OK, or -1 with errno set (ENOMEM if there is no room to read it
+   in). */
+int map_file(const char *name, const unsigned char **data, size_t *size,
+	     int *mapped);
+
+/* Let go of a file from map_file */
+void unmap_file(const unsigned char *data, size_t size, int mapped);
+
+static inline void
+put16(unsigned char *p, unsigned int v)
+{
+  p[0] = v;
+  p[1] = v >> 8;
+}
+
+static inline void
+put32(unsigned char *p, unsigned long v)
+{
+  put16(p, v & 0xffff);
+  put16(p + 2, v >> 16);
+}
+
+static inline void
+put64(unsigned char *p, unsigned long long v)
+{
+  put32(p, v & 0xffffffff);
+  put32(p + 4, v >> 32);
+}
+
+static inline unsigned int
+get16(const unsigned char *p)
+{
+  return p[0] | (p[1] << 8);
+}
+
+static inline unsigned long
+get32(const unsigned char *p)
+{
+  return get16(p) | ((unsigned long) get16(p + 2) << 16);
+}
+
+static inline unsigned long long
+get64(const unsigned char *p)
+{
+  return get32(p) | ((unsigned long long) get32(p + 4) << 32);
+}
+
+#endif /* _MAPFILE_H */
@@ -0,0 +1,79 @@
+/*
+ * markscan.c: Find the places in a packed bitstream where an address
+ * mark may end.  Included by decoder.c once for each width it is
+ * built for, with MARKSCAN_NAME, MARKSCAN_VEC (a vector of 64-bit
+ * words, or just unsigned long long), MARKSCAN_ATTR, and optionally
+ * MARKSCAN_TAIL (the one-word version, for the words left over)
+ * defined.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+
+/*
+ * For words k0 through k1 - 1 of the bitstream in buf, set each bit
+ * of the same word of cand where the 16 bits read up to and including
+ * that bit are those of FM_MARKS (if fm is all ones) or MFM_MARKS (if
+ * mfm is).  Words k0 - 2 and k0 - 1 must exist.
+ *
+ * The words are taken as bit slices: bit j of t[i] is the bit read i
+ * bits before bit j of the word, so the nibble maps n[v] (the last 4
+ * bits read are v) come from a few ands, and the last 16 bits are a
+ * given value where the maps of its nibbles, shifted into place, all
+ * have a 1.  The shifts bring in bits from the maps of the words
+ * before (np, from u).
+ */
+static MARKSCAN_ATTR void
+MARKSCAN_NAME(const unsigned long long *buf, unsigned long long *cand,
+	      long k0, long k1, unsigned long long fm, unsigned long long mfm)
+{
+  typedef MARKSCAN_VEC vec;
+  enum { L = sizeof(vec) / sizeof(unsigned long long) };
+  vec s0, s1, s2, t[4], u[4], hi[4], lo[4], hip[4], lop[4];
+  vec n[16], np[16], m;
+  long k;
+  int i, v;
+
+  for (k = k0; k + L <= k1; k += L) {
+    memcpy(&s0, &buf[k], sizeof(vec));
+    memcpy(&s1, &buf[k - 1], sizeof(vec));
+    memcpy(&s2, &buf[k - 2], sizeof(vec));
+    t[0] = s0;
+    u[0] = s1;
+    for (i = 1; i < 4; i++) {
+      t[i] = (s0 >> i) | (s1 << (64 - i));
+      u[i] = (s1 >> i) | (s2 << (64 - i));
+    }
+    for (v = 0; v < 4; v++) {
+      hi[v] = ((v & 2) ? t[3] : ~t[3]) & ((v & 1) ? t[2] : ~t[2]);
+      lo[v] = ((v & 2) ? t[1] : ~t[1]) & ((v & 1) ? t[0] : ~t[0]);
+      hip[v] = ((v & 2) ? u[3] : ~u[3]) & ((v & 1) ? u[2] : ~u[2]);
+      lop[v] = ((v & 2) ? u[1] : ~u[1]) & ((v & 1) ? u[0] : ~u[0]);
+    }
+    for (v = 0; v < 16; v++) {
+      n[v] = hi[v >> 2] & lo[v & 3];
+      np[v] = hip[v >> 2] & lop[v & 3];
+    }
+#define NIB(p, s) ((n[((p) >> (s)) & 15] >> (s)) | \
+		   (np[((p) >> (s)) & 15] << (64 - (s))))
+#define MATCH(p) (n[(p) & 15] & NIB(p, 4) & NIB(p, 8) & NIB(p, 12)) |
+    m = (fm & (FM_MARKS(MATCH) 0)) | (mfm & (MFM_MARKS(MATCH) 0));
+#undef MATCH
+#undef NIB
+    memcpy(&cand[k], &m, sizeof(vec));
+  }
+#ifdef MARKSCAN_TAIL
+  if (k < k1) MARKSCAN_TAIL(buf, cand, k, k1, fm, mfm);
+#endif
+}
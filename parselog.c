@@ -18,10 +18,10 @@
  */
 
 #include <stdio.h>
-
-static int unread_track = -1, unread_side, unread_pass;
-static int prev_track = -1;
-static int hibit;
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include "parselog.h"
 
 /*
  * XXX Currently parses only the physical track/side/pass messages and
@@ -37,6 +37,204 @@ static int hibit;
  * disk kind.
  */
 
+/*
+ * The log is read in large chunks into a buffer that is scanned by
+ * hand; this is many times faster than calling fscanf for each
+ * sample.  The grammar and results are the same as with the original
+ * fscanf-based parser (see scanf_parse_sample in the TEST code).
+ *
+ * The buffer always has a 0 after the last valid byte, so the common
+ * cases can scan without checking for the end.  It is refilled when
+ * fewer than LOG_LOOKAHEAD bytes are left, so a sample never spans a
+ * refill unless it is unusually long, in which case the slower
+ * general code handles it.
+ */
+#define LOG_CHUNK (1 << 20)
+#define LOG_LOOKAHEAD 64
+
+struct log_reader {
+  FILE *f;
+  unsigned char *buf;
+  size_t pos, end;
+  int eof;
+  int unread_track, unread_side, unread_pass;
+  int prev_track;
+  int hibit;
+};
+
+/* Character classes */
+#define C_OTHER  0
+#define C_SPACE  1
+#define C_DIGIT  2
+#define C_SUFFIX 3  /* t, s, m, or l after a sample */
+
+static unsigned char cclass[256] = {
+  ['\t'] = C_SPACE, ['\n'] = C_SPACE, ['\v'] = C_SPACE,
+  ['\f'] = C_SPACE, ['\r'] = C_SPACE, [' '] = C_SPACE,
+  ['0'] = C_DIGIT, ['1'] = C_DIGIT, ['2'] = C_DIGIT, ['3'] = C_DIGIT,
+  ['4'] = C_DIGIT, ['5'] = C_DIGIT, ['6'] = C_DIGIT, ['7'] = C_DIGIT,
+  ['8'] = C_DIGIT, ['9'] = C_DIGIT,
+  ['t'] = C_SUFFIX, ['s'] = C_SUFFIX, ['m'] = C_SUFFIX, ['l'] = C_SUFFIX,
+};
+
+/*
+ * Start reading a log.  The reader takes over reading from
+ * log_file; the caller should not read it directly afterward.
+ */
+log_reader *
+log_reader_new(FILE *log_file)
+{
+  log_reader *lr = (log_reader *) calloc(1, sizeof(log_reader));
+
+  if (lr == NULL) return NULL;
+  lr->buf = (unsigned char *) malloc(LOG_CHUNK + 1);
+  if (lr->buf == NULL) {
+    free(lr);
+    return NULL;
+  }
+  lr->buf[0] = 0;
+  lr->f = log_file;
+  lr->unread_track = -1;
+  lr->prev_track = -1;
+  return lr;
+}
+
+void
+log_reader_free(log_reader *lr)
+{
+  free(lr->buf);
+  free(lr);
+}
+
+/* Move the unread bytes to the front of the buffer and read more
+   after them.  Return 0 if there is nothing left to read. */
+static int
+lr_fill(log_reader *lr)
+{
+  size_t left = lr->end - lr->pos, n;
+
+  if (lr->eof) return left > 0;
+  memmove(lr->buf, lr->buf + lr->pos, left);
+  lr->pos = 0;
+  n = fread(lr->buf + left, 1, LOG_CHUNK - left, lr->f);
+  if (n < LOG_CHUNK - left) lr->eof = 1;
+  lr->end = left + n;
+  lr->buf[lr->end] = 0;
+  return lr->end > 0;
+}
+
+static inline int
+lr_peek(log_reader *lr)
+{
+  if (lr->pos == lr->end && !lr_fill(lr)) return EOF;
+  return lr->buf[lr->pos];
+}
+
+static inline int
+lr_get(log_reader *lr)
+{
+  if (lr->pos == lr->end && !lr_fill(lr)) return EOF;
+  return lr->buf[lr->pos++];
+}
+
+/* Push back the character just read by lr_get */
+static inline void
+lr_unget(log_reader *lr)
+{
+  lr->pos--;
+}
+
+static inline void
+lr_skip_space(log_reader *lr)
+{
+  while (cclass[(unsigned char) lr_peek(lr)] == C_SPACE) lr->pos++;
+}
+
+/* Skip through the next c */
+static void
+lr_skip_past(log_reader *lr, int c)
+{
+  unsigned char *p;
+
+  for (;;) {
+    p = memchr(lr->buf + lr->pos, c, lr->end - lr->pos);
+    if (p) {
+      lr->pos = p - lr->buf + 1;
+      return;
+    }
+    lr->pos = lr->end;
+    if (!lr_fill(lr)) return;
+  }
+}
+
+/* Like scanf("%d"), without skipping leading space.  Return 1 if a
+   number was read, 0 if not.  Like glibc, converts with strtol's
+   overflow handling and then truncates to int. */
+static int
+lr_number(log_reader *lr, int *val)
+{
+  int c, neg = 0;
+  long v;
+
+  c = lr_peek(lr);
+  if (c == '-' || c == '+') {
+    neg = (c == '-');
+    lr->pos++;
+    c = lr_peek(lr);
+  }
+  if (c < '0' || c > '9') return 0;
+  v = 0;
+  do {
+    if (v <= (LONG_MAX - (c - '0')) / 10) {
+      v = v * 10 + (c - '0');
+    } else {
+      v = -1;  /* overflow */
+    }
+    lr->pos++;
+    c = lr_peek(lr);
+  } while (c >= '0' && c <= '9' && v >= 0);
+  while (c >= '0' && c <= '9') {
+    lr->pos++;
+    c = lr_peek(lr);
+  }
+  if (v < 0) {
+    v = neg ? LONG_MIN : LONG_MAX;
+  } else if (neg) {
+    v = -v;
+  }
+  *val = (int) v;
+  return 1;
+}
+
+/*
+ * Like fscanf for a format made only of literal characters, spaces,
+ * and up to three %d conversions, with the same return value.
+ */
+static int
+lr_scan(log_reader *lr, const char *fmt, int *v0, int *v1, int *v2)
+{
+  int *vals[3] = { v0, v1, v2 };
+  int n = 0, c;
+
+  for (; *fmt; fmt++) {
+    if (*fmt == ' ') {
+      lr_skip_space(lr);
+    } else if (*fmt == '%') {
+      fmt++;  /* 'd' */
+      lr_skip_space(lr);
+      if (lr_peek(lr) == EOF) return n ? n : EOF;
+      if (!lr_number(lr, vals[n])) return n;
+      n++;
+    } else {
+      c = lr_peek(lr);
+      if (c == EOF) return n ? n : EOF;
+      if (c != *fmt) return n;
+      lr->pos++;
+    }
+  }
+  return n;
+}
+
 /*
  * Find start of next unread track capture in file.  If called
  * repeatedly without calling parse_sample, returns the same values
@@ -45,7 +243,172 @@ static int hibit;
  * and *pass.
  */
 int
-parse_track(FILE *log_file, int *side, int *pass)
+parse_track(log_reader *lr, int *side, int *pass)
+{
+  int ret;
+
+  lr->hibit = 0;
+
+  if (lr->unread_track == -1) {
+    for (;;) {
+      // Try to read track start message here.
+      ret = lr_scan(lr, "Track %d, side %d, pass %d:",
+                    &lr->unread_track, &lr->unread_side, &lr->unread_pass);
+      if (ret == EOF) {
+        *side = *pass = 0;
+        return EOF;
+      }
+      if (ret == 3) {
+        break; // success
+      }
+      if (ret == 2) {
+        // Log from an old cw2dmk version without pass numbers
+        lr->unread_pass = 1;
+        break; // success
+      }
+
+      // Try to read old-style (original 4.4 and earlier) retry message.
+      ret = lr_scan(lr, "; retry %d]", &lr->unread_pass, NULL, NULL);
+      if (ret == 1) {
+        lr->unread_pass++;
+        lr->unread_track = lr->prev_track;
+        break;
+      }
+      (void) lr_get(lr);
+    }
+    lr->prev_track = lr->unread_track;
+  }
+
+  *side = lr->unread_side;
+  *pass = lr->unread_pass;
+  return lr->unread_track;
+}
+
+/*
+ * Return next sample from current track capture, or EOF if no more
+ * samples in track capture.  Mark current capture as read.
+ */
+int
+parse_sample(log_reader *lr)
+{
+  unsigned char *p, *e;
+  int c, sample;
+
+  lr->unread_track = -1;
+
+  for (;;) {
+    // The usual case: a sample such as "85s ", with no sign and
+    // far enough from the end of the buffer.
+    if (lr->end - lr->pos < LOG_LOOKAHEAD) lr_fill(lr);
+    p = lr->buf + lr->pos;
+    e = lr->buf + lr->end;
+    while (cclass[*p] == C_SPACE) p++;
+    lr->pos = p - lr->buf;
+    if (cclass[*p] == C_DIGIT && (e - p >= LOG_LOOKAHEAD || lr->eof)) {
+      unsigned char *q = p;
+      sample = *q++ - '0';
+      while (cclass[*q] == C_DIGIT && q - p < 9) {
+        sample = sample * 10 + (*q++ - '0');
+      }
+      if (cclass[*q] == C_SUFFIX) {
+        q++;
+        while (*q == ' ') q++;
+        lr->pos = q - lr->buf;
+        return sample | lr->hibit;
+      }
+      if (cclass[*q] != C_DIGIT && (q < e || lr->eof)) {
+        // A number but not a sample; go on with the next character.
+        lr->pos = q - lr->buf;
+        goto other;
+      }
+      // Too long to scan here; do it the slow way.
+    }
+    if (p == e && lr->eof) {
+      return EOF;
+    }
+
+    // Anything else, or near a refill: the general case.
+    lr_skip_space(lr);
+    c = lr_peek(lr);
+    if (c == EOF) {
+      return EOF;
+    }
+    if (lr_number(lr, &sample)) {
+      c = lr_peek(lr);
+      if (c == 't' || c == 's' || c == 'm' || c == 'l') {
+        lr->pos++;
+        while (lr_peek(lr) == ' ') lr->pos++;
+        return sample | lr->hibit;
+      }
+    }
+
+  other:
+    // No sample here; what is it?
+    c = lr_get(lr);
+    switch (c) {
+    case EOF:
+      // End of file
+      return EOF;
+    case 'T':
+      // Looks like start of next track; push back 'T' for parse_track.
+      lr_unget(lr);
+      return EOF;
+    case '<':
+      // Decoded byte; skip through closing '>'.
+      lr_skip_past(lr, '>');
+      break;
+    case '(':
+      // Number of bits added/dropped; skip through closing ')'.
+      lr_skip_past(lr, ')');
+      break;
+    case '[':
+      // Informational message; usually just skip through closing ']'.
+      do {
+        c = lr_get(lr);
+        if (c == ';') {
+          // Assume old-style retry message starts here.
+          lr_unget(lr);
+          return EOF;
+        }
+      } while (c != EOF && c != ']');
+      break;
+    case '{':
+      // Leading index edge; turn on high bit in upcoming sample(s).
+      /*
+       * Note: due to a bug in logging (XXX to be fixed later), this may
+       * also mean the next sample will be the end of track marker,
+       * which was originally 0x80 but logged as 0x00.  Either way,
+       * setting the high bit will reconstitute the original sample.
+       */
+      lr->hibit = 0x80;
+      break;
+    case '}':
+      // Trailing index edge; turn off high bit in upcoming sample(s).
+      lr->hibit = 0;
+      break;
+    case '?':
+      // Decoder saw missing/extra clock; skip.
+      break;
+    default:
+      // Anything else; skip.
+      break;
+    }
+  }
+}
+
+#if TEST
+#include <time.h>
+
+/*
+ * The original fscanf-based parser, kept as a reference to check the
+ * lexer against and to benchmark it with.
+ */
+static int unread_track = -1, unread_side, unread_pass;
+static int prev_track = -1;
+static int hibit;
+
+static int
+scanf_parse_track(FILE *log_file, int *side, int *pass)
 {
   int ret;
 
@@ -86,12 +449,8 @@ parse_track(FILE *log_file, int *side, int *pass)
   return unread_track;
 }
 
-/*
- * Return next sample from current track capture, or EOF if no more
- * samples in track capture.  Mark current capture as read.
- */
-int
-parse_sample(FILE *log_file)
+static int
+scanf_parse_sample(FILE *log_file)
 {
   int ret, c, sample;
   char junk[2];
@@ -165,15 +524,94 @@ parse_sample(FILE *log_file)
   }
 }
 
-#if TEST
+static double
+now(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/*
+ * Benchmark: parse the whole log with the original fscanf parser and
+ * with the lexer, check that they agree, and report samples/sec.
+ */
+static int
+benchmark(const char *name)
+{
+  FILE *f1, *f2;
+  log_reader *lr;
+  int t1, t2, s1, s2, p1, p2, v1, v2;
+  long n = 0;
+  double start, t_scanf, t_lexer;
+
+  f1 = fopen(name, "r");
+  if (f1 == NULL) {
+    perror(name);
+    return 1;
+  }
+  start = now();
+  do {
+    t1 = scanf_parse_track(f1, &s1, &p1);
+    while (scanf_parse_sample(f1) != EOF) n++;
+  } while (t1 != EOF);
+  t_scanf = now() - start;
+
+  f2 = fopen(name, "r");
+  lr = log_reader_new(f2);
+  start = now();
+  do {
+    t2 = parse_track(lr, &s2, &p2);
+    while (parse_sample(lr) != EOF) /* count above */;
+  } while (t2 != EOF);
+  t_lexer = now() - start;
+
+  printf("%ld samples\n", n);
+  printf("fscanf: %8.3f s, %12.0f samples/sec\n", t_scanf, n / t_scanf);
+  printf("lexer:  %8.3f s, %12.0f samples/sec (%.1fx)\n",
+         t_lexer, n / t_lexer, t_scanf / t_lexer);
+
+  /* Check that both give the same results */
+  rewind(f1);
+  unread_track = prev_track = -1;
+  log_reader_free(lr);
+  rewind(f2);
+  lr = log_reader_new(f2);
+  n = 0;
+  do {
+    t1 = scanf_parse_track(f1, &s1, &p1);
+    t2 = parse_track(lr, &s2, &p2);
+    if (t1 != t2 || s1 != s2 || p1 != p2) {
+      printf("MISMATCH at track %d/%d side %d/%d pass %d/%d\n",
+             t1, t2, s1, s2, p1, p2);
+      return 1;
+    }
+    do {
+      v1 = scanf_parse_sample(f1);
+      v2 = parse_sample(lr);
+      if (v1 != v2) {
+        printf("MISMATCH at sample %ld: %d/%d\n", n, v1, v2);
+        return 1;
+      }
+      n++;
+    } while (v1 != EOF);
+  } while (t1 != EOF);
+  printf("results match\n");
+  return 0;
+}
+
 int
 main(int argc, char **argv)
 {
   int track, side, pass, sample;
   FILE *log_file;
+  log_reader *lr;
 
+  if (argc == 3 && strcmp(argv[1], "-b") == 0) {
+    return benchmark(argv[2]);
+  }
   if (argc != 2) {
-    fprintf(stderr, "usage: %s logfile\n", argv[0]);
+    fprintf(stderr, "usage: %s [-b] logfile\n", argv[0]);
     return 2;
   }
   log_file = fopen(argv[1], "r");
@@ -181,11 +619,12 @@ main(int argc, char **argv)
     perror(argv[1]);
     return 1;
   }
+  lr = log_reader_new(log_file);
   do {
-    track = parse_track(log_file, &side, &pass);
+    track = parse_track(lr, &side, &pass);
     printf("=== track %d, side %d, pass %d ===\n", track, side, pass);
     do {
-      sample = parse_sample(log_file);
+      sample = parse_sample(lr);
       printf("%d ", sample);
     } while (sample != EOF);
     printf("\n");
@@ -17,5 +17,8 @@
  * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
  */
 
-int parse_track(FILE *log_file, int *side, int *pass);
-int parse_sample(FILE *log_file);
+typedef struct log_reader log_reader;
+log_reader *log_reader_new(FILE *log_file);
+void log_reader_free(log_reader *lr);
+int parse_track(log_reader *lr, int *side, int *pass);
+int parse_sample(log_reader *lr);
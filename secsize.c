@@ -19,7 +19,7 @@
  * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
  */
 
-int
+static int
 secsize(int sizecode, int encoding, int maxsize, unsigned int quirk)
 {
   int size;
@@ -0,0 +1,200 @@
+/*
+ * trace.c: Binary trace of the decoder's events.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#if linux
+#include <pthread.h>
+#define HAVE_THREADS 1
+#endif
+#include "trace.h"
+
+#if HAVE_THREADS
+struct trace_sync {
+  pthread_t thread;
+  pthread_mutex_t lock;
+  pthread_cond_t wake;    /* for the writer */
+  pthread_cond_t room;    /* for the producer */
+  int quit;
+};
+#endif
+
+/* Write out what is in the ring up to head */
+static void
+drain(struct trace *t)
+{
+  unsigned long head = __atomic_load_n(&t->head, __ATOMIC_ACQUIRE);
+  unsigned long tail = t->tail;
+  unsigned long n;
+
+  while (tail != head) {
+    /* Up to the end of the ring at most */
+    n = TRACE_RING - (tail & (TRACE_RING - 1));
+    if (n > head - tail) n = head - tail;
+    if (!t->err &&
+	fwrite(&t->ring[tail & (TRACE_RING - 1)], 1, n, t->f) != n) {
+      t->err = errno ? errno : EIO;
+    }
+    tail += n;
+    __atomic_store_n(&t->tail, tail, __ATOMIC_RELEASE);
+  }
+}
+
+#if HAVE_THREADS
+/* Writer thread: drain whenever woken, until told to quit */
+static void *
+writer(void *arg)
+{
+  struct trace *t = (struct trace *) arg;
+  struct trace_sync *s = (struct trace_sync *) t->sync;
+  int quit;
+
+  for (;;) {
+    drain(t);
+    pthread_mutex_lock(&s->lock);
+    pthread_cond_signal(&s->room);
+    /* Sleep unless the producer filled the ring up while draining; it
+       sees asleep after setting head, or this sees the new head */
+    __atomic_store_n(&t->asleep, 1, __ATOMIC_SEQ_CST);
+    while (__atomic_load_n(&t->asleep, __ATOMIC_SEQ_CST) && !s->quit &&
+	   __atomic_load_n(&t->head, __ATOMIC_SEQ_CST) - t->tail
+	   < TRACE_HIGH) {
+      pthread_cond_wait(&s->wake, &s->lock);
+    }
+    t->asleep = 0;
+    quit = s->quit;
+    pthread_mutex_unlock(&s->lock);
+    if (quit) break;
+  }
+  drain(t);
+  return NULL;
+}
+#endif
+
+void
+decode_trace_wake(struct trace *t)
+{
+#if HAVE_THREADS
+  struct trace_sync *s = (struct trace_sync *) t->sync;
+
+  if (s) {
+    pthread_mutex_lock(&s->lock);
+    if (t->asleep) {
+      t->asleep = 0;
+      pthread_cond_signal(&s->wake);
+    }
+    pthread_mutex_unlock(&s->lock);
+  }
+#endif
+}
+
+void
+decode_trace_wait(struct trace *t)
+{
+#if HAVE_THREADS
+  struct trace_sync *s = (struct trace_sync *) t->sync;
+
+  if (s) {
+    pthread_mutex_lock(&s->lock);
+    if (t->asleep) {
+      t->asleep = 0;
+      pthread_cond_signal(&s->wake);
+    }
+    while (t->head - __atomic_load_n(&t->tail, __ATOMIC_ACQUIRE)
+	   > TRACE_RING - TRACE_MAX_EVENT) {
+      pthread_cond_wait(&s->room, &s->lock);
+    }
+    pthread_mutex_unlock(&s->lock);
+    return;
+  }
+#endif
+  drain(t);
+}
+
+struct trace *
+decode_trace_create(const char *name)
+{
+  unsigned char hdr[TRACE_HDR_SIZE];
+  struct trace *t;
+
+  t = (struct trace *) calloc(1, sizeof(struct trace));
+  if (t == NULL) return NULL;
+  t->f = fopen(name, "wb");
+  if (t->f == NULL) {
+    free(t);
+    return NULL;
+  }
+
+  memset(hdr, 0, sizeof(hdr));
+  memcpy(hdr, TRACE_MAGIC, 4);
+  hdr[4] = TRACE_VERSION;
+  if (fwrite(hdr, sizeof(hdr), 1, t->f) != 1) {
+    decode_trace_close(t);
+    return NULL;
+  }
+
+#if HAVE_THREADS
+  {
+    struct trace_sync *s;
+
+    s = (struct trace_sync *) calloc(1, sizeof(struct trace_sync));
+    if (s != NULL) {
+      pthread_mutex_init(&s->lock, NULL);
+      pthread_cond_init(&s->wake, NULL);
+      pthread_cond_init(&s->room, NULL);
+      t->sync = s;
+      if (pthread_create(&s->thread, NULL, writer, t) != 0) {
+	/* Write on the decoder's thread instead */
+	t->sync = NULL;
+	free(s);
+      }
+    }
+  }
+#endif
+  return t;
+}
+
+int
+decode_trace_close(struct trace *t)
+{
+  int err;
+
+#if HAVE_THREADS
+  struct trace_sync *s = (struct trace_sync *) t->sync;
+
+  if (s) {
+    pthread_mutex_lock(&s->lock);
+    s->quit = 1;
+    pthread_cond_signal(&s->wake);
+    pthread_mutex_unlock(&s->lock);
+    pthread_join(s->thread, NULL);
+    free(s);
+  }
+#endif
+  drain(t);
+  err = t->err;
+  if (fclose(t->f) != 0 && !err) err = errno;
+  free(t);
+  if (err) {
+    errno = err;
+    return -1;
+  }
+  return 0;
+}
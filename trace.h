@@ -0,0 +1,189 @@
+/*
+ * trace.h: Binary trace of the decoder's events.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+
+#ifndef _TRACE_H
+#define _TRACE_H
+
+#include <stdio.h>
+
+/*
+ * Everything the decoder can report at message levels 3 through 7 is
+ * an event: a type from the list below and up to two int arguments.
+ * The text the decoder logs for an event is made from the same list
+ * (see decode_event_print), so a trace of the events says everything
+ * a level 7 log would, in a little over half the space (a 2.66 MB
+ * level 7 log of one test capture has a 1.47 MB trace) and much less
+ * time.  A trace is written as the decoder runs, whatever the message
+ * level.
+ *
+ * Each entry is X(type, level, format).  The format takes the
+ * arguments in order; NULL means the event is printed by special
+ * code in decode_event_print.
+ */
+#define TRACE_EVENTS \
+  X(EV_READ,             OUT_TSUMMARY, NULL) /* track, side<<16 | pass */ \
+  X(EV_INDEX_EDGE,       OUT_HEX,     "[index edge %d] ") \
+  X(EV_TRACK_FULL,       OUT_HEX,     "[DMK track buffer full] ") \
+  X(EV_TOO_MANY_AMS,     OUT_ERRORS,  "[too many AMs on track] ") \
+  X(EV_SECOND_IAM,       OUT_IDS,     "[stopping before second IAM] ") \
+  X(EV_MISSING_DAM,      OUT_ERRORS,  "[missing DAM] ") \
+  X(EV_INCOMPLETE_DATA,  OUT_ERRORS,  "[incomplete sector data] ") \
+  X(EV_INCOMPLETE_EXTRA, OUT_ERRORS,  "[incomplete extra data] ") \
+  X(EV_WRAPAROUND,       OUT_ERRORS,  "[wraparound] ") \
+  X(EV_WRAPAROUND_ID,    OUT_IDS,     "[wraparound] ") \
+  X(EV_REUSE,            OUT_ERRORS,  "[reuse %02x] ") \
+  X(EV_USING_CURRENT,    OUT_ERRORS,  "[using current] ") \
+  X(EV_USING_MERGED,     OUT_ERRORS,  "[using merged] ") \
+  X(EV_USING_PREVIOUS,   OUT_ERRORS,  "[using previous] ") \
+  X(EV_ENC_CHANGE,       OUT_ERRORS,  NULL) /* old, new encoding */ \
+  X(EV_BITS_ADDED,       OUT_HEX,     "(+%d)") \
+  X(EV_BITS_DROPPED,     OUT_HEX,     "(-%d)") \
+  X(EV_BAD_CLOCK,        OUT_HEX,     "?") \
+  X(EV_BACKWARD_AM,      OUT_ERRORS,  "[backward AM] ") \
+  X(EV_IAM,              OUT_IDS,     "\n#fc ") \
+  X(EV_IDAM,             OUT_IDS,     "\n#fe ") \
+  X(EV_DAM,              OUT_IDS,     "#%2x ") \
+  X(EV_UNEXPECTED_DAM,   OUT_ERRORS,  "[unexpected DAM] ") \
+  X(EV_DANGLING_PREMARK, OUT_ERRORS,  "[dangling premark] ") \
+  X(EV_ID_CYL,           OUT_IDS,     "cyl=") \
+  X(EV_ID_SIDE,          OUT_IDS,     "side=") \
+  X(EV_ID_SEC,           OUT_IDS,     "sec=") \
+  X(EV_ID_SIZE,          OUT_IDS,     "size=") \
+  X(EV_ID_CRC,           OUT_HEX,     "crc=") \
+  X(EV_GOOD_ID_CRC,      OUT_IDS,     "[good ID CRC] ") \
+  X(EV_BAD_ID_CRC,       OUT_ERRORS,  "[bad ID CRC] ") \
+  X(EV_ID_SECTOR,        OUT_ERRORS,  "%02x ") \
+  X(EV_ID_BYTE,          OUT_IDS,     "%02x ") \
+  X(EV_BYTE,             OUT_HEX,     NULL) /* byte */ \
+  X(EV_GOOD_DATA_CRC,    OUT_IDS,     "[good data CRC] ") \
+  X(EV_BAD_DATA_CRC,     OUT_ERRORS,  "[bad data CRC] ") \
+  X(EV_GOOD_EXTRA_CRC,   OUT_IDS,     "[good extra CRC] ") \
+  X(EV_BAD_EXTRA_CRC,    OUT_ERRORS,  "[bad extra CRC] ") \
+  X(EV_NEWLINE_HEX,      OUT_HEX,     "\n") \
+  X(EV_NEWLINE_IDS,      OUT_IDS,     "\n") \
+  X(EV_SAMPLE,           OUT_SAMPLES, "%d%c ") /* sample, class */ \
+  X(EV_END_OF_DATA,      OUT_HEX,     "[end of data] ") \
+  X(EV_INDEX_ON,         OUT_HEX,     "{") \
+  X(EV_INDEX_OFF,        OUT_HEX,     "}") \
+  X(EV_PAST_FULL,        OUT_SAMPLES, NULL) /* rest is level 7 only... */ \
+  X(EV_PAST_FULL_END,    OUT_SAMPLES, NULL) /* ...up to here */
+
+#define X(type, level, fmt) type,
+enum trace_type { TRACE_EVENTS N_EVENTS };
+#undef X
+
+/*
+ * A trace file is a 16 byte header:
+ *   0   "CWTR"
+ *   4   format version (2)
+ *   5   reserved, 0
+ * followed by the events, packed.  Each event has the index of the
+ * sample being decoded when it happened, counting from 0 at the start
+ * of each read (an EV_READ event marks the start of each read).  Most
+ * events are EV_SAMPLE at the sample after the previous event's, so
+ * these take two bytes:
+ *   0x80 | sample, class
+ * Any other event takes a byte for its type (below 0x80), then three
+ * numbers: the change in sample index from the previous event, as a
+ * signed number, then the two arguments.  Each number is written 7
+ * bits at a time, low bits first, with the top bit set in every byte
+ * but the last; a signed number n is written as (n << 1) ^ (n >> 31).
+ */
+#define TRACE_MAGIC "CWTR"
+#define TRACE_VERSION 2
+#define TRACE_HDR_SIZE 16
+#define TRACE_MAX_EVENT 16  /* bytes */
+
+/*
+ * Events go into a ring buffer that a separate thread drains to the
+ * file.  There is one producer (the decoder using the trace) and one
+ * consumer (the writer), so putting an event takes no lock: the
+ * producer alone advances head and the writer alone advances tail.
+ * The writer sleeps until the ring is half full, or the trace is
+ * closed; the producer wakes it then, and waits for it only if the
+ * ring fills.  Without threads, the producer writes out the ring
+ * itself when it fills.
+ */
+#define TRACE_RING (1 << 20)  /* bytes; must be a power of 2 */
+#define TRACE_HIGH (TRACE_RING / 2)
+
+struct trace {
+  unsigned char ring[TRACE_RING];
+  unsigned long head;     /* bytes put */
+  unsigned long tail;     /* bytes written */
+  unsigned int sample;    /* sample index of the last event put */
+  int asleep;             /* writer waiting for TRACE_HIGH */
+  FILE *f;
+  int err;                /* errno of first write error, or 0 */
+  void *sync;             /* writer thread and its locks, if running */
+};
+
+/* Create a trace file.  Returns NULL on error, with errno set. */
+struct trace *decode_trace_create(const char *name);
+
+/* Write out the events still in the ring and close.  Returns 0 if OK,
+   -1 on error (possibly from an earlier write). */
+int decode_trace_close(struct trace *t);
+
+/* Wait for room in the ring */
+void decode_trace_wait(struct trace *t);
+
+/* Wake the writer */
+void decode_trace_wake(struct trace *t);
+
+static inline unsigned long
+trace_number(struct trace *t, unsigned long h, unsigned int n)
+{
+  while (n >= 0x80) {
+    t->ring[h++ & (TRACE_RING - 1)] = n | 0x80;
+    n >>= 7;
+  }
+  t->ring[h++ & (TRACE_RING - 1)] = n;
+  return h;
+}
+
+/* Add an event */
+static inline void
+trace_put(struct trace *t, unsigned int sample, int type, int a, int b)
+{
+  unsigned long h = t->head;
+  int step = sample - t->sample;
+
+  if (h - __atomic_load_n(&t->tail, __ATOMIC_ACQUIRE) >
+      TRACE_RING - TRACE_MAX_EVENT) {
+    decode_trace_wait(t);
+  }
+  if (type == EV_SAMPLE && step == 1 &&
+      (unsigned int) a < 0x80 && (unsigned int) b < 0x100) {
+    t->ring[h++ & (TRACE_RING - 1)] = 0x80 | a;
+    t->ring[h++ & (TRACE_RING - 1)] = b;
+  } else {
+    t->ring[h++ & (TRACE_RING - 1)] = type;
+    h = trace_number(t, h, ((unsigned int) step << 1) ^ (step >> 31));
+    h = trace_number(t, h, a);
+    h = trace_number(t, h, b);
+  }
+  t->sample = sample;
+  __atomic_store_n(&t->head, h, __ATOMIC_SEQ_CST);
+  if (h - __atomic_load_n(&t->tail, __ATOMIC_RELAXED) >= TRACE_HIGH &&
+      __atomic_load_n(&t->asleep, __ATOMIC_SEQ_CST)) {
+    decode_trace_wake(t);
+  }
+}
+
+#endif /* _TRACE_H */